@@ -0,0 +1,42 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "blend.hpp"
+#include "features.hpp"
+#include "stitch.hpp"
+namespace vc {
+// One image set of a batch manifest
+struct BatchJob {
+    std::string setId, pairId;
+    std::vector<std::string> paths;
+};
+
+// Manifest: one set per line, "<set_id> <pair_id> <img> <img> [...]"; "-" leaves an id empty,
+// relative image paths are taken from the manifest's directory, blank and '#' lines are skipped.
+std::vector<BatchJob> readManifest(const std::string& path);
+
+struct BatchOptions {
+    int jobs = 0;             // sets stitched at once, 0 = sized from cores and memory
+    double memoryMB = -1.0;   // working-set limit of the running sets and the scratch pool, < 0 = half the RAM
+    bool tiff = false;        // per-set panorama.tif (opts.tiffCompression) instead of panorama.jpg
+    bool dzi = false;         // per-set Deep Zoom pyramid instead of panorama.jpg
+};
+
+// Stitches every set in one process on a single shared thread pool. Sets run concurrently on
+// their own threads (their serial stages then overlap); a set starts only once its estimated
+// working set (sized from the image headers, before decoding) fits the memory limit next to the
+// running ones. Outputs go to outDir/<set>_<pair>/ (with the job index appended when the manifest
+// repeats a name), the CSV logs of all sets are appended to outDir/ and a per-set summary goes
+// to outDir/batch.csv.
+// Returns the number of sets that failed.
+int runBatch(const std::vector<BatchJob>& jobs,
+             Detector detector,
+             BlendMode blendMode,
+             int ransacIter,
+             double reprojThresh,
+             double ratio,
+             bool debug,
+             const std::string& outDir,
+             const StitchOptions& opts,
+             const BatchOptions& batch = BatchOptions());
+}
@@ -2,6 +2,8 @@
 #include <opencv2/core.hpp>
 namespace vc {
 enum class BlendMode { OVERLAY, FEATHER };
+// Command-line name: "overlay" or "feather"
+const char* toString(BlendMode b);
 cv::Mat blendOverlay(const cv::Mat& baseImg, const cv::Mat& topImg, const cv::Mat& mask);
 cv::Mat blendFeather(const cv::Mat& baseImg, const cv::Mat& topImg, const cv::Mat& weightMask, double eps=1e-6);
 }
@@ -0,0 +1,48 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+namespace vc {
+// Blocking FIFO with a fixed capacity, used between pipeline stages.
+// push blocks while full; pop blocks while empty and returns false once closed and drained.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(std::size_t capacity) : capacity_(capacity ? capacity : 1) {}
+
+    bool push(T item) {
+        std::unique_lock<std::mutex> lk(mtx_);
+        notFull_.wait(lk, [this]{ return closed_ || items_.size() < capacity_; });
+        if (closed_) return false;
+        items_.push_back(std::move(item));
+        notEmpty_.notify_one();
+        return true;
+    }
+
+    bool pop(T& out) {
+        std::unique_lock<std::mutex> lk(mtx_);
+        notEmpty_.wait(lk, [this]{ return closed_ || !items_.empty(); });
+        if (items_.empty()) return false;
+        out = std::move(items_.front());
+        items_.pop_front();
+        notFull_.notify_one();
+        return true;
+    }
+
+    // No more pushes; consumers drain what is queued
+    void close() {
+        std::lock_guard<std::mutex> lk(mtx_);
+        closed_ = true;
+        notEmpty_.notify_all();
+        notFull_.notify_all();
+    }
+
+private:
+    std::size_t capacity_;
+    std::deque<T> items_;
+    std::mutex mtx_;
+    std::condition_variable notEmpty_, notFull_;
+    bool closed_ = false;
+};
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <vector>
+#include "thread_pool.hpp"
+namespace vc {
+// Inlier correspondences between images a and b, in their own pixel coordinates
+struct PairCorrespondences { int a = -1, b = -1; std::vector<cv::Point2f> ptsA, ptsB; };
+
+struct BundleStats { int iterations = 0; int residuals = 0; double initialRms = 0.0, finalRms = 0.0; double ms = 0.0; };
+
+// Jointly refines every image -> reference homography against all pairwise inlier matches
+// with sparse Levenberg-Marquardt. Each image owns one 8-parameter block (h22 fixed to 1), the
+// reference stays fixed and images with an empty transform are ignored. Residuals and the
+// block-sparse normal equations are evaluated per pair on the pool; huberPx bounds outlier influence.
+// Images flagged in fixed are held like the reference, so a local problem can be solved in place.
+BundleStats refineHomographies(std::vector<cv::Mat>& toRef,
+                               const std::vector<PairCorrespondences>& pairs,
+                               int reference, ThreadPool& pool,
+                               int maxIterations = 30, double huberPx = 3.0,
+                               const std::vector<bool>* fixed = nullptr);
+}
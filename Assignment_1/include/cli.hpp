@@ -0,0 +1,63 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <functional>
+#include <string>
+#include <vector>
+#include "batch.hpp"
+#include "blend.hpp"
+#include "features.hpp"
+#include "stitch.hpp"
+#include "thread_pool.hpp"
+#include "video.hpp"
+namespace vc {
+// Everything the panorama command line can set; shared by the CLI, batch and server modes
+struct CliArgs {
+    Detector detector = Detector::ORB;
+    BlendMode blend = BlendMode::FEATHER;
+    double ratio = 0.75;
+    int ransacIter = 1000;
+    double reprojThresh = 3.0;
+    bool debug = false;
+    StitchOptions opts;
+    bool streamTiff = false, streamDzi = false;
+    std::vector<std::string> paths;
+    std::string videoPath;    // --video: keyframes of this video instead of paths
+    KeyframeOptions keyframes;
+    std::string setId, pairId;
+    std::string outDir;       // run directory, empty = results/run_<timestamp>
+    bool progressive = false; // preview first, full quality afterwards
+    std::string incrementalDir; // --incremental: per-set state kept here between runs
+    std::string tracePath;      // --trace: Chrome trace-event JSON of the whole process
+    bool perfCounters = false;  // --perf-counters: hardware counter columns in the stage tables
+    std::string manifest;     // --batch
+    BatchOptions batch;
+    std::string serveSocket;  // --serve
+    std::string submitSocket; // --submit
+};
+
+void printUsage();
+// Applies command-line tokens on top of args. Unknown flags are ignored; bare tokens are images.
+// Throws std::invalid_argument for an unknown --select method, --tiff compression, --dzi tile
+// format or --metrics format, or a malformed number.
+void parseArgs(const std::vector<std::string>& tokens, CliArgs& args);
+// results/<prefix>_YYYYmmdd_HHMMSS
+std::string timestampedRunDir(const std::string& prefix);
+
+// Outcome of one stitch driven by CliArgs
+struct RunResult {
+    bool ok = false;
+    std::string error;   // why it failed
+    std::string output;  // panorama.jpg, panorama.tif or panorama.dzi
+    std::string outDir;
+    cv::Size size;       // of the returned panorama (0 x 0 for streamed outputs)
+    double wallMs = 0.0;
+    double peakRssMB = 0.0;  // of the whole process once the run finished
+    std::string previewPath; // progressive mode
+    double previewMs = 0.0;
+};
+// Loads args.paths (or the keyframes of args.videoPath), stitches them on pool into args.outDir
+// and writes the panorama. With args.progressive a low-resolution preview (outDir/preview.jpg) is
+// stitched alongside the full job and handed to onPreview as soon as it exists.
+RunResult runStitch(const CliArgs& args, ThreadPool& pool,
+                    const std::function<void(const RunResult&)>& onPreview = nullptr);
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <vector>
+#include "blend.hpp"
+#include "perf_counters.hpp"
+#include "sink.hpp"
+#include "thread_pool.hpp"
+#include "warp.hpp"
+namespace vc {
+// Per-image statistics of the compositing pass
+struct ComposeStats {
+    double warpMs = 0.0; double blendMs = 0.0; double seamMean = 0.0; double seamMax = 0.0;
+    PerfCounts warpPerf, blendPerf; // hardware counters, when perf::enabled()
+};
+
+// One image warped into its own window (roi) of the reference frame, with its feather weights
+struct WarpedTile { cv::Rect roi; cv::Mat img; cv::Mat weight; double warpMs = 0.0; PerfCounts warpPerf; };
+
+// Integer bounding box of an image of size sz after mapping it with H
+cv::Rect warpedBounds(cv::Size sz, const cv::Mat& H);
+// Bounding box of all images in the reference frame; toRef[i] maps image i into it
+cv::Rect panoramaBounds(const std::vector<cv::Mat>& imgs, const std::vector<cv::Mat>& toRef);
+
+WarpedTile warpTile(const cv::Mat& img, const cv::Mat& toRef, Interp interp = Interp::BILINEAR);
+
+// Allocates one canvas covering panoramaBounds and warps + blends every image into it exactly once
+cv::Mat composePanorama(const std::vector<cv::Mat>& imgs, const std::vector<cv::Mat>& toRef, BlendMode mode,
+                        std::vector<ComposeStats>* stats = nullptr, Interp interp = Interp::BILINEAR);
+// Same for images that were already warped, e.g. by a pipeline stage; tiles are blended in order
+cv::Mat composeTiles(const std::vector<WarpedTile>& tiles, BlendMode mode,
+                     std::vector<ComposeStats>* stats = nullptr);
+// The composite restricted to region of the reference frame: only images whose footprint meets
+// it are warped (rows and columns inside it only, in parallel), so any window of the panorama
+// can be rebuilt on its own
+cv::Mat composeRegion(const std::vector<cv::Mat>& imgs, const std::vector<cv::Mat>& toRef, BlendMode mode,
+                      const cv::Rect& region, ThreadPool& pool);
+// Streams the same composite into sink in bands of bandRows rows, top to bottom. Each band warps
+// only the rows of the images it intersects (in parallel on the pool), so memory is bounded by
+// the band rather than the panorama. Seam statistics are aggregated over all bands.
+void composeToSink(const std::vector<cv::Mat>& imgs, const std::vector<cv::Mat>& toRef, BlendMode mode,
+                   PanoramaSink& sink, ThreadPool& pool, int bandRows = 512,
+                   std::vector<ComposeStats>* stats = nullptr);
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bounded_queue.hpp"
+namespace vc {
+// One aligned pair as the debug images show it: the direct neighbour (a) and the new image (b)
+// in their own coordinates, with matches a -> b. Images are shared headers, nothing is copied.
+struct PairViz {
+    size_t index = 0; // of the new image, used in the file names
+    cv::Mat imgA, imgB;
+    std::vector<cv::KeyPoint> kpsA, kpsB;
+    std::vector<cv::DMatch> matches;
+};
+
+// Renders and writes the --debug images on its own worker threads, so drawing and JPEG encoding
+// stay off the stitching path. Jobs wait in a bounded queue (submitting blocks while it is full,
+// which bounds the memory held by pending images). With scale < 1 inputs and keypoints are
+// downscaled before drawing. The destructor waits for every queued image to be written.
+class DebugVizWriter {
+public:
+    DebugVizWriter(const std::string& dir, int threads = 1, double scale = 1.0, size_t queueDepth = 8);
+    ~DebugVizWriter();
+    DebugVizWriter(const DebugVizWriter&) = delete;
+    DebugVizWriter& operator=(const DebugVizWriter&) = delete;
+
+    // kps_<i>_a/b, matches_<i>, matches_annotated_<i> (ratio-test survivors)
+    void matches(PairViz pv);
+    // inliers_<i>, inliers_annotated_<i> (RANSAC inliers; pv.matches index pv.kpsA/kpsB pairwise)
+    void inliers(PairViz pv);
+
+private:
+    void submit(std::function<void()> job);
+    void write(const std::string& stem, const cv::Mat& img) const;
+    PairViz scaled(const PairViz& pv) const;
+
+    std::string dir_;
+    double scale_;
+    BoundedQueue<std::function<void()>> jobs_;
+    std::vector<std::thread> workers_;
+};
+}
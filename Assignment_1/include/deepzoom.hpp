@@ -0,0 +1,48 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <string>
+#include <utility>
+#include <vector>
+#include "sink.hpp"
+#include "thread_pool.hpp"
+namespace vc {
+enum class TileFormat { JPEG, WEBP };
+
+// Writes a Deep Zoom pyramid (basePath.dzi + basePath_files/<level>/<col>_<row>.<ext>) while the
+// panorama streams in. Each level keeps only the rows of its current tile row; completed rows are
+// halved with a 2x2 box filter (INTER_AREA) into the level below, so every level is built in the
+// same pass. Tiles are encoded in parallel batches on the pool.
+class DeepZoomWriter : public PanoramaSink {
+public:
+    DeepZoomWriter(const std::string& basePath, ThreadPool& pool, int tileSize = 256, int overlap = 1,
+                   TileFormat format = TileFormat::JPEG, int quality = 90);
+
+    void begin(cv::Size size) override;
+    void writeBand(int y, const cv::Mat& band) override;
+    void finish() override;
+
+    int tilesWritten() const { return tilesWritten_; }
+
+private:
+    struct Level {
+        cv::Size size;
+        cv::Mat buf;      // rows [bufY, bufY + buf.rows) of this level
+        int bufY = 0;
+        int tileRow = 0;  // next tile row to emit
+        cv::Mat oddRow;   // unpaired row waiting for its partner before downsampling
+    };
+    void pushRows(int level, const cv::Mat& rows, bool last);
+    void emitTiles(int level);
+    void flushJobs();
+
+    std::string basePath_;
+    ThreadPool& pool_;
+    int tileSize_, overlap_;
+    TileFormat format_;
+    int quality_;
+    cv::Size size_;
+    std::vector<Level> levels_; // indexed by DZI level, the last one is full resolution
+    std::vector<std::pair<std::string, cv::Mat>> jobs_;
+    int tilesWritten_ = 0;
+};
+}
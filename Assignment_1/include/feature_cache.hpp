@@ -0,0 +1,32 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <string>
+#include "features.hpp"
+namespace vc {
+// Content-addressed on-disk cache of detect + describe results, one file per entry under dir.
+// Entries are keyed by the image pixels, the detection mask, the detector and its parameters,
+// the OpenCV version and the file format version, so a changed input or setting is a miss.
+//
+// File layout (little-endian, every section 64-byte aligned):
+//   header | x | y | size | angle | response (float[n]) | octave | class_id (int32[n]) | descriptors
+// Loading maps the file: descriptors are a view straight into the mapping, keypoints are
+// assembled from the SoA arrays. Entries are written to a temporary file and renamed, so
+// concurrent runs sharing a directory only ever see complete files.
+class FeatureCache {
+public:
+    explicit FeatureCache(const std::string& dir);
+
+    // 128-bit hex digest identifying the entry
+    static std::string key(const cv::Mat& img, Detector d, const cv::Mat& mask = cv::Mat(),
+                           const KeypointSelection& sel = KeypointSelection());
+    // False when the entry is missing or invalid (truncated, other version or byte order)
+    bool load(const std::string& key, KPDesc& out) const;
+    bool store(const std::string& key, const KPDesc& f) const;
+
+    const std::string& dir() const { return dir_; }
+
+private:
+    std::string pathFor(const std::string& key) const;
+    std::string dir_;
+};
+}
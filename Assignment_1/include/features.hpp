@@ -1,10 +1,63 @@
 #pragma once
 #include <opencv2/core.hpp>
 #include <opencv2/features2d.hpp>
+#include <string>
 #include <vector>
+#include "thread_pool.hpp"
 namespace vc {
+enum class Detector { SIFT, ORB, AKAZE };
 struct KPDesc { std::vector<cv::KeyPoint> kps; cv::Mat desc; };
 KPDesc detectSIFT(const cv::Mat& img);
 KPDesc detectORB(const cv::Mat& img);
 KPDesc detectAKAZE(const cv::Mat& img);
+
+cv::Ptr<cv::Feature2D> createDetector(Detector d);
+// Detector type and every parameter createDetector builds it with, for cache keys
+std::string detectorSignature(Detector d);
+// Command-line name: "sift", "orb" or "akaze"
+const char* toString(Detector d);
+
+// Keypoint selection between detection and description. Detectors cluster keypoints in textured
+// regions; thinning them to an evenly spread subset cuts description, matching and RANSAC cost
+// without losing geometric support.
+enum class KeypointSelect { NONE, ANMS, GRID };
+struct KeypointSelection {
+    KeypointSelect method = KeypointSelect::NONE;
+    int maxKeypoints = 2000; // survivors per image
+    int gridCells = 8;       // GRID: cells along the longer image side
+};
+// "none", "anms:<max>" or "grid:<max>:<cells>": every setting that changes the selected keypoints
+std::string toString(const KeypointSelection& sel);
+// Indices of the selected keypoints, in detector order. ANMS keeps every keypoint whose nearest
+// stronger survivor is farther than a suppression radius, the radius chosen by bisection so that
+// at most maxKeypoints survive. GRID keeps the strongest per cell, then fills up with the
+// strongest of the rest. Sets that are small enough already are returned whole.
+std::vector<int> selectKeypoints(const std::vector<cv::KeyPoint>& kps, cv::Size imgSize, const KeypointSelection& sel);
+
+// Detection and description timings of one image
+struct DetectStats {
+    double detectMs = 0.0;
+    double describeMs = 0.0;
+    int cache = -1;        // feature cache: -1 not used, 0 miss, 1 hit
+    double cacheMs = 0.0;  // key hashing plus entry load or store
+    int detected = -1;     // keypoints before selection, -1 when not detected (cache hit)
+};
+class FeatureCache;
+// Detect + describe one image with a detector borrowed from a process-wide set of idle instances
+// (reused across calls and threads, never shared by two at once); a non-empty mask restricts
+// detection to its non-zero pixels. Only keypoints that survive sel are described.
+KPDesc describeImage(const cv::Mat& img, Detector d, DetectStats* stats = nullptr,
+                     const cv::Mat& mask = cv::Mat(), const KeypointSelection& sel = KeypointSelection());
+// describeImage through the cache: a hit skips detection, a miss stores the result. A null
+// cache is a plain describeImage call.
+KPDesc describeCached(const FeatureCache* cache, const cv::Mat& img, Detector d,
+                      DetectStats* stats = nullptr, const cv::Mat& mask = cv::Mat(),
+                      const KeypointSelection& sel = KeypointSelection());
+// Detects and describes every image concurrently on the pool. Each call borrows its own
+// detector instance and OpenCV's internal threading is capped while the stage runs.
+std::vector<KPDesc> extractFeatures(const std::vector<cv::Mat>& imgs, Detector d, ThreadPool& pool,
+                                    std::vector<DetectStats>* stats = nullptr,
+                                    const std::vector<cv::Mat>* masks = nullptr,
+                                    const FeatureCache* cache = nullptr,
+                                    const KeypointSelection& sel = KeypointSelection());
 }
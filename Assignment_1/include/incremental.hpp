@@ -0,0 +1,43 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+#include "blend.hpp"
+#include "features.hpp"
+#include "stitch.hpp"
+#include "thread_pool.hpp"
+namespace vc {
+struct IncrementalStats {
+    bool fresh = false;       // no usable state: every image was treated as new
+    int reused = 0;           // images taken over from the state
+    int added = 0;            // new images
+    int placed = 0;           // new images that could be aligned
+    int recovered = 0;        // stored images left unplaced by an earlier run, placed now
+    int pairsMatched = 0;
+    int tiles = 0;            // canvas tiles with content
+    int tilesRecomposed = 0;
+    double ms = 0.0;
+};
+
+// Stitches the images at paths while keeping the per-set state in stateDir: per-image features
+// (a FeatureCache), thumbnails, transforms, pairwise inliers and the composite as fixed-size
+// canvas tiles. When the stored images are a prefix of paths, only the additions are processed:
+// each new image is matched against its likely neighbours (thumbnail phase correlation over the
+// placed images, the latest ones as fallback), placed through its best pair, and the transforms
+// of it and its matched neighbours are re-optimised with everything else held fixed. Only the
+// canvas tiles touched by an image that moved or was added are recomposited; the panorama is then
+// assembled from the stored tiles. Any other change to the set (or detector, blend, keypoint
+// selection, matching parameters or megapixel budgets) starts afresh. Images that could not be
+// placed are kept and retried on every run, once new images may connect them.
+cv::Mat stitchIncremental(const std::vector<std::string>& paths,
+                          Detector detector,
+                          BlendMode blendMode,
+                          int ransacIter,
+                          double reprojThresh,
+                          double ratio,
+                          const std::string& stateDir,
+                          const std::string& outDir,
+                          const StitchOptions& opts,
+                          ThreadPool& pool,
+                          IncrementalStats* stats = nullptr);
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+#include "thread_pool.hpp"
+namespace vc {
+// Baseline JPEG of a CV_8UC3 (BGR) image with 4:2:0 chroma subsampling and the standard
+// Huffman tables, i.e. libjpeg's (and so cv::imwrite's) defaults. Every MCU row is its own
+// restart interval, so strips of MCU rows are entropy coded in parallel on the pool and
+// concatenated. Returns false for other types or images beyond the 65535 px JPEG limit.
+bool encodeJpeg(const cv::Mat& img, int quality, ThreadPool& pool, std::vector<uchar>& out);
+bool writeJpeg(const std::string& path, const cv::Mat& img, int quality, ThreadPool& pool);
+}
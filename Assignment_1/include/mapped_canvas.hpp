@@ -0,0 +1,41 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <string>
+#include "sink.hpp"
+namespace vc {
+// A Mat whose pixels live in a memory-mapped sparse file created exclusively as path plus a
+// random suffix (unlinked once mapped, so it disappears with the last reference). Pages never written take no disk space; paging is
+// left to the kernel. Falls back to an ordinary Mat where mmap is unavailable.
+cv::Mat allocateMapped(cv::Size size, int type, const std::string& path);
+// Whole file mapped copy-on-write as a 1 x N CV_8U Mat (empty if it cannot be mapped). The
+// mapping lives as long as the Mat or any view of it.
+cv::Mat mapFile(const std::string& path);
+// rows x cols Mat of type at byte offset inside owner's data, sharing owner's buffer lifetime
+cv::Mat viewOf(const cv::Mat& owner, size_t offset, int rows, int cols, int type);
+// Installed RAM in bytes, 0 if unknown
+size_t physicalMemoryBytes();
+
+// Panorama canvas on top of allocateMapped, filled band by band and accessed in row-aligned
+// tiles. All-black tiles are never touched, written tiles are released from the resident set
+// (madvise) and finish() flushes the mapping (msync).
+class MappedCanvas : public PanoramaSink {
+public:
+    explicit MappedCanvas(const std::string& path, int tileRows = 64);
+
+    void begin(cv::Size size) override;
+    void writeBand(int y, const cv::Mat& band) override;
+    void finish() override;
+
+    int tileCount() const { return (canvas_.rows + tileRows_ - 1) / tileRows_; }
+    cv::Mat tile(int t) const; // rows of tile t, a header into the mapping
+    cv::Mat mat() const { return canvas_; }
+    // Bounding box of the pixels brighter than 1 (as the auto-crop threshold) written so far
+    cv::Rect contentBounds() const;
+
+private:
+    std::string path_;
+    int tileRows_;
+    cv::Mat canvas_;
+    int x0_ = 0, y0_ = 0, x1_ = -1, y1_ = -1;
+};
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <utility>
+#include <vector>
+#include "features.hpp"
+#include "matching.hpp"
+#include "overlap.hpp"
+#include "perf_counters.hpp"
+#include "thread_pool.hpp"
+namespace vc {
+// Verified matches between images i < j; H maps image j into image i
+struct PairMatch {
+    int i = -1, j = -1;
+    std::vector<Match> matches;
+    std::vector<unsigned char> inlierMask;
+    int rawMatches = 0;
+    int inliers = 0;
+    cv::Mat H;
+    double matchMs = 0.0, filterMs = 0.0, ransacMs = 0.0;
+    double distMean = 0.0, distStd = 0.0, avgReprojError = 0.0;
+    PerfCounts matchPerf, ransacPerf; // match + ratio test, RANSAC
+};
+
+// Matches and verifies the candidate pairs in parallel on the pool. With seeds (one per pair),
+// matching is guided by the predicted translation instead of searching all descriptors.
+std::vector<PairMatch> matchPairs(const std::vector<KPDesc>& feats,
+                                  const std::vector<std::pair<int,int>>& pairs,
+                                  Distance distType, double ratio,
+                                  int ransacIter, double thresh,
+                                  ThreadPool& pool,
+                                  const std::vector<OverlapEstimate>* seeds = nullptr);
+
+// Builds the inlier-weighted graph over pairs with at least minInliers, takes its maximum
+// spanning tree and picks the most central image as reference. Returns image -> reference
+// transforms (empty for images outside the reference's component); order receives the
+// breadth-first placement order starting at the reference.
+std::vector<cv::Mat> spanningTreeTransforms(int numImages, const std::vector<PairMatch>& pairs,
+                                            int minInliers, std::vector<int>& order);
+}
@@ -14,5 +14,11 @@ struct Match { int queryIdx; int trainIdx; double dist; };
 std::vector<Match> bruteForceMatch(const cv::Mat& desc1, const cv::Mat& desc2, Distance distType);
 std::vector<std::pair<Match, Match>> bruteForceMatchKNN(const cv::Mat& desc1, const cv::Mat& desc2, Distance distType, int k);
 
+// 2-NN restricted to a spatial window: query i only considers train rows whose point lies within
+// radius of pts1[i] - offset, i.e. where pts2 + offset is expected to land near pts1
+std::vector<std::pair<Match, Match>> guidedMatchKNN(const cv::Mat& desc1, const std::vector<cv::Point2f>& pts1,
+                                                    const cv::Mat& desc2, const std::vector<cv::Point2f>& pts2,
+                                                    cv::Point2d offset, double radius, Distance distType);
+
 std::vector<Match> ratioTest(const std::vector<std::pair<Match,Match>>& knn, double ratio);
 }
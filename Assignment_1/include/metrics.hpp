@@ -0,0 +1,121 @@
+#pragma once
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+namespace vc {
+enum class MetricsFormat { CSV, JSONL, BINARY };
+
+// Column of a metrics table; precision is the number of decimals of a real value in text output
+struct MetricColumn { const char* name; int precision; };
+// A table is written to <dir>/<name>.<csv|jsonl|bin>. A series table holds one vector of
+// numbers per record and is rewritten by every record instead of appended to.
+struct MetricTable {
+    const char* name;
+    std::vector<MetricColumn> columns;
+    bool series = false;
+};
+
+// Interned string: run ids, detector names, directories are stored once and referenced by id
+struct Sym { uint32_t id = 0; };
+
+struct MetricValue {
+    enum Kind : uint8_t { INT, REAL, SYM } kind = INT;
+    union { int64_t i; double d; uint32_t sym; };
+    MetricValue() : i(0) {}
+    MetricValue(int v) : kind(INT), i(v) {}
+    MetricValue(unsigned v) : kind(INT), i(v) {}
+    MetricValue(long v) : kind(INT), i(v) {}
+    MetricValue(long long v) : kind(INT), i(v) {}
+    MetricValue(unsigned long v) : kind(INT), i(static_cast<int64_t>(v)) {}
+    MetricValue(unsigned long long v) : kind(INT), i(static_cast<int64_t>(v)) {}
+    MetricValue(bool v) : kind(INT), i(v ? 1 : 0) {}
+    MetricValue(double v) : kind(REAL), d(v) {}
+    MetricValue(Sym s) : kind(SYM), sym(s.id) {}
+};
+
+constexpr size_t kMaxMetricFields = 24;
+
+struct MetricRecord {
+    const MetricTable* table = nullptr;
+    Sym dir;
+    MetricsFormat format = MetricsFormat::CSV;
+    uint8_t count = 0;
+    std::array<MetricValue, kMaxMetricFields> values;
+    std::vector<double> series;
+};
+
+// Process-wide metrics sink. Producers put typed records into a fixed in-memory ring: no
+// formatting, no file-system calls, only a short lock (and a wait while the ring is full).
+// A background writer drains the ring in batches, formats the records and appends them to
+// their tables, keeping the files open between batches. Rows of concurrent runs sharing a
+// directory (batch mode, the daemon) are serialised by construction.
+//
+// Binary tables: "VCMT" magic, uint16 version, uint16 byte-order mark 0xFEFF, uint16 column
+// count, per column a length-prefixed name and the precision; then tagged entries in host byte
+// order: 'S' uint32 id, uint16 length, bytes (defines a symbol before its first use in the file)
+// and 'R' one row as per value a kind byte (0 int64, 1 double, 2 uint32 symbol) and the value.
+// Binary series: "VCMS" magic, uint16 version, uint16 0xFEFF, uint64 count, double[count].
+class MetricsSink {
+public:
+    static MetricsSink& instance();
+    ~MetricsSink();
+    MetricsSink(const MetricsSink&) = delete;
+    MetricsSink& operator=(const MetricsSink&) = delete;
+
+    Sym intern(const std::string& s);
+
+    template <typename... Args>
+    void record(const MetricTable& table, Sym dir, MetricsFormat format, Args... args) {
+        static_assert(sizeof...(Args) <= kMaxMetricFields, "too many metric fields");
+        MetricRecord r;
+        r.table = &table;
+        r.dir = dir;
+        r.format = format;
+        r.count = static_cast<uint8_t>(sizeof...(Args));
+        size_t k = 0;
+        ((r.values[k++] = MetricValue(args)), ...);
+        push(std::move(r));
+    }
+    void recordSeries(const MetricTable& table, Sym dir, MetricsFormat format, std::vector<double> values);
+
+    // Blocks until everything recorded before the call is written and flushed to the files
+    void flush();
+
+private:
+    MetricsSink();
+    void push(MetricRecord&& r);
+    void writerLoop();
+    void write(const MetricRecord& r);
+    std::string symbol(uint32_t id);
+
+    struct OpenTable { std::ofstream ofs; std::vector<bool> defined; };
+
+    std::vector<MetricRecord> ring_;
+    size_t head_ = 0, size_ = 0;
+    uint64_t pushed_ = 0, written_ = 0;
+    bool flushRequested_ = false, stop_ = false;
+    std::mutex mtx_;
+    std::condition_variable notEmpty_, notFull_, drained_;
+
+    std::deque<std::string> symbols_;
+    std::unordered_map<std::string, uint32_t> symbolIds_;
+    std::mutex symMtx_;
+
+    std::map<std::string, std::unique_ptr<OpenTable>> files_; // writer thread only
+    std::thread writer_;
+};
+
+inline MetricsSink& metrics() { return MetricsSink::instance(); }
+
+bool parseMetricsFormat(const std::string& s, MetricsFormat& out);
+const char* toString(MetricsFormat f);
+}
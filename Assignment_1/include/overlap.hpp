@@ -0,0 +1,31 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <utility>
+#include <vector>
+#include "thread_pool.hpp"
+namespace vc {
+// Coarse placement of image j relative to image i (i < j) from thumbnail phase correlation;
+// a point p in image j lies near p + shift in image i
+struct OverlapEstimate {
+    int i = -1, j = -1;
+    cv::Point2d shift;
+    double response = 0.0; // phase correlation peak
+    double ncc = 0.0;      // thumbnail correlation over the predicted overlap
+    double overlap = 0.0;  // overlap area over the smaller image's area
+    double radius = 0.0;   // search radius (px) around the prediction for guided matching
+    double ms = 0.0;
+    bool valid = false;
+};
+
+// Phase-correlates thumbnails (longest side thumbSide px) of every candidate pair in parallel.
+// Pairs with a weak peak, poor correlation or too little overlap are marked invalid.
+std::vector<OverlapEstimate> estimateOverlaps(const std::vector<cv::Mat>& imgs,
+                                              const std::vector<std::pair<int,int>>& pairs,
+                                              ThreadPool& pool, int thumbSide = 256,
+                                              double minResponse = 0.05, double minNcc = 0.3,
+                                              double minOverlap = 0.05);
+
+// Per-image detection masks covering the union of predicted overlaps, grown by each estimate's
+// search radius. Images without a valid estimate get an empty mask (no restriction).
+std::vector<cv::Mat> overlapMasks(const std::vector<cv::Mat>& imgs, const std::vector<OverlapEstimate>& est);
+}
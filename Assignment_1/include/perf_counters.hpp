@@ -0,0 +1,29 @@
+#pragma once
+#include <cstdint>
+namespace vc {
+// Hardware counter deltas of one measured section; -1 = not measured or not available
+struct PerfCounts {
+    int64_t cycles = -1, instructions = -1, l1dMisses = -1, llcMisses = -1, branchMisses = -1;
+    PerfCounts& operator+=(const PerfCounts& o);
+};
+
+// Linux perf_event_open counters of the calling thread. Each thread opens its own counter
+// group on first use and keeps it, so a section is measured where it runs, on a pool worker
+// as well as on the calling thread, and rows of concurrent work are not mixed up. Counting
+// is user space only (works with perf_event_paranoid <= 2); counts are scaled when the
+// kernel multiplexes the group. Switched off by default: a measurement costs two read()s.
+namespace perf {
+void setEnabled(bool on);
+bool enabled();
+
+class Section {
+public:
+    Section();
+    // Counts since construction, all -1 when disabled or unsupported
+    PerfCounts stop();
+private:
+    bool active_;
+    uint64_t start_[8];
+};
+}
+}
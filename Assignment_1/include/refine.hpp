@@ -0,0 +1,12 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <vector>
+namespace vc {
+// Guided full-resolution refinement of one correspondence set. For every pair, a patch around
+// ptsA[k] in grayA is searched for in grayB within `radius` px of its prediction H_ab * ptsA[k];
+// ptsB[k] moves to the sub-pixel correlation peak when the match is confident.
+// Returns the number of refined correspondences.
+int refineCorrespondences(const cv::Mat& grayA, const cv::Mat& grayB, const cv::Mat& H_ab,
+                          const std::vector<cv::Point2f>& ptsA, std::vector<cv::Point2f>& ptsB,
+                          int patch = 21, int radius = 8, double minScore = 0.8);
+}
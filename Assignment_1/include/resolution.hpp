@@ -0,0 +1,13 @@
+#pragma once
+#include <opencv2/core.hpp>
+namespace vc {
+// Scale that brings an image of this size down to `megapix` megapixels (never upscales);
+// <= 0 keeps full resolution
+double scaleForBudget(cv::Size size, double megapix);
+// Size of an image resized by scaleForBudget's factor s
+cv::Size scaledSize(cv::Size size, double s);
+// Expresses a homography between images registered at one scale at a scale k times larger
+cv::Mat rescaleHomography(const cv::Mat& H, double k);
+// img shrunk by s with area averaging; the input itself (no copy) when s >= 1
+cv::Mat resized(const cv::Mat& img, double s);
+}
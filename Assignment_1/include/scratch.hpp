@@ -0,0 +1,28 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <cstddef>
+namespace vc {
+// Process-wide pool for the large temporaries of compositing (warped tiles, feather weights,
+// band canvases and accumulators, seam and blend intermediates). Buffers of 1 MB and more are
+// rounded up to a power of two and, when their last Mat is released, parked on the free list of
+// that size class, so the next temporary of a similar size reuses pages that are already faulted
+// in instead of going back to malloc and mmap. Smaller buffers go to the default allocator.
+struct ScratchStats {
+    size_t hits = 0, misses = 0;  // allocations served from a free list / from malloc
+    size_t retainedBytes = 0;     // parked on the free lists right now
+    size_t peakRetainedBytes = 0;
+};
+
+// Mat of size and type backed by the pool; the contents are undefined
+cv::Mat scratchMat(cv::Size size, int type);
+// Empty Mat that draws from the pool when an OpenCV function creates it as its output
+cv::Mat scratchMat();
+// Bytes the free lists may hold (default 1 GB); lowering it frees the excess right away
+void setScratchLimit(size_t bytes);
+// Frees every parked buffer
+void trimScratch();
+ScratchStats scratchStats();
+
+// Peak resident set size of the process in bytes, 0 if unknown
+size_t peakRssBytes();
+}
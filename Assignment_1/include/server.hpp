@@ -0,0 +1,27 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "cli.hpp"
+namespace vc {
+// Stitching daemon on a Unix domain socket. The thread pool, the idle detector instances
+// and the feature cache directory live for the whole process, so a request only pays for its
+// own work. A fixed set of request workers (defaults.batch.jobs, default 2) take connections in
+// turn from a queue; every request gets its own run directory under results/serve_<timestamp>/
+// unless it passes --out. The socket is created mode 0600. Input paths resolve against the
+// client's directory, but everything a request writes (--out, --feature-cache, --incremental)
+// must be a relative path without ".." and lands under the daemon's run directory; --set and
+// --pair must be plain names. Process-wide flags (--threads, --trace, --perf-counters, --batch,
+// --jobs, --batch-mem-mb, --serve) are refused with an error reply.
+//
+// Protocol, one request per connection:
+//   request: one line of tab-separated tokens; the client's working directory, then panorama
+//            command-line tokens (applied on top of the daemon's defaults), or "--shutdown"
+//   reply:   one JSON line {"ok","error","output","run_dir","width","height","queue_ms","wall_ms"},
+//            preceded for --progressive requests by the same for the preview with "preview":true
+// Returns the process exit code once a shutdown request has been served.
+int serve(const std::string& socketPath, const CliArgs& defaults);
+
+// Client side: sends the tokens from the current directory, prints the reply and returns 0 when
+// the job succeeded
+int submit(const std::string& socketPath, const std::vector<std::string>& tokens);
+}
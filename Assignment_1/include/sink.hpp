@@ -0,0 +1,14 @@
+#pragma once
+#include <opencv2/core.hpp>
+namespace vc {
+// Receives a panorama top to bottom in row bands, so the whole image never has to exist at once
+class PanoramaSink {
+public:
+    virtual ~PanoramaSink() = default;
+    virtual void begin(cv::Size size) = 0;
+    // Rows [y, y + band.rows) as CV_8UC3, in order. The sink may keep a reference to band,
+    // so callers hand over a fresh Mat for every band.
+    virtual void writeBand(int y, const cv::Mat& band) = 0;
+    virtual void finish() = 0;
+};
+}
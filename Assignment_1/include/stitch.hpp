@@ -3,8 +3,77 @@
 #include <string>
 #include <vector>
 #include "blend.hpp"
+#include "bundle.hpp"
+#include "compose.hpp"
+#include "features.hpp"
+#include "feature_cache.hpp"
+#include "tiff_writer.hpp"
+#include "deepzoom.hpp"
+#include "thread_pool.hpp"
+#include "metrics.hpp"
 namespace vc {
-enum class Detector { SIFT, ORB, AKAZE };
+// Structured results of one stitchImages call, for library callers that want numbers rather
+// than metrics files. Times are in milliseconds, transforms at input resolution.
+struct ImageReport {
+    bool placed = false;
+    cv::Mat toRef;            // input image -> reference frame (before cropping), empty when not placed
+    int keypoints = 0;
+    double detectMs = 0.0, describeMs = 0.0;
+    int cache = -1;           // feature cache: -1 off, 0 miss, 1 hit
+};
+struct PairReport {
+    int a = -1, b = -1;       // b aligned against a; sequential sets match b against the previous neighbours
+    int rawMatches = 0, keptMatches = 0, inliers = 0;
+    double matchMs = 0.0, filterMs = 0.0, ransacMs = 0.0;
+    double avgReprojError = 0.0;
+    cv::Mat H;                // work-scale homography b -> a (sequential: b -> reference), empty when RANSAC failed
+};
+struct StitchReport {
+    std::vector<ImageReport> images; // one per input
+    std::vector<PairReport> pairs;
+    std::vector<int> order;          // placement order, reference first
+    std::vector<BundleStats> bundle; // one per bundle adjustment run (work scale, then full resolution)
+    std::vector<ComposeStats> compose;
+    double workScale = 1.0, composeScale = 1.0;
+    cv::Size size;                   // panorama size before cropping
+    double alignMs = 0.0, composeMs = 0.0, totalMs = 0.0;
+    size_t peakRssBytes = 0;         // of the whole process, at the end of the call
+};
+
+// Pipeline knobs beyond the classic positional parameters
+struct StitchOptions {
+    bool unordered = false;    // match all pairs and place images along a maximum spanning tree
+    int minInliers = 16;       // unordered mode: pairs with fewer inliers are not connected
+    int threads = 0;           // worker threads, 0 = one per hardware thread
+    bool pipelined = false;    // sequential mode: overlap extraction, alignment and warping of consecutive images
+    bool bundleAdjust = false; // jointly refine all transforms against every pairwise inlier
+    int bundleIterations = 30; // Levenberg-Marquardt iteration cap
+    double workMegapix = -1.0;    // registration resolution budget, <= 0 keeps full resolution
+    double composeMegapix = -1.0; // warping/blending resolution budget, <= 0 keeps full resolution
+    bool refineFullRes = false;   // re-localise work-scale inliers on the inputs and re-optimise
+    bool overlapPrepass = false;  // phase-correlate thumbnails first: prune pairs, mask detection, guide matching
+    int prepassPx = 256;          // thumbnail size (longest side) of the pre-pass
+    std::string tiffPath;         // stream the panorama into this BigTIFF instead of returning it
+    TiffCompression tiffCompression = TiffCompression::DEFLATE;
+    int bandRows = 512;           // rows composited per band when streaming
+    std::string dziPath;          // stream a Deep Zoom tile pyramid (dziPath.dzi + dziPath_files/) instead
+    int dziTileSize = 256;
+    TileFormat dziFormat = TileFormat::JPEG;
+    bool mappedCanvas = false;    // always composite into a file-backed memory-mapped canvas
+    double canvasBudgetMB = -1.0; // in-memory canvas limit before switching to it, < 0 = half the RAM
+    KeypointSelection keypoints;  // thin detections (ANMS or grid) before they are described
+    std::string featureCacheDir;  // reuse detect/describe results stored here across runs, empty = off
+    const FeatureCache* featureCache = nullptr; // already opened cache, takes precedence over featureCacheDir
+    ThreadPool* pool = nullptr;   // shared pool (batch mode), null = a pool of `threads` workers per call
+    std::string csvDir;           // append the metrics tables here instead of outDir
+    MetricsFormat metricsFormat = MetricsFormat::CSV; // metrics tables as CSV, JSON lines or binary
+    double vizScale = 1.0;        // --debug images drawn on inputs downscaled by this factor
+    int vizThreads = 1;           // --debug image writer threads
+    bool nearestWarp = false;     // nearest-neighbour sampling when compositing in memory (previews)
+    StitchReport* report = nullptr; // filled with per-image, per-pair and compositing results
+};
+// With an empty outDir nothing is written besides streamed outputs (tiffPath, dziPath):
+// no params.txt, metrics tables or debug images, and no progress on stdout.
 cv::Mat stitchImages(const std::vector<cv::Mat>& imgs,
                      Detector detector,
                      vc::BlendMode blendMode,
@@ -14,5 +83,6 @@ cv::Mat stitchImages(const std::vector<cv::Mat>& imgs,
                      bool debug,
                      const std::string& outDir,
                      const std::string& setId,
-                     const std::string& pairId);
+                     const std::string& pairId,
+                     const StitchOptions& opts = StitchOptions());
 }
@@ -0,0 +1,44 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <memory>
+#include <string>
+#include <vector>
+#include "blend.hpp"
+#include "feature_cache.hpp"
+#include "features.hpp"
+#include "stitch.hpp"
+#include "thread_pool.hpp"
+namespace vc {
+// Parameters of one StitchSession::stitch call
+struct StitchConfig {
+    Detector detector = Detector::ORB;
+    BlendMode blend = BlendMode::FEATHER;
+    double ratio = 0.75;
+    int ransacIter = 1000;
+    double reprojThresh = 3.0;
+    StitchOptions opts; // pool, featureCache and report are supplied by the session
+};
+
+// Library entry point for embedding the pipeline in another process. A session owns the worker
+// pool and the feature cache, which stay alive between calls. Detector instances and the
+// compositing scratch buffers are not per session: they are process-wide and shared by every
+// session and stitch call in the process (see describeImage and scratch.hpp). stitch() writes
+// no files and prints nothing; results come back as the panorama and a StitchReport. Calls may
+// come from several threads.
+class StitchSession {
+public:
+    // threads = 0: one worker per hardware thread; featureCacheDir empty = no feature cache
+    explicit StitchSession(int threads = 0, const std::string& featureCacheDir = "");
+    StitchSession(const StitchSession&) = delete;
+    StitchSession& operator=(const StitchSession&) = delete;
+
+    // Empty when nothing could be stitched, or when cfg.opts streams to tiffPath/dziPath
+    cv::Mat stitch(const std::vector<cv::Mat>& imgs, const StitchConfig& cfg, StitchReport* report = nullptr);
+
+    ThreadPool& pool() { return pool_; }
+
+private:
+    ThreadPool pool_;
+    std::unique_ptr<FeatureCache> featureCache_;
+};
+}
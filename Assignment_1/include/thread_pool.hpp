@@ -0,0 +1,30 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+namespace vc {
+// Fixed-size worker pool shared by the parallel stages of the pipeline
+class ThreadPool {
+public:
+    explicit ThreadPool(int threads = 0); // 0 -> one worker per hardware thread
+    ~ThreadPool();
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return static_cast<int>(workers_.size()); }
+    void submit(std::function<void()> task);
+    // Runs fn(0..n-1) on the pool. The calling thread takes part, so nested calls cannot deadlock.
+    void parallelFor(int n, const std::function<void(int)>& fn);
+
+private:
+    void workerLoop();
+    std::vector<std::thread> workers_;
+    std::deque<std::function<void()>> tasks_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+};
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bounded_queue.hpp"
+#include "sink.hpp"
+#include "thread_pool.hpp"
+namespace vc {
+enum class TiffCompression { NONE, LZW, DEFLATE };
+
+// Streams a BGR panorama into a strip-organised BigTIFF (RGB, 8 bit). Bands are converted,
+// compressed strip by strip in parallel on the pool and appended by a background thread, so
+// compression overlaps with compositing and at most a few bands are held in memory.
+// I/O errors are thrown from finish().
+class BigTiffWriter : public PanoramaSink {
+public:
+    BigTiffWriter(const std::string& path, TiffCompression compression, ThreadPool* pool = nullptr,
+                  int rowsPerStrip = 64);
+    ~BigTiffWriter() override;
+    BigTiffWriter(const BigTiffWriter&) = delete;
+    BigTiffWriter& operator=(const BigTiffWriter&) = delete;
+
+    void begin(cv::Size size) override;
+    void writeBand(int y, const cv::Mat& band) override;
+    void finish() override;
+
+    std::uint64_t bytesWritten() const { return fileOffset_; }
+
+private:
+    void run();
+    void flushStrips(bool last);
+    std::vector<std::uint8_t> encodeStrip(const std::uint8_t* rgb, int rows) const;
+    void writeBytes(const void* data, std::size_t n);
+    void writeIfd();
+
+    std::string path_;
+    TiffCompression compression_;
+    ThreadPool* pool_;
+    int rowsPerStrip_;
+    cv::Size size_;
+    std::FILE* file_ = nullptr;
+    std::uint64_t fileOffset_ = 0;
+    int nextRow_ = 0;
+
+    BoundedQueue<cv::Mat> bands_{2};
+    std::thread worker_;
+    std::exception_ptr error_;
+    std::vector<std::uint8_t> pending_; // RGB rows not yet forming a full strip
+    std::vector<std::uint64_t> stripOffsets_, stripBytes_;
+};
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+namespace vc {
+// Timeline of nested spans per thread, exported as Chrome trace-event JSON (chrome://tracing,
+// ui.perfetto.dev). Spans are only recorded when the build defines VC_TRACE (CMake option
+// VC_TRACE) and start() was called; without VC_TRACE the macros below expand to nothing.
+// Span names must be string literals: only the pointer is stored.
+namespace trace {
+extern std::atomic<bool> active;
+
+inline int64_t nowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void start();
+// Writes everything recorded so far; false when the file cannot be written
+bool write(const std::string& path);
+// Label of the calling thread in the timeline
+void setThreadName(const char* name);
+void record(const char* name, int64_t beginNs, int64_t endNs);
+
+class Span {
+public:
+    explicit Span(const char* name) : name_(active.load(std::memory_order_relaxed) ? name : nullptr),
+                                      begin_(name_ ? nowNs() : 0) {}
+    ~Span() { if (name_) record(name_, begin_, nowNs()); }
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+private:
+    const char* name_;
+    int64_t begin_;
+};
+}
+}
+
+#ifdef VC_TRACE
+#define VC_TRACE_CAT_(a, b) a##b
+#define VC_TRACE_CAT(a, b) VC_TRACE_CAT_(a, b)
+#define VC_TRACE_SCOPE(name) ::vc::trace::Span VC_TRACE_CAT(vcTraceSpan_, __LINE__)(name)
+#define VC_TRACE_THREAD(name) ::vc::trace::setThreadName(name)
+#else
+#define VC_TRACE_SCOPE(name) ((void)0)
+#define VC_TRACE_THREAD(name) ((void)0)
+#endif
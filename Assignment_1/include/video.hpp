@@ -0,0 +1,38 @@
+#pragma once
+#include <opencv2/core.hpp>
+#include <string>
+#include <vector>
+namespace vc {
+struct KeyframeOptions {
+    double minOverlap = 0.6;  // a new keyframe is taken before overlap with the last one drops below this
+    int stride = 1;           // track every stride-th decoded frame
+    int trackSide = 640;      // tracking resolution (longest side)
+    int maxCorners = 500;     // corners seeded on every keyframe
+    int maxKeyframes = 0;     // stop after this many, 0 = whole video
+};
+
+struct Keyframe {
+    int frame = -1;          // index in the video
+    cv::Mat image;           // full-resolution frame
+    double overlap = 1.0;    // estimated overlap with the previous keyframe
+    int tracked = 0;         // corners still tracked from the previous keyframe
+};
+
+struct KeyframeStats {
+    int frames = 0;          // frames decoded
+    double decodeMs = 0.0;   // decoder thread busy time
+    double trackMs = 0.0;    // tracking time on the calling thread
+    double wallMs = 0.0;
+};
+
+// Picks stitching keyframes from a video. A decoder thread reads frames through
+// cv::VideoCapture into a bounded queue while the calling thread tracks corners from the last
+// keyframe frame to frame with pyramidal Lucas-Kanade, fits a similarity to the survivors and estimates
+// the keyframe's overlap with the current frame. When that overlap would fall below
+// minOverlap (or too few corners survive), the last frame still above it becomes the next
+// keyframe and is re-seeded. The last frame is added when it moved noticeably. Returns an empty
+// list when the video cannot be opened. Returns once the whole video has been scanned, so
+// stitching the keyframes starts only afterwards. A non-empty csvPath gets one row per keyframe.
+std::vector<Keyframe> selectKeyframes(const std::string& path, const KeyframeOptions& opts = KeyframeOptions(),
+                                      KeyframeStats* stats = nullptr, const std::string& csvPath = "");
+}
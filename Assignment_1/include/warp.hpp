@@ -1,5 +1,13 @@
 #pragma once
 #include <opencv2/core.hpp>
 namespace vc {
+// Source sampling of the warps: bilinear for output, nearest-neighbour for quick previews
+enum class Interp { BILINEAR, NEAREST };
+
 cv::Mat warpPerspectiveCustom(const cv::Mat& src, const cv::Mat& H, cv::Size outSize);
+// Warps src into the window roi of the destination plane (H maps src -> destination).
+// If weight is given it receives the feather weight of every pixel (distance to the
+// nearest source border), 0 where src does not cover the pixel.
+cv::Mat warpPerspectiveRoi(const cv::Mat& src, const cv::Mat& H, const cv::Rect& roi, cv::Mat* weight = nullptr,
+                           Interp interp = Interp::BILINEAR);
 }
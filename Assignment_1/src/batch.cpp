@@ -0,0 +1,235 @@
+#include "batch.hpp"
+#include "jpeg_writer.hpp"
+#include "mapped_canvas.hpp"
+#include "metrics.hpp"
+#include "scratch.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+#include <opencv2/imgcodecs.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+namespace vc {
+std::vector<BatchJob> readManifest(const std::string& path) {
+    std::ifstream ifs(path);
+    if (!ifs) throw std::runtime_error("readManifest: cannot open " + path);
+    const std::filesystem::path base = std::filesystem::path(path).parent_path();
+    std::vector<BatchJob> jobs;
+    std::string line;
+    for (int lineNo = 1; std::getline(ifs, line); ++lineNo) {
+        std::istringstream ss(line);
+        BatchJob job;
+        if (!(ss >> job.setId) || job.setId[0] == '#') continue;
+        if (!(ss >> job.pairId))
+            throw std::runtime_error(path + ":" + std::to_string(lineNo) + ": expected <set_id> <pair_id> <images...>");
+        if (job.setId == "-") job.setId.clear();
+        if (job.pairId == "-") job.pairId.clear();
+        for (std::string p; ss >> p; ) {
+            std::filesystem::path fp(p);
+            job.paths.push_back(fp.is_absolute() ? p : (base / fp).string());
+        }
+        jobs.push_back(std::move(job));
+    }
+    return jobs;
+}
+
+namespace {
+// Admits sets while their estimated working sets fit the limit; one set is always admitted
+// when nothing runs, so an oversized set still goes through on its own.
+class MemoryGate {
+public:
+    explicit MemoryGate(double limit) : limit_(limit) {}
+    void acquire(double bytes) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        cv_.wait(lock, [&]{ return limit_ <= 0 || used_ == 0 || used_ + bytes <= limit_; });
+        used_ += bytes;
+    }
+    void release(double bytes) {
+        { std::lock_guard<std::mutex> lock(mtx_); used_ -= bytes; }
+        cv_.notify_all();
+    }
+private:
+    double limit_, used_ = 0;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+};
+
+struct JobResult {
+    std::string name, status = "skipped";
+    size_t images = 0;
+    double estimateMB = 0, wallMs = 0;
+    cv::Size size;
+};
+
+std::string jobName(const BatchJob& job, size_t idx) {
+    if (job.setId.empty() && job.pairId.empty()) return "set" + std::to_string(idx);
+    if (job.pairId.empty()) return job.setId;
+    if (job.setId.empty()) return job.pairId;
+    return job.setId + "_" + job.pairId;
+}
+
+// One output directory per job: names the manifest repeats get the job index appended
+std::vector<std::string> jobNames(const std::vector<BatchJob>& jobs) {
+    std::vector<std::string> names;
+    std::map<std::string, int> uses;
+    for (size_t k = 0; k < jobs.size(); ++k) ++uses[names.emplace_back(jobName(jobs[k], k))];
+    for (size_t k = 0; k < jobs.size(); ++k)
+        if (uses[names[k]] > 1) names[k] += "_" + std::to_string(k);
+    return names;
+}
+
+// Pixel count of an image from its file header (PNG, JPEG, BMP), without decoding it. Other
+// formats are guessed from the file size at a 10:1 compression of 3-byte pixels.
+double headerPixels(const std::string& path) {
+    std::ifstream f(path, std::ios::binary);
+    unsigned char h[26] = {};
+    f.read(reinterpret_cast<char*>(h), sizeof(h));
+    auto be16 = [](const unsigned char* p) { return (p[0] << 8) | p[1]; };
+    auto be32 = [](const unsigned char* p) { return (uint32_t(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; };
+    auto le32 = [](const unsigned char* p) { return int32_t(uint32_t(p[0]) | (p[1] << 8) | (p[2] << 16) | (uint32_t(p[3]) << 24)); };
+    if (f.gcount() >= 24 && h[0] == 0x89 && h[1] == 'P' && h[2] == 'N' && h[3] == 'G')
+        return static_cast<double>(be32(h + 16)) * be32(h + 20);
+    if (f.gcount() >= 26 && h[0] == 'B' && h[1] == 'M')
+        return std::abs(static_cast<double>(le32(h + 18))) * std::abs(static_cast<double>(le32(h + 22)));
+    if (f.gcount() >= 2 && h[0] == 0xFF && h[1] == 0xD8) {
+        // Walk the marker segments up to the first start-of-frame
+        f.clear();
+        f.seekg(2);
+        unsigned char seg[7];
+        for (int m; f.read(reinterpret_cast<char*>(seg), 2) && seg[0] == 0xFF; ) {
+            m = seg[1];
+            if (m == 0xFF) { f.seekg(-1, std::ios::cur); continue; } // fill byte
+            if (m == 0x01 || (m >= 0xD0 && m <= 0xD9)) continue;      // markers without a length
+            if (!f.read(reinterpret_cast<char*>(seg), 2)) break;
+            const int len = be16(seg);
+            const bool sof = m >= 0xC0 && m <= 0xCF && m != 0xC4 && m != 0xC8 && m != 0xCC;
+            if (sof) {
+                if (!f.read(reinterpret_cast<char*>(seg), 5)) break;
+                return static_cast<double>(be16(seg + 1)) * be16(seg + 3);
+            }
+            if (len < 2) break;
+            f.seekg(len - 2, std::ios::cur);
+        }
+    }
+    std::error_code ec;
+    const auto bytes = std::filesystem::file_size(path, ec);
+    return ec ? 0.0 : static_cast<double>(bytes) * 10.0 / 3.0;
+}
+}
+
+int runBatch(const std::vector<BatchJob>& jobs,
+             Detector detector,
+             BlendMode blendMode,
+             int ransacIter,
+             double reprojThresh,
+             double ratio,
+             bool debug,
+             const std::string& outDir,
+             const StitchOptions& opts,
+             const BatchOptions& batch) {
+    std::filesystem::create_directories(outDir);
+    ThreadPool pool(opts.threads);
+    // Each set's parallel stages already spread over the pool; running several at once fills
+    // the pool during their serial stretches (sequential alignment, compositing)
+    const int hw = std::max(1u, std::thread::hardware_concurrency());
+    const int slots = std::max(1, std::min(static_cast<int>(jobs.size()), batch.jobs > 0 ? batch.jobs : hw / 2));
+    const double budget = batch.memoryMB > 0 ? batch.memoryMB * 1e6 : 0.5 * physicalMemoryBytes();
+    // Buffers parked in the scratch pool count against the same budget: an eighth of it (at most
+    // the pool's default 1 GB) is set aside for them and the running sets share the rest
+    const size_t scratchLimit = static_cast<size_t>(std::min(static_cast<double>(size_t(1) << 30), budget / 8));
+    setScratchLimit(scratchLimit);
+    MemoryGate gate(budget - static_cast<double>(scratchLimit));
+    std::cout << "Batch: " << jobs.size() << " sets, " << slots << " at a time, " << pool.size()
+              << " pool workers" << std::endl;
+
+    std::vector<JobResult> results(jobs.size());
+    const std::vector<std::string> names = jobNames(jobs);
+    std::atomic<size_t> next{0};
+    auto runner = [&]{
+        VC_TRACE_THREAD("batch runner");
+        for (size_t k; (k = next++) < jobs.size(); ) {
+            const BatchJob& job = jobs[k];
+            JobResult& res = results[k];
+            res.name = names[k];
+            const std::string jobDir = outDir + "/" + res.name;
+            auto t0 = std::chrono::high_resolution_clock::now();
+            double estimate = 0;
+            bool admitted = false;
+            try {
+                res.images = job.paths.size();
+                if (job.paths.size() < 2) throw std::runtime_error("need >=2 images");
+                // Inputs, work/compose copies and the compositing canvas and accumulators. Sized
+                // from the file headers, so a set waiting at the gate holds no decoded pixels.
+                double pixels = 0;
+                for (const auto& p : job.paths) pixels += headerPixels(p);
+                estimate = pixels * (blendMode == BlendMode::FEATHER ? 30.0 : 14.0);
+                res.estimateMB = estimate / 1e6;
+                gate.acquire(estimate);
+                admitted = true;
+
+                std::vector<cv::Mat> imgs;
+                for (const auto& p : job.paths) {
+                    VC_TRACE_SCOPE("decode");
+                    cv::Mat img = cv::imread(p);
+                    if (img.empty()) throw std::runtime_error("failed to read " + p);
+                    imgs.push_back(img);
+                }
+
+                StitchOptions jobOpts = opts;
+                jobOpts.pool = &pool;
+                jobOpts.csvDir = outDir;
+                if (batch.tiff) jobOpts.tiffPath = jobDir + "/panorama.tif";
+                if (batch.dzi) jobOpts.dziPath = jobDir + "/panorama";
+                cv::Mat pano = stitchImages(imgs, detector, blendMode, ransacIter, reprojThresh, ratio, debug,
+                                            jobDir, job.setId, job.pairId, jobOpts);
+                imgs.clear();
+                if (batch.tiff || batch.dzi) {
+                    res.status = "ok";
+                } else if (pano.empty()) {
+                    res.status = "stitch_failed";
+                } else {
+                    res.size = pano.size();
+                    const std::string outPano = jobDir + "/panorama.jpg";
+                    bool saved = pool.size() >= 4 && writeJpeg(outPano, pano, 95, pool);
+                    if (!saved) saved = cv::imwrite(outPano, pano);
+                    res.status = saved ? "ok" : "write_failed";
+                }
+            } catch (const std::exception& e) {
+                std::cerr << "[" << res.name << "] " << e.what() << std::endl;
+                res.status = "error";
+            }
+            if (admitted) gate.release(estimate);
+            res.wallMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+            std::cout << "[" << res.name << "] " << res.status << " (" << res.wallMs << " ms)" << std::endl;
+        }
+    };
+    std::vector<std::thread> runners;
+    for (int s = 0; s < slots; ++s) runners.emplace_back(runner);
+    for (auto& t : runners) t.join();
+    trimScratch();
+
+    metrics().flush();
+    std::ofstream ofs(outDir + "/batch.csv");
+    ofs << "set,images,status,est_working_set_mb,wall_time_ms,out_w,out_h\n";
+    int failed = 0;
+    for (const auto& r : results) {
+        ofs << r.name << "," << r.images << "," << r.status << "," << r.estimateMB << ","
+            << r.wallMs << "," << r.size.width << "," << r.size.height << "\n";
+        if (r.status != "ok") ++failed;
+    }
+    std::cout << "Batch done: " << jobs.size() - failed << "/" << jobs.size() << " sets ok" << std::endl;
+    return failed;
+}
+}
@@ -2,6 +2,10 @@
 #include <opencv2/imgproc.hpp>
 
 namespace vc {
+const char* toString(BlendMode b) {
+    return b == BlendMode::OVERLAY ? "overlay" : "feather";
+}
+
 cv::Mat blendOverlay(const cv::Mat& baseImg, const cv::Mat& topImg, const cv::Mat& mask) {
     CV_Assert(baseImg.type() == CV_8UC3 && topImg.type() == CV_8UC3);
     CV_Assert(baseImg.size() == topImg.size());
@@ -0,0 +1,188 @@
+#include "bundle.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace vc {
+typedef cv::Matx<double, 8, 8> Block;
+typedef cv::Vec<double, 8> BlockVec;
+
+static inline double huberWeight(double r, double delta) {
+    return r <= delta ? 1.0 : delta / r;
+}
+
+static inline double huberCost(double r, double delta) {
+    return r <= delta ? 0.5 * r * r : delta * (r - 0.5 * delta);
+}
+
+// Projects p with the 8-parameter homography h and, if requested, the 2x8 Jacobian rows du/dh, dv/dh
+static inline cv::Point2d project(const BlockVec& h, const cv::Point2f& p, BlockVec* du = nullptr, BlockVec* dv = nullptr) {
+    const double x = p.x, y = p.y;
+    const double w = h[6]*x + h[7]*y + 1.0;
+    const double iw = 1.0 / w;
+    const double u = (h[0]*x + h[1]*y + h[2]) * iw;
+    const double v = (h[3]*x + h[4]*y + h[5]) * iw;
+    if (du && dv) {
+        *du = BlockVec(x*iw, y*iw, iw, 0, 0, 0, -u*x*iw, -u*y*iw);
+        *dv = BlockVec(0, 0, 0, x*iw, y*iw, iw, -v*x*iw, -v*y*iw);
+    }
+    return cv::Point2d(u, v);
+}
+
+// Normal-equation contributions of one pair: blocks (a,a), (b,b), (a,b) and the gradients
+struct PairSystem { Block AA, BB, AB; BlockVec gA, gB; };
+
+static double pairCost(const PairCorrespondences& pc, const std::vector<BlockVec>& params, double delta) {
+    double cost = 0.0;
+    for (size_t k = 0; k < pc.ptsA.size(); ++k) {
+        cv::Point2d d = project(params[pc.a], pc.ptsA[k]) - project(params[pc.b], pc.ptsB[k]);
+        cost += huberCost(std::sqrt(d.x*d.x + d.y*d.y), delta);
+    }
+    return cost;
+}
+
+static void pairSystem(const PairCorrespondences& pc, const std::vector<BlockVec>& params, double delta, PairSystem& out) {
+    out = PairSystem();
+    BlockVec duA, dvA, duB, dvB;
+    for (size_t k = 0; k < pc.ptsA.size(); ++k) {
+        cv::Point2d d = project(params[pc.a], pc.ptsA[k], &duA, &dvA) - project(params[pc.b], pc.ptsB[k], &duB, &dvB);
+        const double w = huberWeight(std::sqrt(d.x*d.x + d.y*d.y), delta);
+        // r = proj_a - proj_b, so J_b = -dproj_b
+        for (int r = 0; r < 8; ++r) {
+            out.gA[r] += w * (duA[r]*d.x + dvA[r]*d.y);
+            out.gB[r] -= w * (duB[r]*d.x + dvB[r]*d.y);
+            for (int c = 0; c < 8; ++c) {
+                out.AA(r, c) += w * (duA[r]*duA[c] + dvA[r]*dvA[c]);
+                out.BB(r, c) += w * (duB[r]*duB[c] + dvB[r]*dvB[c]);
+                out.AB(r, c) -= w * (duA[r]*duB[c] + dvA[r]*dvB[c]);
+            }
+        }
+    }
+}
+
+static BlockVec toParams(const cv::Mat& H) {
+    cv::Mat Hn; H.convertTo(Hn, CV_64F);
+    Hn /= Hn.at<double>(2, 2);
+    const double* h = Hn.ptr<double>();
+    return BlockVec(h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7]);
+}
+
+static cv::Mat fromParams(const BlockVec& p) {
+    return (cv::Mat_<double>(3,3) << p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], 1.0);
+}
+
+BundleStats refineHomographies(std::vector<cv::Mat>& toRef,
+                               const std::vector<PairCorrespondences>& pairsIn,
+                               int reference, ThreadPool& pool,
+                               int maxIterations, double huberPx,
+                               const std::vector<bool>* fixed) {
+    BundleStats stats;
+    auto t0 = std::chrono::high_resolution_clock::now();
+    const int n = static_cast<int>(toRef.size());
+
+    // Variable blocks: every placed image except the reference and the fixed ones
+    std::vector<int> var(n, -1);
+    int numVars = 0;
+    for (int i = 0; i < n; ++i)
+        if (i != reference && !toRef[i].empty() && !(fixed && (*fixed)[i])) var[i] = numVars++;
+    std::vector<const PairCorrespondences*> pairs;
+    for (const auto& pc : pairsIn) {
+        if (pc.a == pc.b || pc.ptsA.empty() || toRef[pc.a].empty() || toRef[pc.b].empty()) continue;
+        pairs.push_back(&pc);
+        stats.residuals += static_cast<int>(pc.ptsA.size());
+    }
+    if (numVars == 0 || pairs.empty()) return stats;
+
+    std::vector<BlockVec> params(n);
+    for (int i = 0; i < n; ++i) if (!toRef[i].empty()) params[i] = toParams(toRef[i]);
+
+    const int numPairs = static_cast<int>(pairs.size());
+    std::vector<double> costs(numPairs);
+    auto totalCost = [&](const std::vector<BlockVec>& p) {
+        pool.parallelFor(numPairs, [&](int k) { costs[k] = pairCost(*pairs[k], p, huberPx); });
+        double s = 0.0; for (double c : costs) s += c;
+        return s;
+    };
+    auto rms = [&](double cost) { return std::sqrt(2.0 * cost / stats.residuals); };
+
+    double cost = totalCost(params);
+    stats.initialRms = rms(cost);
+    double lambda = 1e-4;
+
+    // Block-sparse normal equations: diagonal blocks per variable, off-diagonal blocks per pair
+    std::vector<PairSystem> sys(numPairs);
+    std::vector<Block> diag(numVars);
+    std::vector<BlockVec> grad(numVars);
+    for (int it = 0; it < maxIterations; ++it) {
+        pool.parallelFor(numPairs, [&](int k) { pairSystem(*pairs[k], params, huberPx, sys[k]); });
+        std::fill(diag.begin(), diag.end(), Block::zeros());
+        std::fill(grad.begin(), grad.end(), BlockVec());
+        for (int k = 0; k < numPairs; ++k) {
+            const int va = var[pairs[k]->a], vb = var[pairs[k]->b];
+            if (va >= 0) { diag[va] += sys[k].AA; grad[va] += sys[k].gA; }
+            if (vb >= 0) { diag[vb] += sys[k].BB; grad[vb] += sys[k].gB; }
+        }
+
+        bool improved = false;
+        while (!improved && lambda < 1e8) {
+            // Levenberg-Marquardt damping on the diagonal, block-Jacobi preconditioner
+            std::vector<Block> damped(diag), precond(numVars);
+            for (int v = 0; v < numVars; ++v) {
+                for (int r = 0; r < 8; ++r) damped[v](r, r) += lambda * std::max(diag[v](r, r), 1e-12);
+                precond[v] = damped[v].inv(cv::DECOMP_CHOLESKY);
+            }
+            auto apply = [&](const std::vector<BlockVec>& x, std::vector<BlockVec>& y) {
+                for (int v = 0; v < numVars; ++v) y[v] = damped[v] * x[v];
+                for (int k = 0; k < numPairs; ++k) {
+                    const int va = var[pairs[k]->a], vb = var[pairs[k]->b];
+                    if (va < 0 || vb < 0) continue;
+                    y[va] += sys[k].AB * x[vb];
+                    y[vb] += sys[k].AB.t() * x[va];
+                }
+            };
+            auto dot = [&](const std::vector<BlockVec>& x, const std::vector<BlockVec>& y) {
+                double s = 0.0; for (int v = 0; v < numVars; ++v) s += x[v].dot(y[v]);
+                return s;
+            };
+
+            // Preconditioned conjugate gradients on (J^T J + lambda D) delta = -g
+            std::vector<BlockVec> delta(numVars), r(numVars), z(numVars), p(numVars), Ap(numVars);
+            for (int v = 0; v < numVars; ++v) { r[v] = -grad[v]; z[v] = precond[v] * r[v]; p[v] = z[v]; }
+            double rz = dot(r, z);
+            const double rz0 = rz;
+            for (int cg = 0; cg < 8 * numVars && rz > 1e-20 * rz0; ++cg) {
+                apply(p, Ap);
+                double pAp = dot(p, Ap);
+                if (pAp <= 0.0) break;
+                double alpha = rz / pAp;
+                for (int v = 0; v < numVars; ++v) { delta[v] += alpha * p[v]; r[v] -= alpha * Ap[v]; z[v] = precond[v] * r[v]; }
+                double rzNew = dot(r, z);
+                for (int v = 0; v < numVars; ++v) p[v] = z[v] + (rzNew / rz) * p[v];
+                rz = rzNew;
+            }
+
+            std::vector<BlockVec> trial(params);
+            for (int i = 0; i < n; ++i) if (var[i] >= 0) trial[i] += delta[var[i]];
+            double trialCost = totalCost(trial);
+            if (std::isfinite(trialCost) && trialCost < cost) {
+                const double gain = cost - trialCost;
+                params.swap(trial);
+                cost = trialCost;
+                lambda = std::max(lambda * 0.1, 1e-12);
+                improved = true;
+                if (gain < 1e-9 * cost) it = maxIterations;
+            } else {
+                lambda *= 10.0;
+            }
+        }
+        stats.iterations++;
+        if (!improved) break;
+    }
+
+    for (int i = 0; i < n; ++i) if (var[i] >= 0) toRef[i] = fromParams(params[i]);
+    stats.finalRms = rms(cost);
+    auto t1 = std::chrono::high_resolution_clock::now();
+    stats.ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+    return stats;
+}
+}
@@ -0,0 +1,281 @@
+#include "cli.hpp"
+#include "incremental.hpp"
+#include "jpeg_writer.hpp"
+#include "metrics.hpp"
+#include "scratch.hpp"
+#include "trace.hpp"
+#include <opencv2/imgcodecs.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <filesystem>
+#include <future>
+#include <iostream>
+#include <stdexcept>
+
+namespace vc {
+// Working and compositing resolution of progressive previews
+static constexpr double kPreviewMegapix = 0.08;
+
+void printUsage() {
+    std::cout << "Usage: panorama <img1> <img2> [img3 ...]\n";
+    std::cout << "Options: --det [sift|orb|akaze] --blend [overlay|feather] --ratio <0.5-0.95> --ransac <iters> --th <px> --debug\n";
+    std::cout << "         --viz-scale <0-1> --viz-threads <n>   downscale / writer threads of the --debug images\n";
+    std::cout << "         --unordered [--min-inliers <n>] --pipeline --threads <n> --ba [--ba-iter <n>]\n";
+    std::cout << "         --work-mp <megapix> --compose-mp <megapix> --refine\n";
+    std::cout << "         --prepass [--prepass-px <n>]\n";
+    std::cout << "         --tiff <none|lzw|deflate> [--band-rows <n>]   stream a BigTIFF instead of panorama.jpg\n";
+    std::cout << "         --dzi <jpg|jpeg|webp> [--tile-size <px>]   write a Deep Zoom tile pyramid instead\n";
+    std::cout << "         --mmap-canvas --canvas-budget-mb <mb>\n";
+    std::cout << "         --select <anms|grid> [--max-kps <n>] [--grid-cells <n>]   spread-out keypoint subset per image\n";
+    std::cout << "         --feature-cache <dir>   reuse keypoints/descriptors across runs\n";
+    std::cout << "         --metrics <csv|jsonl|bin>   format of the per-stage metrics tables (default csv)\n";
+    std::cout << "         --video <file> [--kf-overlap <0-1>] [--video-stride <n>] [--max-keyframes <n>]   stitch video keyframes\n";
+    std::cout << "         --progressive   write a quick preview.jpg first, then the full panorama\n";
+    std::cout << "         --incremental <state dir>   re-stitch only what images added since the last run affect\n";
+    std::cout << "         --perf-counters   cycles, instructions, cache and branch misses per stage (Linux)\n";
+    std::cout << "         --trace <file.json>   span timeline for Perfetto / chrome://tracing (needs -DVC_TRACE=ON)\n";
+    std::cout << "         --out <dir>   run directory instead of results/run_<timestamp>\n";
+    std::cout << "   or: panorama --batch <manifest> [--jobs <n>] [--batch-mem-mb <mb>] [options]\n";
+    std::cout << "         manifest lines: <set_id> <pair_id> <img1> <img2> [img3 ...]\n";
+    std::cout << "   or: panorama --serve <socket> [options]   stitching daemon, options are per-request defaults\n";
+    std::cout << "   or: panorama --submit <socket> [options] <img1> <img2> [...]   send one job to the daemon\n";
+    std::cout << "       panorama --submit <socket> --shutdown\n";
+}
+
+void parseArgs(const std::vector<std::string>& tokens, CliArgs& args) {
+    StitchOptions& opts = args.opts;
+    const int n = static_cast<int>(tokens.size());
+    for (int i = 0; i < n; ++i) {
+        const std::string& a = tokens[i];
+        if (a == "--det" && i+1 < n) {
+            const std::string& v = tokens[++i];
+            if (v == "sift") args.detector = Detector::SIFT;
+            else if (v == "orb") args.detector = Detector::ORB;
+            else if (v == "akaze") args.detector = Detector::AKAZE;
+        } else if (a == "--blend" && i+1 < n) {
+            const std::string& v = tokens[++i];
+            if (v == "overlay") args.blend = BlendMode::OVERLAY;
+            else if (v == "feather") args.blend = BlendMode::FEATHER;
+        } else if (a == "--ratio" && i+1 < n) {
+            args.ratio = std::stod(tokens[++i]);
+        } else if (a == "--ransac" && i+1 < n) {
+            args.ransacIter = std::stoi(tokens[++i]);
+        } else if (a == "--th" && i+1 < n) {
+            args.reprojThresh = std::stod(tokens[++i]);
+        } else if (a == "--debug") {
+            args.debug = true;
+        } else if (a == "--unordered") {
+            opts.unordered = true;
+        } else if (a == "--min-inliers" && i+1 < n) {
+            opts.minInliers = std::stoi(tokens[++i]);
+        } else if (a == "--pipeline") {
+            opts.pipelined = true;
+        } else if (a == "--threads" && i+1 < n) {
+            opts.threads = std::stoi(tokens[++i]);
+        } else if (a == "--ba") {
+            opts.bundleAdjust = true;
+        } else if (a == "--ba-iter" && i+1 < n) {
+            opts.bundleIterations = std::stoi(tokens[++i]);
+        } else if (a == "--work-mp" && i+1 < n) {
+            opts.workMegapix = std::stod(tokens[++i]);
+        } else if (a == "--compose-mp" && i+1 < n) {
+            opts.composeMegapix = std::stod(tokens[++i]);
+        } else if (a == "--refine") {
+            opts.refineFullRes = true;
+        } else if (a == "--prepass") {
+            opts.overlapPrepass = true;
+        } else if (a == "--prepass-px" && i+1 < n) {
+            opts.prepassPx = std::stoi(tokens[++i]);
+        } else if (a == "--tiff" && i+1 < n) {
+            const std::string& c = tokens[++i];
+            args.streamTiff = true;
+            if (c == "none") opts.tiffCompression = TiffCompression::NONE;
+            else if (c == "lzw") opts.tiffCompression = TiffCompression::LZW;
+            else if (c == "deflate") opts.tiffCompression = TiffCompression::DEFLATE;
+            else throw std::invalid_argument("--tiff: unknown compression " + c + " (none, lzw or deflate)");
+        } else if (a == "--band-rows" && i+1 < n) {
+            opts.bandRows = std::stoi(tokens[++i]);
+        } else if (a == "--dzi" && i+1 < n) {
+            const std::string& f = tokens[++i];
+            args.streamDzi = true;
+            if (f == "jpg" || f == "jpeg") opts.dziFormat = TileFormat::JPEG;
+            else if (f == "webp") opts.dziFormat = TileFormat::WEBP;
+            else throw std::invalid_argument("--dzi: unknown tile format " + f + " (jpg or webp)");
+        } else if (a == "--tile-size" && i+1 < n) {
+            opts.dziTileSize = std::stoi(tokens[++i]);
+        } else if (a == "--mmap-canvas") {
+            opts.mappedCanvas = true;
+        } else if (a == "--canvas-budget-mb" && i+1 < n) {
+            opts.canvasBudgetMB = std::stod(tokens[++i]);
+        } else if (a == "--select" && i+1 < n) {
+            const std::string& v = tokens[++i];
+            if (v == "anms") opts.keypoints.method = KeypointSelect::ANMS;
+            else if (v == "grid") opts.keypoints.method = KeypointSelect::GRID;
+            else if (v == "none") opts.keypoints.method = KeypointSelect::NONE;
+            else throw std::invalid_argument("--select: unknown method " + v + " (none, anms or grid)");
+        } else if (a == "--max-kps" && i+1 < n) {
+            opts.keypoints.maxKeypoints = std::stoi(tokens[++i]);
+        } else if (a == "--grid-cells" && i+1 < n) {
+            opts.keypoints.gridCells = std::stoi(tokens[++i]);
+        } else if (a == "--feature-cache" && i+1 < n) {
+            opts.featureCacheDir = tokens[++i];
+        } else if (a == "--metrics" && i+1 < n) {
+            if (!parseMetricsFormat(tokens[++i], opts.metricsFormat))
+                throw std::invalid_argument("--metrics: unknown format " + tokens[i] + " (csv, jsonl or bin)");
+        } else if (a == "--batch" && i+1 < n) {
+            args.manifest = tokens[++i];
+        } else if (a == "--jobs" && i+1 < n) {
+            args.batch.jobs = std::stoi(tokens[++i]);
+        } else if (a == "--batch-mem-mb" && i+1 < n) {
+            args.batch.memoryMB = std::stod(tokens[++i]);
+        } else if (a == "--serve" && i+1 < n) {
+            args.serveSocket = tokens[++i];
+        } else if (a == "--submit" && i+1 < n) {
+            args.submitSocket = tokens[++i];
+        } else if (a == "--video" && i+1 < n) {
+            args.videoPath = tokens[++i];
+        } else if (a == "--kf-overlap" && i+1 < n) {
+            args.keyframes.minOverlap = std::stod(tokens[++i]);
+        } else if (a == "--video-stride" && i+1 < n) {
+            args.keyframes.stride = std::stoi(tokens[++i]);
+        } else if (a == "--max-keyframes" && i+1 < n) {
+            args.keyframes.maxKeyframes = std::stoi(tokens[++i]);
+        } else if (a == "--progressive") {
+            args.progressive = true;
+        } else if (a == "--incremental" && i+1 < n) {
+            args.incrementalDir = tokens[++i];
+        } else if (a == "--viz-scale" && i+1 < n) {
+            opts.vizScale = std::stod(tokens[++i]);
+        } else if (a == "--viz-threads" && i+1 < n) {
+            opts.vizThreads = std::stoi(tokens[++i]);
+        } else if (a == "--perf-counters") {
+            args.perfCounters = true;
+        } else if (a == "--trace" && i+1 < n) {
+            args.tracePath = tokens[++i];
+        } else if (a == "--out" && i+1 < n) {
+            args.outDir = tokens[++i];
+        } else if (a == "--set" && i+1 < n) {
+            args.setId = tokens[++i];
+        } else if (a == "--pair" && i+1 < n) {
+            args.pairId = tokens[++i];
+        } else if (!a.empty() && a[0] != '-') {
+            args.paths.push_back(a);
+        }
+    }
+}
+
+std::string timestampedRunDir(const std::string& prefix) {
+    auto now = std::chrono::system_clock::now();
+    std::time_t t = std::chrono::system_clock::to_time_t(now);
+    std::tm tm = *std::localtime(&t);
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), "results/%s_%04d%02d%02d_%02d%02d%02d", prefix.c_str(),
+                  tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    return buf;
+}
+
+// Thumbnail-scale registration (ORB) and nearest-neighbour overlay compositing
+static cv::Mat stitchPreview(const std::vector<cv::Mat>& imgs, const CliArgs& args, const std::string& outDir,
+                             ThreadPool& pool) {
+    StitchOptions p;
+    p.unordered = args.opts.unordered;
+    p.minInliers = args.opts.minInliers;
+    p.workMegapix = p.composeMegapix = kPreviewMegapix;
+    p.nearestWarp = true;
+    p.pool = &pool;
+    return stitchImages(imgs, Detector::ORB, BlendMode::OVERLAY, std::min(args.ransacIter, 500), args.reprojThresh,
+                        args.ratio, false, outDir, "", "", p);
+}
+
+RunResult runStitch(const CliArgs& args, ThreadPool& pool, const std::function<void(const RunResult&)>& onPreview) {
+    RunResult res;
+    auto t0 = std::chrono::high_resolution_clock::now();
+    res.outDir = args.outDir.empty() ? timestampedRunDir("run") : args.outDir;
+    cv::Mat pano;
+    const bool streamed = args.streamTiff || args.streamDzi;
+    StitchOptions opts = args.opts;
+    opts.pool = &pool;
+    if (!args.incrementalDir.empty()) {
+        // The incremental path writes panorama.jpg from stored tiles of still images only
+        if (streamed || args.progressive || !args.videoPath.empty()) {
+            res.error = "--incremental cannot be combined with --tiff, --dzi, --progressive or --video";
+            return res;
+        }
+        // Reads only what it needs: the stored state replaces most of the work
+        if (args.paths.empty()) { res.error = "Need >=1 image"; return res; }
+        pano = stitchIncremental(args.paths, args.detector, args.blend, args.ransacIter, args.reprojThresh, args.ratio,
+                                 args.incrementalDir, res.outDir, opts, pool);
+    } else {
+        std::vector<cv::Mat> imgs;
+        if (!args.videoPath.empty()) {
+            // Decoding overlaps tracking; only keyframes reach the pipeline, once the scan is done
+            std::filesystem::create_directories(res.outDir);
+            KeyframeStats ks;
+            for (auto& kf : selectKeyframes(args.videoPath, args.keyframes, &ks, res.outDir + "/keyframes.csv"))
+                imgs.push_back(kf.image);
+            if (ks.frames == 0) { res.error = "Failed to read " + args.videoPath; return res; }
+            std::cout << "Video: " << imgs.size() << " keyframes from " << ks.frames << " frames (decode "
+                      << ks.decodeMs << " ms, track " << ks.trackMs << " ms, wall " << ks.wallMs << " ms)" << std::endl;
+        }
+        for (const auto& p : args.paths) {
+            VC_TRACE_SCOPE("decode");
+            cv::Mat img = cv::imread(p);
+            if (img.empty()) { res.error = "Failed to read " + p; return res; }
+            imgs.push_back(img);
+        }
+        if (imgs.size() < 2) { res.error = "Need >=2 images"; return res; }
+
+        if (args.streamTiff) opts.tiffPath = res.outDir + "/panorama.tif";
+        if (args.streamDzi) opts.dziPath = res.outDir + "/panorama";
+
+        // Progressive: the full job starts right away and the preview is stitched next to it
+        std::future<cv::Mat> full = std::async(args.progressive ? std::launch::async : std::launch::deferred, [&]{
+            return stitchImages(imgs, args.detector, args.blend, args.ransacIter, args.reprojThresh, args.ratio,
+                                args.debug, res.outDir, args.setId, args.pairId, opts);
+        });
+        if (args.progressive) {
+            auto p0 = std::chrono::high_resolution_clock::now();
+            RunResult preview;
+            preview.outDir = res.outDir;
+            try {
+                VC_TRACE_SCOPE("preview");
+                cv::Mat small = stitchPreview(imgs, args, res.outDir + "/preview", pool);
+                preview.output = res.outDir + "/preview.jpg";
+                preview.ok = !small.empty() && cv::imwrite(preview.output, small);
+                preview.size = small.size();
+                if (!preview.ok) preview.error = "Preview failed";
+            } catch (const std::exception& e) {
+                preview.error = e.what();
+            }
+            preview.wallMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - p0).count();
+            res.previewMs = preview.wallMs;
+            if (preview.ok) res.previewPath = preview.output;
+            if (onPreview) onPreview(preview);
+        }
+        pano = full.get();
+    }
+    if (streamed) {
+        res.ok = true;
+        res.output = args.streamTiff ? opts.tiffPath : opts.dziPath + ".dzi";
+    } else if (pano.empty()) {
+        res.error = "Stitch failed";
+    } else {
+        res.size = pano.size();
+        res.output = res.outDir + "/panorama.jpg";
+        // Quality 95 and 4:2:0 as cv::imwrite; below 4 workers libjpeg's SIMD path is still faster
+        bool saved = pool.size() >= 4 && writeJpeg(res.output, pano, 95, pool);
+        if (!saved) {
+            VC_TRACE_SCOPE("encode");
+            saved = cv::imwrite(res.output, pano);
+        }
+        if (saved) res.ok = true;
+        else res.error = "Failed to write " + res.output + " (try --tiff for very large panoramas)";
+    }
+    metrics().flush(); // the run directory is complete once the result is reported
+    res.wallMs = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+    res.peakRssMB = peakRssBytes() / 1e6;
+    return res;
+}
+}
@@ -0,0 +1,249 @@
+#include "compose.hpp"
+#include "scratch.hpp"
+#include "warp.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+#include <opencv2/imgproc.hpp>
+#include <opencv2/core.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace vc {
+cv::Rect warpedBounds(cv::Size sz, const cv::Mat& H) {
+    std::vector<cv::Point2f> corners = {
+        cv::Point2f(0, 0),
+        cv::Point2f(static_cast<float>(sz.width), 0),
+        cv::Point2f(static_cast<float>(sz.width), static_cast<float>(sz.height)),
+        cv::Point2f(0, static_cast<float>(sz.height))
+    };
+    std::vector<cv::Point2f> warped;
+    cv::perspectiveTransform(corners, warped, H);
+    float minX = warped[0].x, minY = warped[0].y, maxX = warped[0].x, maxY = warped[0].y;
+    for (const auto& p : warped) {
+        minX = std::min(minX, p.x);
+        minY = std::min(minY, p.y);
+        maxX = std::max(maxX, p.x);
+        maxY = std::max(maxY, p.y);
+    }
+    int x0 = static_cast<int>(std::floor(minX)), y0 = static_cast<int>(std::floor(minY));
+    int x1 = static_cast<int>(std::ceil(maxX)), y1 = static_cast<int>(std::ceil(maxY));
+    return cv::Rect(x0, y0, x1 - x0, y1 - y0);
+}
+
+cv::Rect panoramaBounds(const std::vector<cv::Mat>& imgs, const std::vector<cv::Mat>& toRef) {
+    cv::Rect box;
+    for (size_t i = 0; i < imgs.size(); ++i) {
+        cv::Rect r = warpedBounds(imgs[i].size(), toRef[i]);
+        box = (i == 0) ? r : (box | r);
+    }
+    return box;
+}
+
+WarpedTile warpTile(const cv::Mat& img, const cv::Mat& toRef, Interp interp) {
+    WarpedTile t;
+    t.roi = warpedBounds(img.size(), toRef);
+    perf::Section section;
+    auto t_w0 = std::chrono::high_resolution_clock::now();
+    t.img = warpPerspectiveRoi(img, toRef, t.roi, &t.weight, interp);
+    auto t_w1 = std::chrono::high_resolution_clock::now();
+    t.warpPerf = section.stop();
+    t.warpMs = std::chrono::duration<double, std::milli>(t_w1 - t_w0).count();
+    return t;
+}
+
+namespace {
+// Blending state of one compositing pass over a canvas that covers `bounds` of the reference frame
+class CanvasAccumulator {
+public:
+    // All buffers come from the scratch pool, so consecutive bands (and runs) reuse them
+    CanvasAccumulator(const cv::Rect& bounds, BlendMode mode) : bounds_(bounds), mode_(mode) {
+        canvas_ = zeroed(bounds.size(), CV_8UC3);
+        covered_ = zeroed(bounds.size(), CV_8U);
+        if (mode == BlendMode::FEATHER) {
+            acc_ = zeroed(bounds.size(), CV_32FC3);
+            wsum_ = zeroed(bounds.size(), CV_32F);
+        }
+    }
+
+    // Returns the number of pixels the seam statistics were computed on
+    int add(const WarpedTile& tile, ComposeStats& s) {
+        const cv::Rect canvasRect(0, 0, bounds_.width, bounds_.height);
+        cv::Rect roi = (tile.roi - bounds_.tl()) & canvasRect;
+        if (roi.empty()) return 0;
+        const cv::Rect src(roi.tl() + bounds_.tl() - tile.roi.tl(), roi.size());
+        cv::Mat warped = tile.img(src), weight = tile.weight(src);
+        cv::Mat mask = scratchMat(); cv::compare(weight, 0.0, mask, cv::CMP_GT);
+
+        // Seam quality on the overlap with what has been composited so far
+        cv::Mat overlap = scratchMat(); cv::bitwise_and(covered_(roi), mask, overlap);
+        const int overlapPixels = cv::countNonZero(overlap);
+        if (overlapPixels > 0) {
+            VC_TRACE_SCOPE("seam metrics");
+            cv::Mat current = scratchMat();
+            if (mode_ == BlendMode::OVERLAY) {
+                current = canvas_(roi);
+            } else {
+                cv::Mat curF = normalised(acc_(roi), wsum_(roi));
+                curF.convertTo(current, CV_8U);
+            }
+            cv::Mat grayA = scratchMat(), grayB = scratchMat();
+            cv::cvtColor(current, grayA, cv::COLOR_BGR2GRAY); cv::cvtColor(warped, grayB, cv::COLOR_BGR2GRAY);
+            cv::Mat diff = scratchMat();
+            cv::absdiff(grayA, grayB, diff);
+            cv::Scalar meanVal, stdVal; cv::meanStdDev(diff, meanVal, stdVal, overlap);
+            s.seamMean = meanVal[0];
+            double minv, maxv; cv::minMaxLoc(diff, &minv, &maxv, nullptr, nullptr, overlap);
+            s.seamMax = maxv;
+        }
+
+        VC_TRACE_SCOPE("blend");
+        perf::Section section;
+        auto t_b0 = std::chrono::high_resolution_clock::now();
+        if (mode_ == BlendMode::OVERLAY) {
+            warped.copyTo(canvas_(roi), mask);
+        } else {
+            // Feathering: accumulate colour weighted by the distance to each source border
+            cv::Mat w3 = scratchMat(); cv::cvtColor(weight, w3, cv::COLOR_GRAY2BGR);
+            cv::Mat topF = scratchMat(); warped.convertTo(topF, CV_32F);
+            cv::multiply(topF, w3, topF);
+            cv::Mat accRoi = acc_(roi), wsumRoi = wsum_(roi);
+            accRoi += topF;
+            wsumRoi += weight;
+        }
+        cv::Mat coveredRoi = covered_(roi);
+        coveredRoi |= mask;
+        auto t_b1 = std::chrono::high_resolution_clock::now();
+        s.blendPerf = section.stop();
+        s.warpPerf = tile.warpPerf;
+        s.warpMs = tile.warpMs;
+        s.blendMs = std::chrono::duration<double, std::milli>(t_b1 - t_b0).count();
+        return overlapPixels;
+    }
+
+    cv::Mat finish() {
+        if (mode_ == BlendMode::FEATHER) {
+            VC_TRACE_SCOPE("blend normalise");
+            normalised(acc_, wsum_).convertTo(canvas_, CV_8U);
+        }
+        return canvas_;
+    }
+
+private:
+    static cv::Mat zeroed(cv::Size size, int type) {
+        cv::Mat m = scratchMat(size, type);
+        m.setTo(cv::Scalar::all(0));
+        return m;
+    }
+    // Weighted colour sum divided by the weight sum (clamped away from 0), as CV_32FC3
+    static cv::Mat normalised(const cv::Mat& acc, const cv::Mat& wsum) {
+        cv::Mat w = scratchMat(), w3 = scratchMat(), outF = scratchMat();
+        cv::max(wsum, 1e-6, w);
+        cv::cvtColor(w, w3, cv::COLOR_GRAY2BGR);
+        cv::divide(acc, w3, outF);
+        return outF;
+    }
+
+    cv::Rect bounds_;
+    BlendMode mode_;
+    cv::Mat canvas_, covered_, acc_, wsum_;
+};
+}
+
+cv::Mat composePanorama(const std::vector<cv::Mat>& imgs, const std::vector<cv::Mat>& toRef, BlendMode mode,
+                        std::vector<ComposeStats>* stats, Interp interp) {
+    if (imgs.empty()) return cv::Mat();
+    if (stats) stats->assign(imgs.size(), ComposeStats());
+
+    // Final bounding box once; each image is warped into its own window and blended right away
+    CanvasAccumulator canvas(panoramaBounds(imgs, toRef), mode);
+    ComposeStats scratch;
+    for (size_t i = 0; i < imgs.size(); ++i)
+        canvas.add(warpTile(imgs[i], toRef[i], interp), stats ? (*stats)[i] : scratch);
+    return canvas.finish();
+}
+
+cv::Mat composeTiles(const std::vector<WarpedTile>& tiles, BlendMode mode,
+                     std::vector<ComposeStats>* stats) {
+    if (tiles.empty()) return cv::Mat();
+    if (stats) stats->assign(tiles.size(), ComposeStats());
+
+    cv::Rect bounds = tiles[0].roi;
+    for (const auto& t : tiles) bounds |= t.roi;
+    CanvasAccumulator canvas(bounds, mode);
+    ComposeStats scratch;
+    for (size_t i = 0; i < tiles.size(); ++i)
+        canvas.add(tiles[i], stats ? (*stats)[i] : scratch);
+    return canvas.finish();
+}
+
+cv::Mat composeRegion(const std::vector<cv::Mat>& imgs, const std::vector<cv::Mat>& toRef, BlendMode mode,
+                      const cv::Rect& region, ThreadPool& pool) {
+    std::vector<WarpedTile> tiles(imgs.size());
+    pool.parallelFor(static_cast<int>(imgs.size()), [&](int i) {
+        if (imgs[i].empty() || toRef[i].empty()) return;
+        const cv::Rect roi = warpedBounds(imgs[i].size(), toRef[i]) & region;
+        if (roi.empty()) return;
+        tiles[i].roi = roi;
+        tiles[i].img = warpPerspectiveRoi(imgs[i], toRef[i], roi, &tiles[i].weight);
+    });
+    CanvasAccumulator canvas(region, mode);
+    ComposeStats scratch;
+    for (const auto& t : tiles)
+        if (!t.roi.empty()) canvas.add(t, scratch);
+    return canvas.finish();
+}
+
+void composeToSink(const std::vector<cv::Mat>& imgs, const std::vector<cv::Mat>& toRef, BlendMode mode,
+                   PanoramaSink& sink, ThreadPool& pool, int bandRows,
+                   std::vector<ComposeStats>* stats) {
+    if (stats) stats->assign(imgs.size(), ComposeStats());
+    if (imgs.empty()) return;
+    const cv::Rect bounds = panoramaBounds(imgs, toRef);
+    std::vector<cv::Rect> footprints(imgs.size());
+    for (size_t i = 0; i < imgs.size(); ++i) footprints[i] = warpedBounds(imgs[i].size(), toRef[i]);
+    std::vector<double> seamSum(imgs.size(), 0.0);
+    std::vector<long long> seamPixels(imgs.size(), 0);
+
+    sink.begin(bounds.size());
+    bandRows = std::max(1, bandRows);
+    for (int y = bounds.y; y < bounds.br().y; y += bandRows) {
+        const cv::Rect band(bounds.x, y, bounds.width, std::min(bandRows, bounds.br().y - y));
+        // Warp only the rows of each image that fall into this band, in parallel
+        std::vector<WarpedTile> tiles(imgs.size());
+        pool.parallelFor(static_cast<int>(imgs.size()), [&](int i) {
+            const cv::Rect roi = footprints[i] & band;
+            if (roi.empty()) return;
+            perf::Section section;
+            auto t_w0 = std::chrono::high_resolution_clock::now();
+            tiles[i].roi = roi;
+            tiles[i].img = warpPerspectiveRoi(imgs[i], toRef[i], roi, &tiles[i].weight);
+            auto t_w1 = std::chrono::high_resolution_clock::now();
+            tiles[i].warpPerf = section.stop();
+            tiles[i].warpMs = std::chrono::duration<double, std::milli>(t_w1 - t_w0).count();
+        });
+        CanvasAccumulator canvas(band, mode);
+        for (size_t i = 0; i < imgs.size(); ++i) {
+            if (tiles[i].roi.empty()) continue;
+            ComposeStats bs;
+            const int px = canvas.add(tiles[i], bs);
+            if (!stats) continue;
+            ComposeStats& s = (*stats)[i];
+            s.warpMs += bs.warpMs;
+            s.blendMs += bs.blendMs;
+            s.warpPerf += bs.warpPerf;
+            s.blendPerf += bs.blendPerf;
+            s.seamMax = std::max(s.seamMax, bs.seamMax);
+            seamSum[i] += bs.seamMean * px;
+            seamPixels[i] += px;
+        }
+        cv::Mat out = canvas.finish();
+        VC_TRACE_SCOPE("write band");
+        sink.writeBand(y - bounds.y, out);
+    }
+    sink.finish();
+    if (stats)
+        for (size_t i = 0; i < imgs.size(); ++i)
+            if (seamPixels[i] > 0) (*stats)[i].seamMean = seamSum[i] / seamPixels[i];
+}
+}
@@ -0,0 +1,118 @@
+#include "debug_viz.hpp"
+#include "trace.hpp"
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+
+namespace vc {
+namespace {
+cv::Scalar colorFromIndex(int idx) {
+    int hue = (idx * 37) % 180; // spread hues
+    cv::Mat hsv(1,1,CV_8UC3, cv::Vec3b((uchar)hue, 200, 255));
+    cv::Mat bgr; cv::cvtColor(hsv, bgr, cv::COLOR_HSV2BGR);
+    cv::Vec3b c = bgr.at<cv::Vec3b>(0,0);
+    return cv::Scalar(c[0], c[1], c[2]);
+}
+
+// Both images side by side, the first topN matches as coloured pairs with index labels
+cv::Mat annotate(const PairViz& pv) {
+    int H = std::max(pv.imgA.rows, pv.imgB.rows);
+    int W = pv.imgA.cols + pv.imgB.cols;
+    cv::Mat anno(H, W, CV_8UC3, cv::Scalar::all(0));
+    pv.imgA.copyTo(anno(cv::Rect(0, 0, pv.imgA.cols, pv.imgA.rows)));
+    pv.imgB.copyTo(anno(cv::Rect(pv.imgA.cols, 0, pv.imgB.cols, pv.imgB.rows)));
+    int xOffset = pv.imgA.cols;
+    int topN = std::min<int>(static_cast<int>(pv.matches.size()), 150);
+    for (int t = 0; t < topN; ++t) {
+        const auto& m = pv.matches[t];
+        cv::Point p(cvRound(pv.kpsA[m.queryIdx].pt.x), cvRound(pv.kpsA[m.queryIdx].pt.y));
+        cv::Point q(cvRound(pv.kpsB[m.trainIdx].pt.x) + xOffset, cvRound(pv.kpsB[m.trainIdx].pt.y));
+        cv::Scalar col = colorFromIndex(t);
+        cv::circle(anno, p, 4, col, 2, cv::LINE_AA);
+        cv::circle(anno, q, 4, col, 2, cv::LINE_AA);
+        cv::line(anno, p, q, col, 1, cv::LINE_AA);
+        char txt[16]; std::snprintf(txt, sizeof(txt), "%d", t+1);
+        cv::putText(anno, txt, p + cv::Point(5,-5), cv::FONT_HERSHEY_SIMPLEX, 0.45, col, 1, cv::LINE_AA);
+        cv::putText(anno, txt, q + cv::Point(5,-5), cv::FONT_HERSHEY_SIMPLEX, 0.45, col, 1, cv::LINE_AA);
+    }
+    return anno;
+}
+}
+
+DebugVizWriter::DebugVizWriter(const std::string& dir, int threads, double scale, size_t queueDepth)
+    : dir_(dir), scale_(scale > 0.0 && scale < 1.0 ? scale : 1.0), jobs_(queueDepth) {
+    for (int t = 0; t < std::max(1, threads); ++t) {
+        workers_.emplace_back([this]{
+            VC_TRACE_THREAD("debug viz");
+            std::function<void()> job;
+            while (jobs_.pop(job)) {
+                try { job(); }
+                catch (const std::exception& e) { std::cerr << "Debug visualisation failed: " << e.what() << std::endl; }
+            }
+        });
+    }
+}
+
+DebugVizWriter::~DebugVizWriter() {
+    jobs_.close();
+    for (auto& w : workers_) w.join();
+}
+
+void DebugVizWriter::submit(std::function<void()> job) {
+    jobs_.push(std::move(job));
+}
+
+void DebugVizWriter::write(const std::string& stem, const cv::Mat& img) const {
+    VC_TRACE_SCOPE("encode");
+    cv::imwrite(dir_ + "/" + stem + ".jpg", img);
+}
+
+PairViz DebugVizWriter::scaled(const PairViz& pv) const {
+    if (scale_ >= 1.0) return pv;
+    PairViz out = pv;
+    cv::resize(pv.imgA, out.imgA, cv::Size(), scale_, scale_, cv::INTER_AREA);
+    cv::resize(pv.imgB, out.imgB, cv::Size(), scale_, scale_, cv::INTER_AREA);
+    for (auto* kps : {&out.kpsA, &out.kpsB})
+        for (auto& kp : *kps) { kp.pt *= static_cast<float>(scale_); kp.size *= static_cast<float>(scale_); }
+    return out;
+}
+
+void DebugVizWriter::matches(PairViz pv) {
+    submit([this, pv = std::move(pv)]{
+        VC_TRACE_SCOPE("debug matches");
+        const PairViz s = scaled(pv);
+        const std::string i = std::to_string(s.index);
+        // 1) More visible keypoints: rich style + bright color
+        cv::Mat imgKP1, imgKP2;
+        cv::drawKeypoints(s.imgA, s.kpsA, imgKP1, cv::Scalar(0,255,255), cv::DrawMatchesFlags::DRAW_RICH_KEYPOINTS);
+        cv::drawKeypoints(s.imgB, s.kpsB, imgKP2, cv::Scalar(0,255,255), cv::DrawMatchesFlags::DRAW_RICH_KEYPOINTS);
+        write("kps_" + i + "_a", imgKP1);
+        write("kps_" + i + "_b", imgKP2);
+
+        // 2) Dense matches (OpenCV default)
+        cv::Mat matchesImg;
+        cv::drawMatches(s.imgA, s.kpsA, s.imgB, s.kpsB, s.matches, matchesImg);
+        write("matches_" + i, matchesImg);
+
+        // 3) Annotated matches: colored pairs + pair index labels (topN to avoid clutter)
+        write("matches_annotated_" + i, annotate(s));
+    });
+}
+
+void DebugVizWriter::inliers(PairViz pv) {
+    if (pv.matches.empty()) return;
+    submit([this, pv = std::move(pv)]{
+        VC_TRACE_SCOPE("debug inliers");
+        const PairViz s = scaled(pv);
+        const std::string i = std::to_string(s.index);
+        // Dense inliers image
+        cv::Mat inlierImg;
+        cv::drawMatches(s.imgA, s.kpsA, s.imgB, s.kpsB, s.matches, inlierImg);
+        write("inliers_" + i, inlierImg);
+        // Annotated inliers (limit topN)
+        write("inliers_annotated_" + i, annotate(s));
+    });
+}
+}
@@ -0,0 +1,113 @@
+#include "deepzoom.hpp"
+#include "trace.hpp"
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+namespace vc {
+DeepZoomWriter::DeepZoomWriter(const std::string& basePath, ThreadPool& pool, int tileSize, int overlap,
+                               TileFormat format, int quality)
+    : basePath_(basePath), pool_(pool), tileSize_(std::max(1, tileSize)), overlap_(std::max(0, overlap)),
+      format_(format), quality_(quality) {}
+
+void DeepZoomWriter::begin(cv::Size size) {
+    CV_Assert(size.width > 0 && size.height > 0);
+    size_ = size;
+    // Level 0 is 1x1; every level above doubles up to the full size
+    int maxLevel = 0;
+    while ((1 << maxLevel) < std::max(size.width, size.height)) ++maxLevel;
+    levels_.assign(maxLevel + 1, Level());
+    for (int l = 0; l <= maxLevel; ++l) {
+        const int shift = maxLevel - l;
+        levels_[l].size = cv::Size((size.width + (1 << shift) - 1) >> shift, (size.height + (1 << shift) - 1) >> shift);
+        std::filesystem::create_directories(basePath_ + "_files/" + std::to_string(l));
+    }
+}
+
+void DeepZoomWriter::writeBand(int, const cv::Mat& band) {
+    CV_Assert(!levels_.empty() && band.type() == CV_8UC3 && band.cols == size_.width);
+    pushRows(static_cast<int>(levels_.size()) - 1, band, false);
+}
+
+void DeepZoomWriter::finish() {
+    pushRows(static_cast<int>(levels_.size()) - 1, cv::Mat(), true);
+    flushJobs();
+    std::ofstream ofs(basePath_ + ".dzi");
+    ofs << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" Format=\""
+        << (format_ == TileFormat::JPEG ? "jpg" : "webp") << "\" Overlap=\"" << overlap_
+        << "\" TileSize=\"" << tileSize_ << "\">\n"
+        << "  <Size Width=\"" << size_.width << "\" Height=\"" << size_.height << "\"/>\n"
+        << "</Image>\n";
+    if (!ofs) throw std::runtime_error("DeepZoomWriter: cannot write " + basePath_ + ".dzi");
+}
+
+void DeepZoomWriter::pushRows(int level, const cv::Mat& rows, bool last) {
+    Level& lv = levels_[level];
+    if (!rows.empty()) {
+        if (lv.buf.empty()) lv.buf = rows.clone();
+        else cv::vconcat(lv.buf, rows, lv.buf);
+    }
+    emitTiles(level);
+    if (level == 0) return;
+
+    // Pair rows for the 2x2 box filter; an odd last row (and column) is replicated
+    cv::Mat src;
+    if (!lv.oddRow.empty() && !rows.empty()) cv::vconcat(lv.oddRow, rows, src);
+    else src = lv.oddRow.empty() ? rows : lv.oddRow;
+    lv.oddRow.release();
+    if (src.rows % 2 == 1) {
+        if (last) { cv::vconcat(src, src.row(src.rows - 1), src); }
+        else { lv.oddRow = src.row(src.rows - 1).clone(); src = src.rowRange(0, src.rows - 1); }
+    }
+    cv::Mat half;
+    if (!src.empty()) {
+        if (src.cols % 2 == 1) cv::copyMakeBorder(src, src, 0, 0, 0, 1, cv::BORDER_REPLICATE);
+        cv::resize(src, half, cv::Size(src.cols / 2, src.rows / 2), 0, 0, cv::INTER_AREA);
+    }
+    if (!half.empty() || last) pushRows(level - 1, half, last);
+}
+
+// Cuts every tile row of the level whose rows (including overlap) have all arrived
+void DeepZoomWriter::emitTiles(int level) {
+    Level& lv = levels_[level];
+    const int ts = tileSize_, ov = overlap_;
+    const int cols = (lv.size.width + ts - 1) / ts, rowsOfTiles = (lv.size.height + ts - 1) / ts;
+    const char* ext = format_ == TileFormat::JPEG ? ".jpg" : ".webp";
+    while (lv.tileRow < rowsOfTiles) {
+        const int r = lv.tileRow;
+        const int y0 = std::max(0, r * ts - ov), y1 = std::min(lv.size.height, (r + 1) * ts + ov);
+        if (lv.bufY + lv.buf.rows < y1) break;
+        for (int c = 0; c < cols; ++c) {
+            const int x0 = std::max(0, c * ts - ov), x1 = std::min(lv.size.width, (c + 1) * ts + ov);
+            std::string path = basePath_ + "_files/" + std::to_string(level) + "/" +
+                               std::to_string(c) + "_" + std::to_string(r) + ext;
+            jobs_.emplace_back(std::move(path), lv.buf(cv::Rect(x0, y0 - lv.bufY, x1 - x0, y1 - y0)).clone());
+        }
+        ++lv.tileRow;
+        // Only rows from the next tile row's top overlap on are still needed
+        const int keep = std::min(lv.bufY + lv.buf.rows, std::max(0, lv.tileRow * ts - ov));
+        if (keep > lv.bufY) {
+            lv.buf = lv.buf.rowRange(keep - lv.bufY, lv.buf.rows);
+            lv.bufY = keep;
+        }
+    }
+    if (static_cast<int>(jobs_.size()) >= 4 * (pool_.size() + 1)) flushJobs();
+}
+
+void DeepZoomWriter::flushJobs() {
+    std::vector<int> params = format_ == TileFormat::JPEG
+        ? std::vector<int>{cv::IMWRITE_JPEG_QUALITY, quality_}
+        : std::vector<int>{cv::IMWRITE_WEBP_QUALITY, quality_};
+    pool_.parallelFor(static_cast<int>(jobs_.size()), [&](int k) {
+        VC_TRACE_SCOPE("encode tile");
+        if (!cv::imwrite(jobs_[k].first, jobs_[k].second, params))
+            throw std::runtime_error("DeepZoomWriter: cannot write " + jobs_[k].first);
+    });
+    tilesWritten_ += static_cast<int>(jobs_.size());
+    jobs_.clear();
+}
+}
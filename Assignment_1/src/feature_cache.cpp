@@ -0,0 +1,174 @@
+#include "feature_cache.hpp"
+#include "mapped_canvas.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace vc {
+namespace {
+constexpr uint32_t kVersion = 1;
+constexpr uint32_t kByteOrder = 0x01020304; // reads back swapped on a host of the other endianness
+constexpr size_t kAlign = 64;
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t count;     // keypoints
+    int32_t descRows, descCols, descType;
+    uint64_t off[8];    // x, y, size, angle, response, octave, class_id, descriptors
+    uint64_t fileBytes;
+};
+constexpr char kMagic[8] = {'V', 'C', 'F', 'E', 'A', 'T', 0, 0};
+enum Section { X, Y, SIZE, ANGLE, RESPONSE, OCTAVE, CLASS_ID, DESC };
+
+size_t alignUp(size_t n) { return (n + kAlign - 1) / kAlign * kAlign; }
+
+// Two independent 64-bit multiply-rotate lanes, finalised with the murmur3 mixer. Not
+// cryptographic: it only has to make accidental collisions between cache entries negligible.
+class Hasher {
+public:
+    void bytes(const void* data, size_t n) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) { uint64_t w; std::memcpy(&w, p + i, 8); word(w); }
+        uint64_t tail = 0;
+        std::memcpy(&tail, p + i, n - i);
+        word(tail);
+        word(n);
+    }
+    void text(const std::string& s) { bytes(s.data(), s.size()); }
+    void mat(const cv::Mat& m) {
+        const int32_t dims[3] = {m.rows, m.cols, m.type()};
+        bytes(dims, sizeof(dims));
+        for (int r = 0; r < m.rows; ++r) bytes(m.ptr(r), m.cols * m.elemSize());
+    }
+    std::string hex() const {
+        char buf[33];
+        std::snprintf(buf, sizeof(buf), "%016llx%016llx",
+                      static_cast<unsigned long long>(fmix(a_)), static_cast<unsigned long long>(fmix(b_ ^ a_)));
+        return buf;
+    }
+
+private:
+    static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+    static uint64_t fmix(uint64_t k) {
+        k ^= k >> 33; k *= 0xff51afd7ed558ccdULL;
+        k ^= k >> 33; k *= 0xc4ceb9fe1a85ec53ULL;
+        return k ^ (k >> 33);
+    }
+    void word(uint64_t w) {
+        a_ = rotl(a_ ^ (w * 0x87c37b91114253d5ULL), 31) * 0x4cf5ad432745937fULL;
+        b_ = rotl(b_ ^ (w * 0x4cf5ad432745937fULL), 33) * 0x87c37b91114253d5ULL + a_;
+    }
+    uint64_t a_ = 0x9e3779b97f4a7c15ULL, b_ = 0xc2b2ae3d27d4eb4fULL;
+};
+}
+
+FeatureCache::FeatureCache(const std::string& dir) : dir_(dir) {}
+
+std::string FeatureCache::key(const cv::Mat& img, Detector d, const cv::Mat& mask, const KeypointSelection& sel) {
+    Hasher h;
+    const uint32_t version = kVersion;
+    h.bytes(&version, sizeof(version));
+    h.text(detectorSignature(d));
+    // Hashed only when selecting, so entries written before selection existed stay valid
+    if (sel.method != KeypointSelect::NONE) h.text(toString(sel));
+    h.text(CV_VERSION);
+    h.mat(img);
+    h.mat(mask);
+    return h.hex();
+}
+
+// Entries fan out over 256 subdirectories by the first byte of the key
+std::string FeatureCache::pathFor(const std::string& key) const {
+    return dir_ + "/" + key.substr(0, 2) + "/" + key + ".vcf";
+}
+
+bool FeatureCache::load(const std::string& key, KPDesc& out) const {
+    cv::Mat file = mapFile(pathFor(key));
+    const size_t bytes = file.total();
+    if (bytes < sizeof(FileHeader)) return false;
+    FileHeader h;
+    std::memcpy(&h, file.data, sizeof(h));
+    if (std::memcmp(h.magic, kMagic, sizeof(kMagic)) != 0 || h.version != kVersion ||
+        h.byteOrder != kByteOrder || h.fileBytes != bytes || h.descRows < 0 || h.descCols < 0)
+        return false;
+    // One descriptor row per keypoint, of a type a detector produces: anything else is a foreign
+    // or corrupted entry, and matching it would index keypoints out of range
+    if (static_cast<size_t>(h.descRows) != h.count ||
+        (h.descRows > 0 && h.descType != CV_8U && h.descType != CV_32F))
+        return false;
+    const size_t n = h.count;
+    const size_t descBytes = static_cast<size_t>(h.descRows) * h.descCols * CV_ELEM_SIZE(h.descType);
+    for (int s = X; s <= DESC; ++s) {
+        const size_t len = s == DESC ? descBytes : n * 4;
+        if (h.off[s] % kAlign != 0 || h.off[s] > bytes || len > bytes - h.off[s]) return false;
+    }
+
+    const uchar* base = file.data;
+    auto f32 = [&](Section s) { return reinterpret_cast<const float*>(base + h.off[s]); };
+    auto i32 = [&](Section s) { return reinterpret_cast<const int32_t*>(base + h.off[s]); };
+    const float *x = f32(X), *y = f32(Y), *size = f32(SIZE), *angle = f32(ANGLE), *resp = f32(RESPONSE);
+    const int32_t *octave = i32(OCTAVE), *classId = i32(CLASS_ID);
+    out.kps.resize(n);
+    for (size_t k = 0; k < n; ++k)
+        out.kps[k] = cv::KeyPoint(x[k], y[k], size[k], angle[k], resp[k], octave[k], classId[k]);
+    // Shares the mapping: it stays alive as long as the descriptors do
+    out.desc = h.descRows > 0 ? viewOf(file, h.off[DESC], h.descRows, h.descCols, h.descType) : cv::Mat();
+    return true;
+}
+
+bool FeatureCache::store(const std::string& key, const KPDesc& f) const {
+    const size_t n = f.kps.size();
+    const cv::Mat desc = f.desc.isContinuous() ? f.desc : f.desc.clone();
+    FileHeader h{};
+    std::memcpy(h.magic, kMagic, sizeof(kMagic));
+    h.version = kVersion;
+    h.byteOrder = kByteOrder;
+    h.count = static_cast<uint32_t>(n);
+    h.descRows = desc.rows;
+    h.descCols = desc.cols;
+    h.descType = desc.empty() ? 0 : desc.type();
+    size_t pos = alignUp(sizeof(FileHeader));
+    for (int s = X; s < DESC; ++s) { h.off[s] = pos; pos = alignUp(pos + n * 4); }
+    h.off[DESC] = pos;
+    h.fileBytes = pos + desc.total() * desc.elemSize();
+
+    std::vector<char> buf(h.fileBytes, 0);
+    std::memcpy(buf.data(), &h, sizeof(h));
+    float* fs[5];
+    for (int s = X; s <= RESPONSE; ++s) fs[s] = reinterpret_cast<float*>(buf.data() + h.off[s]);
+    int32_t* octave = reinterpret_cast<int32_t*>(buf.data() + h.off[OCTAVE]);
+    int32_t* classId = reinterpret_cast<int32_t*>(buf.data() + h.off[CLASS_ID]);
+    for (size_t k = 0; k < n; ++k) {
+        const cv::KeyPoint& kp = f.kps[k];
+        fs[X][k] = kp.pt.x; fs[Y][k] = kp.pt.y; fs[SIZE][k] = kp.size;
+        fs[ANGLE][k] = kp.angle; fs[RESPONSE][k] = kp.response;
+        octave[k] = kp.octave; classId[k] = kp.class_id;
+    }
+    if (!desc.empty()) std::memcpy(buf.data() + h.off[DESC], desc.data, desc.total() * desc.elemSize());
+
+    // Written beside the entry and renamed into place
+    const std::string path = pathFor(key);
+    const std::string tmp = path + ".tmp" +
+        std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()) ^
+                       static_cast<size_t>(std::chrono::steady_clock::now().time_since_epoch().count()));
+    std::error_code ec;
+    std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+    {
+        std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
+        ofs.write(buf.data(), static_cast<std::streamsize>(buf.size()));
+        if (!ofs) { ofs.close(); std::filesystem::remove(tmp, ec); return false; }
+    }
+    std::filesystem::rename(tmp, path, ec);
+    if (ec) { std::filesystem::remove(tmp, ec); return false; }
+    return true;
+}
+}
@@ -1,9 +1,19 @@
 #include "features.hpp"
 #include "preprocess.hpp"
+#include "feature_cache.hpp"
+#include "trace.hpp"
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/features2d.hpp>
+#include <opencv2/core/utility.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <iostream>
+#include <mutex>
+#include <numeric>
+#include <sstream>
+#include <thread>
 
 namespace vc {
 static KPDesc detectWith(cv::Ptr<cv::Feature2D> det, const cv::Mat& img) {
@@ -17,24 +27,294 @@ static KPDesc detectWith(cv::Ptr<cv::Feature2D> det, const cv::Mat& img) {
 KPDesc detectSIFT(const cv::Mat& img) {
     cv::Ptr<cv::Feature2D> det;
     try {
-#if CV_VERSION_MAJOR >= 4
-        det = cv::SIFT::create();
-#else
-        det = cv::xfeatures2d::SIFT::create();
-#endif
+        det = createDetector(Detector::SIFT);
     } catch (...) {
-        det = cv::ORB::create(5000);
+        det = createDetector(Detector::ORB);
     }
     return detectWith(det, img);
 }
 
 KPDesc detectORB(const cv::Mat& img) {
-    auto det = cv::ORB::create(5000);
-    return detectWith(det, img);
+    return detectWith(createDetector(Detector::ORB), img);
 }
 
 KPDesc detectAKAZE(const cv::Mat& img) {
-    auto det = cv::AKAZE::create();
-    return detectWith(det, img);
+    return detectWith(createDetector(Detector::AKAZE), img);
+}
+
+// Detector settings, in one place: createDetector builds from them and detectorSignature hashes
+// them, so retuning a value also invalidates the feature-cache entries made with the old one.
+// Enum-valued settings are stored as int and cast back to the enumerator's own type.
+static const struct { int nFeatures = 0, nOctaveLayers = 3; double contrastThreshold = 0.04, edgeThreshold = 10.0, sigma = 1.6; }
+    kSiftParams{};
+static const struct {
+    int nFeatures = 5000; float scaleFactor = 1.2f; int nLevels = 8, edgeThreshold = 31, firstLevel = 0, wtaK = 2;
+    int scoreType = cv::ORB::HARRIS_SCORE; int patchSize = 31, fastThreshold = 20;
+} kOrbParams{};
+static const struct {
+    int descriptorType = cv::AKAZE::DESCRIPTOR_MLDB; int descriptorSize = 0, descriptorChannels = 3;
+    float threshold = 0.001f; int nOctaves = 4, nOctaveLayers = 4; int diffusivity = cv::KAZE::DIFF_PM_G2;
+} kAkazeParams{};
+
+cv::Ptr<cv::Feature2D> createDetector(Detector d) {
+    if (d == Detector::SIFT) {
+        const auto& p = kSiftParams;
+        return cv::SIFT::create(p.nFeatures, p.nOctaveLayers, p.contrastThreshold, p.edgeThreshold, p.sigma);
+    }
+    if (d == Detector::ORB) {
+        const auto& p = kOrbParams;
+        return cv::ORB::create(p.nFeatures, p.scaleFactor, p.nLevels, p.edgeThreshold, p.firstLevel, p.wtaK,
+                               static_cast<decltype(cv::ORB::HARRIS_SCORE)>(p.scoreType), p.patchSize, p.fastThreshold);
+    }
+    const auto& p = kAkazeParams;
+    return cv::AKAZE::create(static_cast<decltype(cv::AKAZE::DESCRIPTOR_MLDB)>(p.descriptorType), p.descriptorSize,
+                             p.descriptorChannels, p.threshold, p.nOctaves, p.nOctaveLayers,
+                             static_cast<decltype(cv::KAZE::DIFF_PM_G2)>(p.diffusivity));
+}
+
+const char* toString(Detector d) {
+    return d == Detector::SIFT ? "sift" : d == Detector::ORB ? "orb" : "akaze";
+}
+
+std::string toString(const KeypointSelection& sel) {
+    if (sel.method == KeypointSelect::NONE) return "none";
+    if (sel.method == KeypointSelect::ANMS) return "anms:" + std::to_string(sel.maxKeypoints);
+    return "grid:" + std::to_string(sel.maxKeypoints) + ":" + std::to_string(sel.gridCells);
+}
+
+std::string detectorSignature(Detector d) {
+    std::ostringstream ss;
+    ss.precision(17);
+    if (d == Detector::SIFT) {
+        const auto& p = kSiftParams;
+        ss << "sift:" << p.nFeatures << ":" << p.nOctaveLayers << ":" << p.contrastThreshold << ":" << p.edgeThreshold
+           << ":" << p.sigma;
+    } else if (d == Detector::ORB) {
+        const auto& p = kOrbParams;
+        ss << "orb:" << p.nFeatures << ":" << p.scaleFactor << ":" << p.nLevels << ":" << p.edgeThreshold << ":"
+           << p.firstLevel << ":" << p.wtaK << ":" << p.scoreType << ":" << p.patchSize << ":" << p.fastThreshold;
+    } else {
+        const auto& p = kAkazeParams;
+        ss << "akaze:" << p.descriptorType << ":" << p.descriptorSize << ":" << p.descriptorChannels << ":"
+           << p.threshold << ":" << p.nOctaves << ":" << p.nOctaveLayers << ":" << p.diffusivity;
+    }
+    return ss.str();
+}
+
+// Keypoint indices strongest first; ties keep detector order so the selection is deterministic
+static std::vector<int> byResponse(const std::vector<cv::KeyPoint>& kps) {
+    std::vector<int> order(kps.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return kps[a].response > kps[b].response; });
+    return order;
+}
+
+// Greedy disc suppression in response order: a keypoint survives when no stronger survivor lies
+// within radius. Survivors are binned in cells at least radius wide, so each test looks at 3 x 3
+// cells. Gives up once more than stopAfter keypoints survive.
+static std::vector<int> suppress(const std::vector<cv::KeyPoint>& kps, const std::vector<int>& order, cv::Size size,
+                                 float radius, size_t stopAfter) {
+    // Cells no smaller than needed for ~4 keypoints each, which bounds the grid size
+    const float minCell = std::sqrt(static_cast<float>(size.area()) / (4.0f * kps.size() + 1.0f));
+    const float cell = std::max({radius, minCell, 1.0f});
+    const int cols = static_cast<int>(size.width / cell) + 1, rows = static_cast<int>(size.height / cell) + 1;
+    std::vector<std::vector<int>> grid(static_cast<size_t>(cols) * rows);
+    const float r2 = radius * radius;
+    std::vector<int> kept;
+    for (int k : order) {
+        const cv::Point2f p = kps[k].pt;
+        const int cx = std::min(std::max(static_cast<int>(p.x / cell), 0), cols - 1);
+        const int cy = std::min(std::max(static_cast<int>(p.y / cell), 0), rows - 1);
+        bool free = true;
+        for (int y = std::max(cy - 1, 0); free && y <= std::min(cy + 1, rows - 1); ++y)
+            for (int x = std::max(cx - 1, 0); free && x <= std::min(cx + 1, cols - 1); ++x)
+                for (int s : grid[static_cast<size_t>(y) * cols + x]) {
+                    const cv::Point2f d = kps[s].pt - p;
+                    if (d.dot(d) < r2) { free = false; break; }
+                }
+        if (!free) continue;
+        grid[static_cast<size_t>(cy) * cols + cx].push_back(k);
+        kept.push_back(k);
+        if (kept.size() > stopAfter) break;
+    }
+    return kept;
+}
+
+// Strongest keypoints per grid cell, then the strongest of the rest until the cap is reached
+static std::vector<int> gridTopK(const std::vector<cv::KeyPoint>& kps, const std::vector<int>& order, cv::Size size,
+                                 int cells, size_t maxKeypoints) {
+    const float cell = std::max(size.width, size.height) / static_cast<float>(std::max(1, cells));
+    const int cols = std::max(1, static_cast<int>(std::ceil(size.width / cell)));
+    const int rows = std::max(1, static_cast<int>(std::ceil(size.height / cell)));
+    const size_t quota = (maxKeypoints + cols * rows - 1) / (cols * rows);
+    std::vector<size_t> taken(static_cast<size_t>(cols) * rows, 0);
+    std::vector<int> kept, rest;
+    for (int k : order) {
+        const int cx = std::min(std::max(static_cast<int>(kps[k].pt.x / cell), 0), cols - 1);
+        const int cy = std::min(std::max(static_cast<int>(kps[k].pt.y / cell), 0), rows - 1);
+        size_t& t = taken[static_cast<size_t>(cy) * cols + cx];
+        if (t < quota) { ++t; kept.push_back(k); }
+        else rest.push_back(k);
+    }
+    // Weak or empty cells leave room for the strongest keypoints of crowded ones
+    for (size_t r = 0; kept.size() < maxKeypoints && r < rest.size(); ++r) kept.push_back(rest[r]);
+    if (kept.size() > maxKeypoints) {
+        std::partial_sort(kept.begin(), kept.begin() + maxKeypoints, kept.end(),
+                          [&](int a, int b) { return kps[a].response > kps[b].response; });
+        kept.resize(maxKeypoints);
+    }
+    return kept;
+}
+
+std::vector<int> selectKeypoints(const std::vector<cv::KeyPoint>& kps, cv::Size imgSize, const KeypointSelection& sel) {
+    const size_t cap = static_cast<size_t>(std::max(1, sel.maxKeypoints));
+    std::vector<int> kept;
+    if (sel.method == KeypointSelect::NONE || kps.size() <= cap) {
+        kept.resize(kps.size());
+        std::iota(kept.begin(), kept.end(), 0);
+        return kept;
+    }
+    const std::vector<int> order = byResponse(kps);
+    if (sel.method == KeypointSelect::GRID) {
+        kept = gridTopK(kps, order, imgSize, sel.gridCells, cap);
+    } else {
+        // Survivors fall as the radius grows: bisect for the smallest radius leaving at most cap
+        float lo = 0.0f, hi = std::hypot(static_cast<float>(imgSize.width), static_cast<float>(imgSize.height));
+        while (hi - lo > 0.5f) {
+            const float mid = 0.5f * (lo + hi);
+            if (suppress(kps, order, imgSize, mid, cap).size() > cap) lo = mid;
+            else hi = mid;
+        }
+        kept = suppress(kps, order, imgSize, hi, cap);
+    }
+    std::sort(kept.begin(), kept.end());
+    return kept;
+}
+
+// Caps OpenCV's own parallel_for_ threads while the pool is busy, so that
+// workers x internal threads does not oversubscribe the cores. The setting is process-wide and
+// feature stages of concurrent stitches (batch sets, daemon requests, previews) overlap, so the
+// caps are reference counted: the first holder saves and caps, the last one restores.
+class CvThreadCap {
+public:
+    explicit CvThreadCap(int workers) {
+        std::lock_guard<std::mutex> lk(mtx());
+        if (holders()++ > 0) return;
+        saved() = cv::getNumThreads();
+        int hw = std::max(1u, std::thread::hardware_concurrency());
+        cv::setNumThreads(std::max(1, hw / std::max(1, workers)));
+    }
+    ~CvThreadCap() {
+        std::lock_guard<std::mutex> lk(mtx());
+        if (--holders() == 0) cv::setNumThreads(saved());
+    }
+    CvThreadCap(const CvThreadCap&) = delete;
+    CvThreadCap& operator=(const CvThreadCap&) = delete;
+private:
+    static std::mutex& mtx() { static std::mutex m; return m; }
+    static int& holders() { static int n = 0; return n; }
+    static int& saved() { static int s = 0; return s; }
+};
+
+// Feature2D instances are not safe to use from two threads at once, so every call borrows an
+// idle one from a process-wide free list and hands it back afterwards. Short-lived threads (the
+// pipelined describe thread, request workers) reuse detectors just like long-lived pool workers;
+// the list grows to the largest number of concurrent calls.
+class DetectorLease {
+public:
+    explicit DetectorLease(Detector d) : d_(d) {
+        {
+            std::lock_guard<std::mutex> lk(mtx());
+            auto& spare = idle()[static_cast<int>(d_)];
+            if (!spare.empty()) { det_ = spare.back(); spare.pop_back(); }
+        }
+        if (!det_) det_ = createDetector(d_);
+    }
+    ~DetectorLease() {
+        std::lock_guard<std::mutex> lk(mtx());
+        idle()[static_cast<int>(d_)].push_back(det_);
+    }
+    DetectorLease(const DetectorLease&) = delete;
+    DetectorLease& operator=(const DetectorLease&) = delete;
+    cv::Feature2D* operator->() const { return det_.get(); }
+private:
+    static std::mutex& mtx() { static std::mutex m; return m; }
+    static std::vector<cv::Ptr<cv::Feature2D>>* idle() {
+        static auto* lists = new std::vector<cv::Ptr<cv::Feature2D>>[3]; // never destroyed, like the scratch pool
+        return lists;
+    }
+    Detector d_;
+    cv::Ptr<cv::Feature2D> det_;
+};
+
+KPDesc describeImage(const cv::Mat& img, Detector d, DetectStats* stats, const cv::Mat& mask,
+                     const KeypointSelection& sel) {
+    DetectorLease det(d);
+
+    KPDesc out;
+    auto t0 = std::chrono::high_resolution_clock::now();
+    {
+        VC_TRACE_SCOPE("detect");
+        det->detect(img, out.kps, mask);
+    }
+    const int detected = static_cast<int>(out.kps.size());
+    if (sel.method != KeypointSelect::NONE) {
+        VC_TRACE_SCOPE("select keypoints");
+        std::vector<cv::KeyPoint> kept;
+        for (int k : selectKeypoints(out.kps, img.size(), sel)) kept.push_back(out.kps[k]);
+        out.kps.swap(kept);
+    }
+    auto t1 = std::chrono::high_resolution_clock::now();
+    {
+        VC_TRACE_SCOPE("describe");
+        det->compute(img, out.kps, out.desc);
+    }
+    auto t2 = std::chrono::high_resolution_clock::now();
+    if (stats) {
+        stats->detectMs = std::chrono::duration<double, std::milli>(t1 - t0).count();
+        stats->describeMs = std::chrono::duration<double, std::milli>(t2 - t1).count();
+        stats->detected = detected;
+    }
+    return out;
+}
+
+KPDesc describeCached(const FeatureCache* cache, const cv::Mat& img, Detector d, DetectStats* stats,
+                      const cv::Mat& mask, const KeypointSelection& sel) {
+    if (!cache) return describeImage(img, d, stats, mask, sel);
+    auto t0 = std::chrono::high_resolution_clock::now();
+    KPDesc out;
+    std::string key;
+    bool hit;
+    {
+        VC_TRACE_SCOPE("feature cache load");
+        key = FeatureCache::key(img, d, mask, sel);
+        hit = cache->load(key, out);
+    }
+    auto t1 = std::chrono::high_resolution_clock::now();
+    double cacheMs = std::chrono::duration<double, std::milli>(t1 - t0).count();
+    if (!hit) {
+        out = describeImage(img, d, stats, mask, sel);
+        auto t2 = std::chrono::high_resolution_clock::now();
+        VC_TRACE_SCOPE("feature cache store");
+        cache->store(key, out);
+        cacheMs += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t2).count();
+    }
+    if (stats) { stats->cache = hit ? 1 : 0; stats->cacheMs = cacheMs; }
+    return out;
+}
+
+std::vector<KPDesc> extractFeatures(const std::vector<cv::Mat>& imgs, Detector d, ThreadPool& pool,
+                                    std::vector<DetectStats>* stats,
+                                    const std::vector<cv::Mat>* masks,
+                                    const FeatureCache* cache,
+                                    const KeypointSelection& sel) {
+    std::vector<KPDesc> feats(imgs.size());
+    if (stats) stats->assign(imgs.size(), DetectStats());
+    const int n = static_cast<int>(imgs.size());
+    CvThreadCap cap(std::min(n, pool.size() + 1));
+    pool.parallelFor(n, [&](int i) {
+        feats[i] = describeCached(cache, imgs[i], d, stats ? &(*stats)[i] : nullptr, masks ? (*masks)[i] : cv::Mat(), sel);
+    });
+    return feats;
 }
 }
@@ -1,4 +1,5 @@
 #include "homography.hpp"
+#include "trace.hpp"
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/calib3d.hpp>
@@ -90,6 +91,7 @@ cv::Mat ransacHomography(const std::vector<cv::Point2f>& srcPts,
                          const std::vector<cv::Point2f>& dstPts,
                          int iterations, double thresh,
                          std::vector<unsigned char>& inlierMask) {
+    VC_TRACE_SCOPE("ransac");
     CV_Assert(srcPts.size() == dstPts.size());
     const int n = static_cast<int>(srcPts.size());
     inlierMask.assign(n, 0);
@@ -0,0 +1,400 @@
+#include "incremental.hpp"
+#include "bundle.hpp"
+#include "compose.hpp"
+#include "feature_cache.hpp"
+#include "match_graph.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "overlap.hpp"
+#include "resolution.hpp"
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+
+namespace vc {
+namespace fs = std::filesystem;
+
+namespace {
+constexpr int kStateVersion = 4;
+constexpr int kTileSize = 512;    // canvas tile side, compose-scale pixels
+constexpr size_t kNeighbours = 3; // placed images a new one is matched against
+
+const MetricTable kIncrementalTable{"incremental", {
+    {"run_id", 0}, {"fresh", 0}, {"reused_images", 0}, {"new_images", 0}, {"placed_images", 0}, {"recovered_images", 0},
+    {"matched_pairs", 0},
+    {"tiles", 0}, {"recomposed_tiles", 0}, {"time_ms", 3}}};
+
+struct ImageState {
+    std::string path, fileKey;  // fileKey: size and modification time of the file
+    std::string featureKey;     // FeatureCache entry of its work-scale features
+    cv::Size size;              // input resolution
+    cv::Mat toRef;              // work scale, empty = not placed
+};
+
+struct SetState {
+    std::string detector, blend;
+    std::string keypoints;                          // toString(KeypointSelection) of the stored features
+    double ratio = 0.0, reprojThresh = 0.0;         // matching parameters of the stored inliers and transforms
+    int ransacIter = 0, minInliers = 0;
+    double workMegapix = 0.0, composeMegapix = 0.0; // budgets the scales were derived from
+    double workScale = 1.0, composeScale = 1.0;
+    std::vector<ImageState> images;
+    std::vector<PairCorrespondences> corrs; // work-scale inliers of every accepted pair
+    std::set<std::pair<int,int>> tiles;     // tiles stored on disk
+};
+
+std::string fileKey(const std::string& path) {
+    std::error_code ec;
+    const auto size = fs::file_size(path, ec);
+    const auto mtime = fs::last_write_time(path, ec).time_since_epoch().count();
+    return std::to_string(size) + ":" + std::to_string(mtime);
+}
+
+bool loadState(const std::string& path, SetState& st) {
+    cv::FileStorage fsIn;
+    try { if (!fsIn.open(path, cv::FileStorage::READ)) return false; } catch (const cv::Exception&) { return false; }
+    if (static_cast<int>(fsIn["version"]) != kStateVersion) return false;
+    fsIn["detector"] >> st.detector;
+    fsIn["blend"] >> st.blend;
+    fsIn["keypoint_select"] >> st.keypoints;
+    fsIn["ratio"] >> st.ratio;
+    fsIn["ransac_iter"] >> st.ransacIter;
+    fsIn["reproj_th"] >> st.reprojThresh;
+    fsIn["min_inliers"] >> st.minInliers;
+    fsIn["work_megapix"] >> st.workMegapix;
+    fsIn["compose_megapix"] >> st.composeMegapix;
+    fsIn["work_scale"] >> st.workScale;
+    fsIn["compose_scale"] >> st.composeScale;
+    for (const auto& node : fsIn["images"]) {
+        ImageState im;
+        node["path"] >> im.path;
+        node["file_key"] >> im.fileKey;
+        node["feature_key"] >> im.featureKey;
+        im.size = cv::Size(static_cast<int>(node["width"]), static_cast<int>(node["height"]));
+        node["to_ref"] >> im.toRef;
+        st.images.push_back(im);
+    }
+    for (const auto& node : fsIn["pairs"]) {
+        PairCorrespondences pc;
+        pc.a = static_cast<int>(node["a"]);
+        pc.b = static_cast<int>(node["b"]);
+        node["pts_a"] >> pc.ptsA;
+        node["pts_b"] >> pc.ptsB;
+        st.corrs.push_back(std::move(pc));
+    }
+    std::vector<int> tiles;
+    fsIn["tiles"] >> tiles;
+    for (size_t t = 0; t + 1 < tiles.size(); t += 2) st.tiles.emplace(tiles[t], tiles[t + 1]);
+    return true;
+}
+
+// Written beside the old state and renamed over it, so an interrupted run leaves the old one intact
+void saveState(const std::string& path, const SetState& st) {
+    const std::string tmp = path + ".tmp.yml";
+    {
+        cv::FileStorage out(tmp, cv::FileStorage::WRITE);
+        out << "version" << kStateVersion << "detector" << st.detector << "blend" << st.blend
+            << "keypoint_select" << st.keypoints
+            << "ratio" << st.ratio << "ransac_iter" << st.ransacIter << "reproj_th" << st.reprojThresh
+            << "min_inliers" << st.minInliers
+            << "work_megapix" << st.workMegapix << "compose_megapix" << st.composeMegapix
+            << "work_scale" << st.workScale << "compose_scale" << st.composeScale;
+        out << "images" << "[";
+        for (const auto& im : st.images)
+            out << "{" << "path" << im.path << "file_key" << im.fileKey << "feature_key" << im.featureKey
+                << "width" << im.size.width << "height" << im.size.height << "to_ref" << im.toRef << "}";
+        out << "]" << "pairs" << "[";
+        for (const auto& pc : st.corrs)
+            out << "{" << "a" << pc.a << "b" << pc.b << "pts_a" << pc.ptsA << "pts_b" << pc.ptsB << "}";
+        out << "]";
+        std::vector<int> tiles;
+        for (const auto& t : st.tiles) { tiles.push_back(t.first); tiles.push_back(t.second); }
+        out << "tiles" << tiles;
+    }
+    fs::rename(tmp, path);
+}
+
+std::string tilePath(const std::string& stateDir, const std::pair<int,int>& t) {
+    return stateDir + "/tiles/" + std::to_string(t.first) + "_" + std::to_string(t.second) + ".png";
+}
+
+int floorDiv(int a, int b) { return a >= 0 ? a / b : -((-a + b - 1) / b); }
+}
+
+cv::Mat stitchIncremental(const std::vector<std::string>& paths,
+                          Detector detector,
+                          BlendMode blendMode,
+                          int ransacIter,
+                          double reprojThresh,
+                          double ratio,
+                          const std::string& stateDir,
+                          const std::string& outDir,
+                          const StitchOptions& opts,
+                          ThreadPool& pool,
+                          IncrementalStats* statsOut) {
+    auto t0 = std::chrono::high_resolution_clock::now();
+    IncrementalStats stats;
+    const int n = static_cast<int>(paths.size());
+    const std::string statePath = stateDir + "/state.yml";
+    fs::create_directories(outDir);
+
+    // Inputs are only decoded when an image is new or has to be recomposited
+    std::vector<cv::Mat> inputs(n);
+    auto input = [&](int i) -> const cv::Mat& {
+        if (inputs[i].empty()) {
+            VC_TRACE_SCOPE("decode");
+            inputs[i] = cv::imread(paths[i]);
+            if (inputs[i].empty()) throw std::runtime_error("Failed to read " + paths[i]);
+        }
+        return inputs[i];
+    };
+
+    SetState st;
+    const bool loaded = loadState(statePath, st);
+    // The scales follow from the budgets and the first image, which must match as well
+    bool usable = loaded && st.detector == toString(detector) && st.blend == toString(blendMode) &&
+                  st.keypoints == toString(opts.keypoints) &&
+                  st.ratio == ratio && st.ransacIter == ransacIter && st.reprojThresh == reprojThresh &&
+                  st.minInliers == opts.minInliers &&
+                  st.workMegapix == opts.workMegapix && st.composeMegapix == opts.composeMegapix &&
+                  st.images.size() <= paths.size();
+    for (size_t i = 0; usable && i < st.images.size(); ++i)
+        usable = st.images[i].path == paths[i] && st.images[i].fileKey == fileKey(paths[i]);
+    if (!usable) {
+        if (loaded) std::cout << "Incremental: stored set does not match, starting afresh" << std::endl;
+        fs::remove_all(stateDir + "/tiles");
+        fs::remove_all(stateDir + "/thumbs");
+        st = SetState();
+        st.detector = toString(detector);
+        st.blend = toString(blendMode);
+        st.keypoints = toString(opts.keypoints);
+        st.ratio = ratio;
+        st.ransacIter = ransacIter;
+        st.reprojThresh = reprojThresh;
+        st.minInliers = opts.minInliers;
+        st.workMegapix = opts.workMegapix;
+        st.composeMegapix = opts.composeMegapix;
+        if (n > 0) {
+            const cv::Size s0 = input(0).size();
+            st.workScale = scaleForBudget(s0, opts.workMegapix);
+            st.composeScale = scaleForBudget(s0, opts.composeMegapix);
+        }
+        stats.fresh = true;
+    }
+    fs::create_directories(stateDir + "/tiles");
+    fs::create_directories(stateDir + "/thumbs");
+    FeatureCache cache(stateDir + "/features");
+    const Distance distType = detector == Detector::ORB ? Distance::HAMMING : Distance::L2;
+    const double toCompose = st.composeScale / st.workScale;
+
+    stats.reused = static_cast<int>(st.images.size());
+    stats.added = n - stats.reused;
+    std::cout << "Incremental: " << stats.reused << " stored images, " << stats.added << " new" << std::endl;
+
+    std::vector<KPDesc> feats(n);
+    std::vector<cv::Mat> thumbs(n);
+    auto features = [&](int i) -> const KPDesc& {
+        ImageState& im = st.images[i];
+        if (feats[i].kps.empty() && (im.featureKey.empty() || !cache.load(im.featureKey, feats[i]))) {
+            const cv::Mat work = resized(input(i), st.workScale);
+            im.featureKey = FeatureCache::key(work, detector, cv::Mat(), opts.keypoints);
+            feats[i] = describeImage(work, detector, nullptr, cv::Mat(), opts.keypoints);
+            cache.store(im.featureKey, feats[i]);
+        }
+        return feats[i];
+    };
+    auto thumbnail = [&](int i) -> const cv::Mat& {
+        if (thumbs[i].empty()) thumbs[i] = cv::imread(stateDir + "/thumbs/" + std::to_string(i) + ".png");
+        return thumbs[i];
+    };
+    auto footprint = [&](int i) {
+        return warpedBounds(scaledSize(st.images[i].size, st.composeScale), rescaleHomography(st.images[i].toRef, toCompose));
+    };
+
+    std::vector<cv::Rect> dirty; // compose-frame regions whose tiles have to be rebuilt
+    // Matches image k against its likely neighbours among the placed images, places it through
+    // its best pair and re-optimises it together with the neighbours it matched
+    auto place = [&](int k) {
+        const int m = static_cast<int>(st.images.size());
+        // Likely neighbours: placed images whose thumbnails phase-correlate with this one
+        std::vector<int> placed;
+        std::vector<cv::Mat> candThumbs;
+        for (int p = 0; p < m; ++p) {
+            if (p == k || st.images[p].toRef.empty() || thumbnail(p).empty()) continue;
+            placed.push_back(p);
+            candThumbs.push_back(thumbs[p]);
+        }
+        if (placed.empty() || thumbnail(k).empty()) return false;
+        candThumbs.push_back(thumbs[k]);
+        std::vector<std::pair<int,int>> candidates;
+        for (int c = 0; c < static_cast<int>(placed.size()); ++c) candidates.emplace_back(c, static_cast<int>(placed.size()));
+        std::vector<OverlapEstimate> est = estimateOverlaps(candThumbs, candidates, pool, opts.prepassPx);
+        std::sort(est.begin(), est.end(), [](const OverlapEstimate& a, const OverlapEstimate& b) {
+            return a.valid != b.valid ? a.valid : a.overlap * a.ncc > b.overlap * b.ncc;
+        });
+        std::vector<std::pair<int,int>> pairs;
+        for (const auto& e : est) if (e.valid && pairs.size() < kNeighbours) pairs.emplace_back(placed[e.i], k);
+        // Nothing correlated: the placed images closest in capture order
+        if (pairs.empty()) {
+            std::stable_sort(placed.begin(), placed.end(), [k](int a, int b) { return std::abs(a - k) < std::abs(b - k); });
+            for (size_t c = 0; c < placed.size() && pairs.size() < 2; ++c) pairs.emplace_back(placed[c], k);
+        }
+        for (const auto& pr : pairs) features(pr.first);
+        features(k);
+
+        std::vector<PairMatch> pms = matchPairs(feats, pairs, distType, ratio, ransacIter, reprojThresh, pool);
+        stats.pairsMatched += static_cast<int>(pms.size());
+        const PairMatch* best = nullptr;
+        std::vector<int> neighbours;
+        for (const auto& pm : pms) {
+            if (pm.H.empty() || pm.inliers < opts.minInliers) continue;
+            if (!best || pm.inliers > best->inliers) best = &pm;
+            neighbours.push_back(pm.i);
+            PairCorrespondences pc; pc.a = pm.i; pc.b = pm.j;
+            for (size_t t = 0; t < pm.matches.size(); ++t) {
+                if (!pm.inlierMask[t]) continue;
+                pc.ptsA.push_back(feats[pm.i].kps[pm.matches[t].queryIdx].pt);
+                pc.ptsB.push_back(feats[pm.j].kps[pm.matches[t].trainIdx].pt);
+            }
+            st.corrs.push_back(std::move(pc));
+        }
+        if (!best) return false;
+        // H maps image k into its neighbour
+        st.images[k].toRef = st.images[best->i].toRef * best->H;
+
+        // Local re-optimisation: the image and its matched neighbours move, the rest is held
+        std::vector<bool> fixed(m, true);
+        fixed[k] = false;
+        for (int p : neighbours) fixed[p] = false;
+        std::vector<cv::Mat> toRef(m);
+        std::vector<cv::Rect> before(m);
+        for (int i = 0; i < m; ++i) {
+            toRef[i] = st.images[i].toRef;
+            if (!fixed[i] && i != k) before[i] = footprint(i);
+        }
+        std::vector<PairCorrespondences> local;
+        for (const auto& pc : st.corrs) if (!fixed[pc.a] || !fixed[pc.b]) local.push_back(pc);
+        refineHomographies(toRef, local, 0, pool, opts.bundleIterations, reprojThresh, &fixed);
+        for (int i = 0; i < m; ++i) {
+            if (fixed[i]) continue;
+            st.images[i].toRef = toRef[i];
+            if (i != k) dirty.push_back(before[i]);
+            dirty.push_back(footprint(i));
+        }
+        std::cout << "  image " << k << ": placed via " << best->i << " (" << best->inliers << " inliers, "
+                  << neighbours.size() << " neighbours)" << std::endl;
+        return true;
+    };
+
+    for (int k = stats.reused; k < n; ++k) {
+        ImageState im;
+        im.path = paths[k];
+        im.fileKey = fileKey(paths[k]);
+        im.size = input(k).size();
+        st.images.push_back(im);
+        const double s = std::min(1.0, opts.prepassPx / static_cast<double>(std::max(im.size.width, im.size.height)));
+        thumbs[k] = resized(input(k), s);
+        cv::imwrite(stateDir + "/thumbs/" + std::to_string(k) + ".png", thumbs[k]);
+        features(k);
+
+        if (k == 0) {
+            st.images[0].toRef = cv::Mat::eye(3, 3, CV_64F);
+            dirty.push_back(footprint(0));
+            ++stats.placed;
+        } else if (place(k)) {
+            ++stats.placed;
+        }
+    }
+    // Images left unplaced, by this run or an earlier one, may connect through the new placements;
+    // retried until a pass places nothing more
+    for (bool progress = stats.placed > 0; progress; ) {
+        progress = false;
+        for (int k = 0; k < n; ++k) {
+            if (!st.images[k].toRef.empty() || !place(k)) continue;
+            progress = true;
+            if (k < stats.reused) ++stats.recovered;
+            else ++stats.placed;
+        }
+    }
+    for (int k = 0; k < n; ++k)
+        if (st.images[k].toRef.empty()) std::cout << "  image " << k << ": no neighbour matched, not placed" << std::endl;
+
+    // Tiles touched by anything that moved or was added are rebuilt from every image over them
+    std::set<std::pair<int,int>> touched;
+    for (const auto& r : dirty) {
+        if (r.empty()) continue;
+        for (int ty = floorDiv(r.y, kTileSize); ty <= floorDiv(r.br().y - 1, kTileSize); ++ty)
+            for (int tx = floorDiv(r.x, kTileSize); tx <= floorDiv(r.br().x - 1, kTileSize); ++tx)
+                touched.emplace(tx, ty);
+    }
+    std::vector<cv::Mat> composeImgs(n), composeH(n);
+    std::vector<cv::Rect> footprints(n);
+    std::vector<int> needed;
+    for (int i = 0; i < n; ++i) {
+        if (st.images[i].toRef.empty()) continue;
+        composeH[i] = rescaleHomography(st.images[i].toRef, toCompose);
+        footprints[i] = footprint(i);
+        for (const auto& t : touched) {
+            if ((footprints[i] & cv::Rect(t.first * kTileSize, t.second * kTileSize, kTileSize, kTileSize)).empty()) continue;
+            needed.push_back(i);
+            break;
+        }
+    }
+    for (int i : needed) input(i); // decoded serially, the downscaling runs on the pool
+    pool.parallelFor(static_cast<int>(needed.size()), [&](int t) {
+        composeImgs[needed[t]] = resized(inputs[needed[t]], st.composeScale);
+    });
+    for (const auto& t : touched) {
+        const cv::Rect region(t.first * kTileSize, t.second * kTileSize, kTileSize, kTileSize);
+        cv::Mat tile = composeRegion(composeImgs, composeH, blendMode, region, pool);
+        if (cv::countNonZero(tile.reshape(1)) == 0) {
+            st.tiles.erase(t);
+            fs::remove(tilePath(stateDir, t));
+            continue;
+        }
+        if (!cv::imwrite(tilePath(stateDir, t), tile)) throw std::runtime_error("cannot write " + tilePath(stateDir, t));
+        st.tiles.insert(t);
+    }
+    stats.tilesRecomposed = static_cast<int>(touched.size());
+    stats.tiles = static_cast<int>(st.tiles.size());
+    saveState(statePath, st);
+
+    // Assemble the panorama from the stored tiles
+    cv::Rect bounds;
+    for (int i = 0; i < n; ++i) if (!footprints[i].empty()) bounds = bounds.empty() ? footprints[i] : (bounds | footprints[i]);
+    cv::Mat pano;
+    if (!bounds.empty()) {
+        pano = cv::Mat(bounds.size(), CV_8UC3, cv::Scalar::all(0));
+        for (const auto& t : st.tiles) {
+            const cv::Rect region(t.first * kTileSize, t.second * kTileSize, kTileSize, kTileSize);
+            const cv::Rect inter = region & bounds;
+            if (inter.empty()) continue;
+            cv::Mat tile = cv::imread(tilePath(stateDir, t));
+            if (tile.empty()) continue;
+            tile(inter - region.tl()).copyTo(pano(inter - bounds.tl()));
+        }
+        cv::Mat gray;
+        cv::cvtColor(pano, gray, cv::COLOR_BGR2GRAY);
+        std::vector<cv::Point> pts;
+        cv::findNonZero(gray > 1, pts);
+        if (!pts.empty()) pano = pano(cv::boundingRect(pts)).clone();
+    }
+
+    stats.ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count();
+    std::cout << "Incremental: placed " << stats.placed << "/" << stats.added << " new and " << stats.recovered
+              << " previously unplaced images, recomposited "
+              << stats.tilesRecomposed << "/" << stats.tiles << " tiles in " << stats.ms << " ms" << std::endl;
+    metrics().record(kIncrementalTable, metrics().intern(outDir), opts.metricsFormat,
+                     metrics().intern(outDir.substr(outDir.find_last_of('/') + 1)), stats.fresh, stats.reused, stats.added,
+                     stats.placed, stats.recovered, stats.pairsMatched, stats.tiles, stats.tilesRecomposed, stats.ms);
+    if (statsOut) *statsOut = stats;
+    return pano;
+}
+}
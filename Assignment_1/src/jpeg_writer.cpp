@@ -0,0 +1,282 @@
+#include "jpeg_writer.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+
+namespace vc {
+namespace {
+// Natural (row-major) index of the k-th coefficient in zig-zag order
+const int kZigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63 };
+
+// ITU-T T.81 Annex K quantisation tables, natural order
+const int kLumaQuant[64] = {
+    16, 11, 10, 16,  24,  40,  51,  61,  12, 12, 14, 19,  26,  58,  60,  55,
+    14, 13, 16, 24,  40,  57,  69,  56,  14, 17, 22, 29,  51,  87,  80,  62,
+    18, 22, 37, 56,  68, 109, 103,  77,  24, 35, 55, 64,  81, 104, 113,  92,
+    49, 64, 78, 87, 103, 121, 120, 101,  72, 92, 95, 98, 112, 100, 103,  99 };
+const int kChromaQuant[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99,  18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99,  47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,  99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,  99, 99, 99, 99, 99, 99, 99, 99 };
+
+// Annex K Huffman tables: code counts per length 1..16, then symbols
+const uint8_t kDcLumaBits[16] = {0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0};
+const uint8_t kDcChromaBits[16] = {0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+const uint8_t kDcVals[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+const uint8_t kAcLumaBits[16] = {0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d};
+const uint8_t kAcLumaVals[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+    0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+    0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+    0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+    0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+    0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+    0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa };
+const uint8_t kAcChromaBits[16] = {0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77};
+const uint8_t kAcChromaVals[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+    0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+    0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+    0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+    0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+    0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+    0xf9, 0xfa };
+
+struct HuffTable { uint16_t code[256] = {}; uint8_t size[256] = {}; };
+
+HuffTable buildHuffTable(const uint8_t* bits, const uint8_t* vals) {
+    HuffTable t;
+    int code = 0, k = 0;
+    for (int len = 1; len <= 16; ++len) {
+        for (int c = 0; c < bits[len-1]; ++c, ++k) {
+            t.code[vals[k]] = static_cast<uint16_t>(code++);
+            t.size[vals[k]] = static_cast<uint8_t>(len);
+        }
+        code <<= 1;
+    }
+    return t;
+}
+
+// Quality scaling as in libjpeg's jpeg_quality_scaling / jpeg_add_quant_table (baseline)
+void scaleQuant(const int* base, int quality, int* out) {
+    quality = std::min(100, std::max(1, quality));
+    const int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    for (int i = 0; i < 64; ++i) out[i] = std::min(255, std::max(1, (base[i] * scale + 50) / 100));
+}
+
+// Reciprocal divisors that fold the AAN output scaling into quantisation (libjpeg's float path)
+void aanDivisors(const int* quant, float* out) {
+    static const double aan[8] = {1.0, 1.387039845, 1.306562965, 1.175875602,
+                                  1.0, 0.785694958, 0.541196100, 0.275899379};
+    for (int r = 0; r < 8; ++r)
+        for (int c = 0; c < 8; ++c)
+            out[r*8 + c] = static_cast<float>(1.0 / (quant[r*8 + c] * aan[r] * aan[c] * 8.0));
+}
+
+// Arai-Agui-Nakajima forward DCT, in place on rows then columns (outputs scaled, see aanDivisors)
+inline void fdct8(float* d, int stride) {
+    float tmp0 = d[0] + d[7*stride], tmp7 = d[0] - d[7*stride];
+    float tmp1 = d[stride] + d[6*stride], tmp6 = d[stride] - d[6*stride];
+    float tmp2 = d[2*stride] + d[5*stride], tmp5 = d[2*stride] - d[5*stride];
+    float tmp3 = d[3*stride] + d[4*stride], tmp4 = d[3*stride] - d[4*stride];
+
+    float tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+    float tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+    d[0] = tmp10 + tmp11;
+    d[4*stride] = tmp10 - tmp11;
+    float z1 = (tmp12 + tmp13) * 0.707106781f;
+    d[2*stride] = tmp13 + z1;
+    d[6*stride] = tmp13 - z1;
+
+    tmp10 = tmp4 + tmp5; tmp11 = tmp5 + tmp6; tmp12 = tmp6 + tmp7;
+    float z5 = (tmp10 - tmp12) * 0.382683433f;
+    float z2 = 0.541196100f * tmp10 + z5;
+    float z4 = 1.306562965f * tmp12 + z5;
+    float z3 = tmp11 * 0.707106781f;
+    float z11 = tmp7 + z3, z13 = tmp7 - z3;
+    d[5*stride] = z13 + z2;
+    d[3*stride] = z13 - z2;
+    d[stride] = z11 + z4;
+    d[7*stride] = z11 - z4;
+}
+
+// Entropy-coded segment writer with 0xFF byte stuffing
+class JpegBitWriter {
+public:
+    explicit JpegBitWriter(std::vector<uchar>& out) : out_(out) {}
+    void put(uint32_t bits, int n) {
+        acc_ = (acc_ << n) | (bits & ((1u << n) - 1));
+        count_ += n;
+        while (count_ >= 8) {
+            const uchar b = static_cast<uchar>(acc_ >> (count_ - 8));
+            out_.push_back(b);
+            if (b == 0xFF) out_.push_back(0);
+            count_ -= 8;
+        }
+    }
+    // Pads the last byte with 1 bits, as required before a marker
+    void flush() { if (count_ > 0) put(0x7F, 8 - count_); }
+    void marker(uchar m) { out_.push_back(0xFF); out_.push_back(m); }
+private:
+    std::vector<uchar>& out_;
+    uint64_t acc_ = 0;
+    int count_ = 0;
+};
+
+inline int bitLength(int v) { return v == 0 ? 0 : 32 - __builtin_clz(static_cast<unsigned>(v)); }
+
+void encodeBlock(JpegBitWriter& bw, float* blk, const float* div, int& prevDc,
+                 const HuffTable& dc, const HuffTable& ac) {
+    for (int r = 0; r < 8; ++r) fdct8(blk + r*8, 1);
+    for (int c = 0; c < 8; ++c) fdct8(blk + c, 8);
+    int q[64];
+    for (int k = 0; k < 64; ++k) {
+        const float v = blk[kZigzag[k]] * div[kZigzag[k]];
+        q[k] = static_cast<int>(v + (v >= 0.f ? 0.5f : -0.5f));
+    }
+
+    const int diff = q[0] - prevDc;
+    prevDc = q[0];
+    const int dcLen = bitLength(std::abs(diff));
+    bw.put(dc.code[dcLen], dc.size[dcLen]);
+    if (dcLen) bw.put(static_cast<uint32_t>(diff < 0 ? diff - 1 : diff), dcLen);
+
+    int run = 0;
+    for (int k = 1; k < 64; ++k) {
+        if (q[k] == 0) { ++run; continue; }
+        while (run > 15) { bw.put(ac.code[0xF0], ac.size[0xF0]); run -= 16; }
+        const int len = bitLength(std::abs(q[k]));
+        const int sym = (run << 4) | len;
+        bw.put(ac.code[sym], ac.size[sym]);
+        bw.put(static_cast<uint32_t>(q[k] < 0 ? q[k] - 1 : q[k]), len);
+        run = 0;
+    }
+    if (run > 0) bw.put(ac.code[0x00], ac.size[0x00]); // EOB
+}
+
+void putMarkerSegment(std::vector<uchar>& out, uchar marker, const std::vector<uchar>& payload) {
+    out.push_back(0xFF); out.push_back(marker);
+    const size_t len = payload.size() + 2;
+    out.push_back(static_cast<uchar>(len >> 8)); out.push_back(static_cast<uchar>(len & 0xFF));
+    out.insert(out.end(), payload.begin(), payload.end());
+}
+
+void appendHuff(std::vector<uchar>& p, uchar classId, const uint8_t* bits, const uint8_t* vals) {
+    p.push_back(classId);
+    int n = 0;
+    for (int i = 0; i < 16; ++i) { p.push_back(bits[i]); n += bits[i]; }
+    p.insert(p.end(), vals, vals + n);
+}
+}
+
+bool encodeJpeg(const cv::Mat& img, int quality, ThreadPool& pool, std::vector<uchar>& out) {
+    VC_TRACE_SCOPE("encode");
+    if (img.empty() || img.type() != CV_8UC3 || img.cols > 65535 || img.rows > 65535) return false;
+    const int W = img.cols, H = img.rows;
+    const int mcusX = (W + 15) / 16, mcusY = (H + 15) / 16;
+
+    int lumaQ[64], chromaQ[64];
+    scaleQuant(kLumaQuant, quality, lumaQ);
+    scaleQuant(kChromaQuant, quality, chromaQ);
+    float lumaDiv[64], chromaDiv[64];
+    aanDivisors(lumaQ, lumaDiv);
+    aanDivisors(chromaQ, chromaDiv);
+    static const HuffTable dcLuma = buildHuffTable(kDcLumaBits, kDcVals);
+    static const HuffTable dcChroma = buildHuffTable(kDcChromaBits, kDcVals);
+    static const HuffTable acLuma = buildHuffTable(kAcLumaBits, kAcLumaVals);
+    static const HuffTable acChroma = buildHuffTable(kAcChromaBits, kAcChromaVals);
+
+    // Strips of whole MCU rows; a few per worker so uneven rows still balance
+    const int strips = std::min(mcusY, 4 * (pool.size() + 1));
+    const int rowsPerStrip = (mcusY + strips - 1) / strips;
+    std::vector<std::vector<uchar>> segments(strips);
+    pool.parallelFor(strips, [&](int s) {
+        VC_TRACE_SCOPE("encode strip");
+        std::vector<uchar>& seg = segments[s];
+        seg.reserve(static_cast<size_t>(rowsPerStrip) * mcusX * 256);
+        JpegBitWriter bw(seg);
+        const int r0 = s * rowsPerStrip, r1 = std::min(mcusY, r0 + rowsPerStrip);
+        float Y[4][64], Cb[64], Cr[64];
+        const uchar* rows[16];
+        for (int my = r0; my < r1; ++my) {
+            int dcY = 0, dcCb = 0, dcCr = 0; // predictors restart with every MCU row
+            // Edge MCUs replicate the last row/column
+            for (int py = 0; py < 16; ++py) rows[py] = img.ptr<uchar>(std::min(H - 1, my * 16 + py));
+            for (int mx = 0; mx < mcusX; ++mx) {
+                std::fill(Cb, Cb + 64, 0.f);
+                std::fill(Cr, Cr + 64, 0.f);
+                const int x0 = mx * 16, xLast = std::min(16, W - x0) - 1;
+                for (int py = 0; py < 16; ++py) {
+                    const uchar* row = rows[py] + 3 * x0;
+                    for (int px = 0; px < 16; ++px) {
+                        const uchar* p = row + 3 * std::min(px, xLast);
+                        const float b = p[0], g = p[1], r = p[2];
+                        Y[(py / 8) * 2 + px / 8][(py % 8) * 8 + px % 8] = 0.299f*r + 0.587f*g + 0.114f*b - 128.f;
+                        const int c = (py / 2) * 8 + px / 2;
+                        Cb[c] += -0.168736f*r - 0.331264f*g + 0.5f*b;
+                        Cr[c] += 0.5f*r - 0.418688f*g - 0.081312f*b;
+                    }
+                }
+                for (int k = 0; k < 64; ++k) { Cb[k] *= 0.25f; Cr[k] *= 0.25f; } // 2x2 mean; +128 -128 cancel
+                for (int b = 0; b < 4; ++b) encodeBlock(bw, Y[b], lumaDiv, dcY, dcLuma, acLuma);
+                encodeBlock(bw, Cb, chromaDiv, dcCb, dcChroma, acChroma);
+                encodeBlock(bw, Cr, chromaDiv, dcCr, dcChroma, acChroma);
+            }
+            bw.flush();
+            if (my + 1 < mcusY) bw.marker(static_cast<uchar>(0xD0 + my % 8)); // RSTn
+        }
+    });
+
+    out.clear();
+    out.push_back(0xFF); out.push_back(0xD8); // SOI
+    putMarkerSegment(out, 0xE0, {'J', 'F', 'I', 'F', 0, 1, 1, 0, 0, 1, 0, 1, 0, 0});
+    std::vector<uchar> p;
+    for (int t = 0; t < 2; ++t) {
+        const int* q = t == 0 ? lumaQ : chromaQ;
+        p.push_back(static_cast<uchar>(t));
+        for (int k = 0; k < 64; ++k) p.push_back(static_cast<uchar>(q[kZigzag[k]]));
+    }
+    putMarkerSegment(out, 0xDB, p); // DQT
+    putMarkerSegment(out, 0xC0, {8, static_cast<uchar>(H >> 8), static_cast<uchar>(H & 0xFF),
+                                 static_cast<uchar>(W >> 8), static_cast<uchar>(W & 0xFF), 3,
+                                 1, 0x22, 0, 2, 0x11, 1, 3, 0x11, 1}); // SOF0
+    p.clear();
+    appendHuff(p, 0x00, kDcLumaBits, kDcVals);
+    appendHuff(p, 0x10, kAcLumaBits, kAcLumaVals);
+    appendHuff(p, 0x01, kDcChromaBits, kDcVals);
+    appendHuff(p, 0x11, kAcChromaBits, kAcChromaVals);
+    putMarkerSegment(out, 0xC4, p); // DHT
+    putMarkerSegment(out, 0xDD, {static_cast<uchar>(mcusX >> 8), static_cast<uchar>(mcusX & 0xFF)}); // DRI
+    putMarkerSegment(out, 0xDA, {3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0}); // SOS
+    size_t total = out.size() + 2;
+    for (const auto& seg : segments) total += seg.size();
+    out.reserve(total);
+    for (const auto& seg : segments) out.insert(out.end(), seg.begin(), seg.end());
+    out.push_back(0xFF); out.push_back(0xD9); // EOI
+    return true;
+}
+
+bool writeJpeg(const std::string& path, const cv::Mat& img, int quality, ThreadPool& pool) {
+    std::vector<uchar> buf;
+    if (!encodeJpeg(img, quality, pool, buf)) return false;
+    VC_TRACE_SCOPE("write file");
+    std::ofstream ofs(path, std::ios::binary);
+    ofs.write(reinterpret_cast<const char*>(buf.data()), static_cast<std::streamsize>(buf.size()));
+    return static_cast<bool>(ofs);
+}
+}
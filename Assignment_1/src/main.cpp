@@ -1,76 +1,79 @@
 #include <opencv2/opencv.hpp>
 #include <iostream>
-#include "preprocess.hpp"
-#include "features.hpp"
-#include "matching.hpp"
-#include "homography.hpp"
-#include "warp.hpp"
-#include "blend.hpp"
-#include "stitch.hpp"
+#include "batch.hpp"
+#include "cli.hpp"
+#include "perf_counters.hpp"
+#include "server.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
 
 int main(int argc, char** argv) {
     if (argc < 3) {
-        std::cout << "Usage: panorama <img1> <img2> [img3 ...]\n";
-        std::cout << "Options: --det [sift|orb|akaze] --blend [overlay|feather] --ratio <0.5-0.95> --ransac <iters> --th <px> --debug\n";
+        vc::printUsage();
         return 0;
     }
-    vc::Detector det = vc::Detector::ORB;
-    vc::BlendMode bm = vc::BlendMode::FEATHER;
-    double ratio = 0.75;
-    int ransacIter = 1000;
-    double reproj = 3.0;
-    bool debug = false;
+    const std::vector<std::string> tokens(argv + 1, argv + argc);
+    vc::CliArgs args;
+    try { vc::parseArgs(tokens, args); }
+    catch (const std::exception& e) { std::cerr << e.what() << std::endl; return 1; }
+    vc::perf::setEnabled(args.perfCounters);
 
-    std::vector<std::string> paths;
-    std::string setId, pairId;
-    for (int i = 1; i < argc; ++i) {
-        std::string a = argv[i];
-        if (a == "--det" && i+1 < argc) {
-            std::string v = argv[++i];
-            if (v == "sift") det = vc::Detector::SIFT;
-            else if (v == "orb") det = vc::Detector::ORB;
-            else if (v == "akaze") det = vc::Detector::AKAZE;
-        } else if (a == "--blend" && i+1 < argc) {
-            std::string v = argv[++i];
-            if (v == "overlay") bm = vc::BlendMode::OVERLAY;
-            else if (v == "feather") bm = vc::BlendMode::FEATHER;
-        } else if (a == "--ratio" && i+1 < argc) {
-            ratio = std::stod(argv[++i]);
-        } else if (a == "--ransac" && i+1 < argc) {
-            ransacIter = std::stoi(argv[++i]);
-        } else if (a == "--th" && i+1 < argc) {
-            reproj = std::stod(argv[++i]);
-        } else if (a == "--debug") {
-            debug = true;
-        } else if (a == "--set" && i+1 < argc) {
-            setId = argv[++i];
-        } else if (a == "--pair" && i+1 < argc) {
-            pairId = argv[++i];
-        } else if (!a.empty() && a[0] != '-') {
-            paths.push_back(a);
+    // The timeline covers whichever mode runs and is written when main returns
+    struct TraceFile {
+        std::string path;
+        ~TraceFile() {
+            if (path.empty()) return;
+            if (vc::trace::write(path)) std::cout << "Trace: " << path << std::endl;
+            else std::cerr << "Failed to write " << path << std::endl;
         }
+    } traceFile;
+    if (!args.tracePath.empty() && args.submitSocket.empty()) {
+#ifndef VC_TRACE
+        std::cerr << "--trace: built without VC_TRACE, the trace will be empty" << std::endl;
+#endif
+        VC_TRACE_THREAD("main");
+        vc::trace::start();
+        traceFile.path = args.tracePath;
     }
 
-    std::vector<cv::Mat> imgs;
-    for (const auto& p : paths) {
-        cv::Mat img = cv::imread(p);
-        if (img.empty()) { std::cerr << "Failed to read " << p << std::endl; return 1; }
-        imgs.push_back(img);
+    try {
+        if (!args.submitSocket.empty()) {
+            // Everything but the socket itself is forwarded to the daemon
+            std::vector<std::string> forward;
+            for (size_t i = 0; i < tokens.size(); ++i) {
+                if (tokens[i] == "--submit") { ++i; continue; }
+                forward.push_back(tokens[i]);
+            }
+            return vc::submit(args.submitSocket, forward);
+        }
+        if (!args.serveSocket.empty()) return vc::serve(args.serveSocket, args);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    // Create unique run directory: results/run_YYYYmmdd_HHMMSS (batch_ for a batch)
+    if (args.outDir.empty()) args.outDir = vc::timestampedRunDir(args.manifest.empty() ? "run" : "batch");
+
+    if (!args.manifest.empty()) {
+        std::vector<vc::BatchJob> jobs;
+        try { jobs = vc::readManifest(args.manifest); }
+        catch (const std::exception& e) { std::cerr << e.what() << std::endl; return 1; }
+        args.batch.tiff = args.streamTiff;
+        args.batch.dzi = args.streamDzi;
+        return vc::runBatch(jobs, args.detector, args.blend, args.ransacIter, args.reprojThresh, args.ratio,
+                            args.debug, args.outDir, args.opts, args.batch) == 0 ? 0 : 1;
     }
-    if (imgs.size() < 2) { std::cout << "Need >=2 images\n"; return 0; }
-    // Create unique run directory: results/run_YYYYmmdd_HHMMSS
-    auto now = std::chrono::system_clock::now();
-    std::time_t t = std::chrono::system_clock::to_time_t(now);
-    std::tm tm = *std::localtime(&t);
-    char buf[64];
-    std::snprintf(buf, sizeof(buf), "results/run_%04d%02d%02d_%02d%02d%02d",
-                  tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
-    std::string outDir = buf;
 
-    cv::Mat pano = vc::stitchImages(imgs, det, bm, ransacIter, reproj, ratio, debug, outDir, setId, pairId);
-    if (pano.empty()) { std::cerr << "Stitch failed\n"; return 1; }
-    std::string outPano = outDir + "/panorama.jpg";
-    cv::imwrite(outPano, pano);
-    std::cout << "Saved: " << outPano << std::endl;
+    if (args.paths.size() < 2 && args.videoPath.empty()) { std::cout << "Need >=2 images\n"; return 0; }
+    // One pool for stitching and for encoding the result
+    vc::ThreadPool pool(args.opts.threads);
+    vc::RunResult res = vc::runStitch(args, pool, [](const vc::RunResult& preview) {
+        if (preview.ok) std::cout << "Preview: " << preview.output << " (" << preview.wallMs << " ms)" << std::endl;
+        else std::cerr << "Preview: " << preview.error << std::endl;
+    });
+    if (!res.ok) { std::cerr << res.error << std::endl; return 1; }
+    if (!args.streamTiff && !args.streamDzi) std::cout << "Saved: " << res.output << std::endl;
+    std::cout << "Peak RSS: " << res.peakRssMB << " MB" << std::endl;
     return 0;
 }
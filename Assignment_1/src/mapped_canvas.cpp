@@ -0,0 +1,199 @@
+#include "mapped_canvas.hpp"
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#define VC_HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace vc {
+#ifdef VC_HAVE_MMAP
+namespace {
+// Owns mappings created by allocateMapped: OpenCV calls deallocate once the last Mat header
+// referencing one is released. Anything else it is asked to allocate goes to the default allocator.
+class MappedAllocator : public cv::MatAllocator {
+public:
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+                           cv::AccessFlag flags, cv::UMatUsageFlags usage) const override {
+        return cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usage);
+    }
+    bool allocate(cv::UMatData* u, cv::AccessFlag flags, cv::UMatUsageFlags usage) const override {
+        return cv::Mat::getStdAllocator()->allocate(u, flags, usage);
+    }
+    void deallocate(cv::UMatData* u) const override {
+        if (!u) return;
+        ::munmap(u->origdata, u->size);
+        delete u;
+    }
+};
+
+MappedAllocator* mappedAllocator() {
+    static MappedAllocator allocator;
+    return &allocator;
+}
+
+size_t pageSize() {
+    static const size_t ps = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    return ps;
+}
+
+// Page-aligned inner part of [p, p + n)
+void adviseInner(void* p, size_t n, int advice) {
+    const size_t ps = pageSize();
+    uintptr_t a = (reinterpret_cast<uintptr_t>(p) + ps - 1) / ps * ps;
+    uintptr_t b = (reinterpret_cast<uintptr_t>(p) + n) / ps * ps;
+    if (b > a) ::madvise(reinterpret_cast<void*>(a), b - a, advice);
+}
+}
+
+cv::Mat allocateMapped(cv::Size size, int type, const std::string& path) {
+    const size_t step = static_cast<size_t>(size.width) * CV_ELEM_SIZE(type);
+    const size_t bytes = step * size.height;
+    if (bytes == 0) return cv::Mat(size, type);
+
+    // A fresh file of our own (O_EXCL, random suffix): concurrent canvases given the same path
+    // can never open, truncate or unlink each other's backing file
+    std::vector<char> name(path.begin(), path.end());
+    for (char c : std::string(".XXXXXX")) name.push_back(c);
+    name.push_back('\0');
+    int fd = ::mkstemp(name.data());
+    if (fd < 0) throw std::runtime_error("allocateMapped: cannot create " + path);
+    // ftruncate only sets the length: the file stays sparse until pages are written
+    if (::ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+        ::close(fd); ::unlink(name.data());
+        throw std::runtime_error("allocateMapped: cannot size " + path);
+    }
+    void* p = ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    ::unlink(name.data());
+    if (p == MAP_FAILED) throw std::runtime_error("allocateMapped: mmap failed for " + path);
+    ::madvise(p, bytes, MADV_SEQUENTIAL);
+
+    // A Mat over the mapping that carries its own UMatData, so headers share and release it
+    cv::Mat m(size, type, p, step);
+    cv::UMatData* u = new cv::UMatData(mappedAllocator());
+    u->data = u->origdata = static_cast<uchar*>(p);
+    u->size = bytes;
+    u->refcount = 1;
+    m.u = u;
+    m.allocator = mappedAllocator();
+    return m;
+}
+
+cv::Mat mapFile(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return cv::Mat();
+    const off_t bytes = ::lseek(fd, 0, SEEK_END);
+    if (bytes <= 0 || bytes > INT32_MAX) { ::close(fd); return cv::Mat(); }
+    void* p = ::mmap(nullptr, static_cast<size_t>(bytes), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) return cv::Mat();
+
+    cv::Mat m(1, static_cast<int>(bytes), CV_8U, p);
+    cv::UMatData* u = new cv::UMatData(mappedAllocator());
+    u->data = u->origdata = static_cast<uchar*>(p);
+    u->size = static_cast<size_t>(bytes);
+    u->refcount = 1;
+    m.u = u;
+    m.allocator = mappedAllocator();
+    return m;
+}
+
+size_t physicalMemoryBytes() {
+    const long pages = ::sysconf(_SC_PHYS_PAGES);
+    return pages > 0 ? static_cast<size_t>(pages) * pageSize() : 0;
+}
+#else
+cv::Mat allocateMapped(cv::Size size, int type, const std::string&) {
+    return cv::Mat(size, type, cv::Scalar::all(0));
+}
+
+cv::Mat mapFile(const std::string& path) {
+    std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+    if (!ifs) return cv::Mat();
+    const std::streamoff bytes = ifs.tellg();
+    if (bytes <= 0 || bytes > INT32_MAX) return cv::Mat();
+    cv::Mat m(1, static_cast<int>(bytes), CV_8U);
+    ifs.seekg(0);
+    ifs.read(reinterpret_cast<char*>(m.data), bytes);
+    return ifs ? m : cv::Mat();
+}
+
+size_t physicalMemoryBytes() { return 0; }
+#endif
+
+cv::Mat viewOf(const cv::Mat& owner, size_t offset, int rows, int cols, int type) {
+    CV_Assert(owner.isContinuous() && offset + static_cast<size_t>(rows) * cols * CV_ELEM_SIZE(type) <= owner.total() * owner.elemSize());
+    cv::Mat view(rows, cols, type, owner.data + offset);
+    if (owner.u) {
+        CV_XADD(&owner.u->refcount, 1);
+        view.u = owner.u;
+        view.allocator = owner.allocator;
+    }
+    return view;
+}
+
+MappedCanvas::MappedCanvas(const std::string& path, int tileRows)
+    : path_(path), tileRows_(std::max(1, tileRows)) {}
+
+void MappedCanvas::begin(cv::Size size) {
+    canvas_ = allocateMapped(size, CV_8UC3, path_);
+}
+
+cv::Mat MappedCanvas::tile(int t) const {
+    const int r0 = t * tileRows_;
+    return canvas_.rowRange(r0, std::min(canvas_.rows, r0 + tileRows_));
+}
+
+void MappedCanvas::writeBand(int y, const cv::Mat& band) {
+    CV_Assert(band.type() == CV_8UC3 && band.cols == canvas_.cols && y >= 0 && y + band.rows <= canvas_.rows);
+    for (int r = y; r < y + band.rows; ) {
+        const int next = std::min(y + band.rows, (r / tileRows_ + 1) * tileRows_);
+        cv::Mat src = band.rowRange(r - y, next - y);
+        if (cv::countNonZero(src.reshape(1)) > 0) {
+            cv::Mat dst = canvas_.rowRange(r, next);
+            src.copyTo(dst);
+            cv::Mat gray, mask, rowsAny, colsAny;
+            cv::cvtColor(src, gray, cv::COLOR_BGR2GRAY);
+            mask = gray > 1;
+            cv::reduce(mask, rowsAny, 1, cv::REDUCE_MAX);
+            cv::reduce(mask, colsAny, 0, cv::REDUCE_MAX);
+            std::vector<cv::Point> rowPts, colPts;
+            cv::findNonZero(rowsAny, rowPts);
+            cv::findNonZero(colsAny, colPts);
+            if (!rowPts.empty()) {
+                if (y1_ < y0_) { x0_ = canvas_.cols; y0_ = canvas_.rows; x1_ = -1; y1_ = -1; }
+                y0_ = std::min(y0_, r + rowPts.front().y);
+                y1_ = std::max(y1_, r + rowPts.back().y);
+                x0_ = std::min(x0_, colPts.front().x);
+                x1_ = std::max(x1_, colPts.back().x);
+            }
+#ifdef VC_HAVE_MMAP
+            // Written rows go to the page cache for writeback instead of staying resident
+            adviseInner(dst.data, dst.step * dst.rows, MADV_DONTNEED);
+#endif
+        }
+        r = next;
+    }
+}
+
+void MappedCanvas::finish() {
+#ifdef VC_HAVE_MMAP
+    if (canvas_.u && canvas_.u->currAllocator != cv::Mat::getStdAllocator())
+        ::msync(canvas_.u->origdata, canvas_.u->size, MS_SYNC);
+#endif
+}
+
+cv::Rect MappedCanvas::contentBounds() const {
+    if (y1_ < y0_ || x1_ < x0_) return cv::Rect();
+    return cv::Rect(x0_, y0_, x1_ - x0_ + 1, y1_ - y0_ + 1);
+}
+}
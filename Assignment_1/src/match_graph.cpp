@@ -0,0 +1,151 @@
+#include "match_graph.hpp"
+#include "homography.hpp"
+#include <opencv2/core.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <numeric>
+#include <queue>
+
+namespace vc {
+static std::vector<cv::Point2f> keypointPositions(const KPDesc& f) {
+    std::vector<cv::Point2f> pts;
+    cv::KeyPoint::convert(f.kps, pts);
+    return pts;
+}
+
+static PairMatch matchPair(const KPDesc& a, const KPDesc& b, int i, int j,
+                           Distance distType, double ratio, int ransacIter, double thresh,
+                           const OverlapEstimate* seed) {
+    PairMatch pm; pm.i = i; pm.j = j;
+    perf::Section matchSection;
+    auto t_m0 = std::chrono::high_resolution_clock::now();
+    auto knn = seed ? guidedMatchKNN(a.desc, keypointPositions(a), b.desc, keypointPositions(b),
+                                     seed->shift, seed->radius, distType)
+                    : bruteForceMatchKNN(a.desc, b.desc, distType, 2);
+    auto t_m1 = std::chrono::high_resolution_clock::now();
+    pm.matches = ratioTest(knn, ratio);
+    auto t_m2 = std::chrono::high_resolution_clock::now();
+    pm.matchPerf = matchSection.stop();
+    pm.rawMatches = static_cast<int>(knn.size());
+    pm.matchMs = std::chrono::duration<double, std::milli>(t_m1 - t_m0).count();
+    pm.filterMs = std::chrono::duration<double, std::milli>(t_m2 - t_m1).count();
+    if (!pm.matches.empty()) {
+        double s = 0.0; for (const auto& m : pm.matches) s += m.dist;
+        pm.distMean = s / pm.matches.size();
+        double var = 0.0; for (const auto& m : pm.matches) { double d = m.dist - pm.distMean; var += d*d; }
+        pm.distStd = std::sqrt(var / pm.matches.size());
+    }
+
+    // j -> i, like new -> pano in the sequential path
+    std::vector<cv::Point2f> src, dst;
+    src.reserve(pm.matches.size()); dst.reserve(pm.matches.size());
+    for (const auto& m : pm.matches) {
+        dst.push_back(a.kps[m.queryIdx].pt);
+        src.push_back(b.kps[m.trainIdx].pt);
+    }
+    perf::Section ransacSection;
+    auto t_r0 = std::chrono::high_resolution_clock::now();
+    cv::Mat H = ransacHomography(src, dst, ransacIter, thresh, pm.inlierMask);
+    auto t_r1 = std::chrono::high_resolution_clock::now();
+    pm.ransacPerf = ransacSection.stop();
+    pm.ransacMs = std::chrono::duration<double, std::milli>(t_r1 - t_r0).count();
+    if (H.empty() || !cv::checkRange(H)) return pm;
+    pm.H = H;
+    double err = 0.0;
+    std::vector<cv::Point2f> proj;
+    cv::perspectiveTransform(src, proj, H);
+    for (size_t t = 0; t < src.size(); ++t) {
+        if (!pm.inlierMask[t]) continue;
+        ++pm.inliers;
+        err += cv::norm(proj[t] - dst[t]);
+    }
+    pm.avgReprojError = pm.inliers > 0 ? err / pm.inliers : 0.0;
+    return pm;
+}
+
+std::vector<PairMatch> matchPairs(const std::vector<KPDesc>& feats,
+                                  const std::vector<std::pair<int,int>>& pairs,
+                                  Distance distType, double ratio,
+                                  int ransacIter, double thresh,
+                                  ThreadPool& pool,
+                                  const std::vector<OverlapEstimate>* seeds) {
+    std::vector<PairMatch> out(pairs.size());
+    pool.parallelFor(static_cast<int>(pairs.size()), [&](int k) {
+        const int i = pairs[k].first, j = pairs[k].second;
+        const OverlapEstimate* seed = seeds && (*seeds)[k].valid ? &(*seeds)[k] : nullptr;
+        out[k] = matchPair(feats[i], feats[j], i, j, distType, ratio, ransacIter, thresh, seed);
+    });
+    return out;
+}
+
+std::vector<cv::Mat> spanningTreeTransforms(int numImages, const std::vector<PairMatch>& pairs,
+                                            int minInliers, std::vector<int>& order) {
+    std::vector<cv::Mat> toRef(numImages);
+    order.clear();
+    if (numImages <= 0) return toRef;
+
+    // Maximum spanning tree over inlier counts (Kruskal)
+    std::vector<int> edgeIdx;
+    for (size_t k = 0; k < pairs.size(); ++k)
+        if (!pairs[k].H.empty() && pairs[k].inliers >= minInliers) edgeIdx.push_back(static_cast<int>(k));
+    std::sort(edgeIdx.begin(), edgeIdx.end(), [&](int x, int y) {
+        if (pairs[x].inliers != pairs[y].inliers) return pairs[x].inliers > pairs[y].inliers;
+        return std::make_pair(pairs[x].i, pairs[x].j) < std::make_pair(pairs[y].i, pairs[y].j);
+    });
+    std::vector<int> parent(numImages);
+    std::iota(parent.begin(), parent.end(), 0);
+    auto find = [&](int x) { while (parent[x] != x) x = parent[x] = parent[parent[x]]; return x; };
+    std::vector<std::vector<int>> adj(numImages); // indices into pairs
+    for (int k : edgeIdx) {
+        int ri = find(pairs[k].i), rj = find(pairs[k].j);
+        if (ri == rj) continue;
+        parent[ri] = rj;
+        adj[pairs[k].i].push_back(k);
+        adj[pairs[k].j].push_back(k);
+    }
+    auto other = [&](int k, int v) { return pairs[k].i == v ? pairs[k].j : pairs[k].i; };
+    // Heavier edges first so the placement order is independent of the input order
+    for (auto& nb : adj)
+        std::sort(nb.begin(), nb.end(), [&](int x, int y) { return pairs[x].inliers > pairs[y].inliers; });
+
+    auto bfs = [&](int root, std::vector<int>& hops, std::vector<int>& via, std::vector<int>& seq) {
+        hops.assign(numImages, -1); via.assign(numImages, -1); seq.clear();
+        std::queue<int> q; q.push(root); hops[root] = 0;
+        while (!q.empty()) {
+            int v = q.front(); q.pop(); seq.push_back(v);
+            for (int k : adj[v]) {
+                int w = other(k, v);
+                if (hops[w] >= 0) continue;
+                hops[w] = hops[v] + 1; via[w] = k; q.push(w);
+            }
+        }
+    };
+
+    // Reference: the image of the largest component with the smallest eccentricity,
+    // ties broken by total inlier weight
+    std::vector<int> hops, via, seq;
+    int ref = 0, bestSize = 0, bestEcc = 0, bestWeight = 0;
+    for (int v = 0; v < numImages; ++v) {
+        bfs(v, hops, via, seq);
+        int ecc = 0; for (int h : hops) ecc = std::max(ecc, h);
+        int weight = 0; for (int k : adj[v]) weight += pairs[k].inliers;
+        int size = static_cast<int>(seq.size());
+        bool better = size > bestSize ||
+                      (size == bestSize && (ecc < bestEcc || (ecc == bestEcc && weight > bestWeight)));
+        if (better) { ref = v; bestSize = size; bestEcc = ecc; bestWeight = weight; }
+    }
+
+    // Chain transforms outwards along the tree: child -> parent -> ... -> reference
+    bfs(ref, hops, via, seq);
+    for (int v : seq) {
+        if (v == ref) { toRef[v] = cv::Mat::eye(3, 3, CV_64F); continue; }
+        const PairMatch& pm = pairs[via[v]];
+        int p = other(via[v], v);
+        cv::Mat H_v_to_p = (pm.j == v) ? pm.H : cv::Mat(pm.H.inv());
+        toRef[v] = toRef[p] * H_v_to_p;
+    }
+    order = seq;
+    return toRef;
+}
+}
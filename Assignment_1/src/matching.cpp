@@ -1,9 +1,11 @@
 #include "matching.hpp"
+#include "trace.hpp"
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
 #include <limits>
 #include <cmath>
 #include <algorithm>
+#include <unordered_map>
 
 namespace vc {
 static inline double squaredL2(const float* a, const float* b, int dim) {
@@ -73,6 +75,7 @@ std::vector<Match> bruteForceMatch(const cv::Mat& desc1, const cv::Mat& desc2, D
 }
 
 std::vector<std::pair<Match, Match>> bruteForceMatchKNN(const cv::Mat& desc1, const cv::Mat& desc2, Distance distType, int k) {
+    VC_TRACE_SCOPE("match");
     std::vector<std::pair<Match, Match>> knn;
     if (desc1.empty() || desc2.empty() || k < 2) return knn;
     const int n1 = desc1.rows;
@@ -103,7 +106,59 @@ std::vector<std::pair<Match, Match>> bruteForceMatchKNN(const cv::Mat& desc1, co
     return knn;
 }
 
+std::vector<std::pair<Match, Match>> guidedMatchKNN(const cv::Mat& desc1, const std::vector<cv::Point2f>& pts1,
+                                                    const cv::Mat& desc2, const std::vector<cv::Point2f>& pts2,
+                                                    cv::Point2d offset, double radius, Distance distType) {
+    std::vector<std::pair<Match, Match>> knn;
+    if (desc1.empty() || desc2.empty() || radius <= 0.0) return knn;
+    CV_Assert(static_cast<int>(pts1.size()) == desc1.rows && static_cast<int>(pts2.size()) == desc2.rows);
+
+    // Bucket train points on a grid of radius-sized cells
+    auto cellOf = [&](double v) { return static_cast<long long>(std::floor(v / radius)); };
+    auto key = [](long long cx, long long cy) {
+        return (static_cast<unsigned long long>(cx) << 32) ^ (static_cast<unsigned long long>(cy) & 0xffffffffULL);
+    };
+    std::unordered_map<unsigned long long, std::vector<int>> grid;
+    for (int j = 0; j < desc2.rows; ++j)
+        grid[key(cellOf(pts2[j].x + offset.x), cellOf(pts2[j].y + offset.y))].push_back(j);
+
+    const double r2 = radius * radius;
+    for (int i = 0; i < desc1.rows; ++i) {
+        double best = std::numeric_limits<double>::infinity();
+        double second = std::numeric_limits<double>::infinity();
+        int bestIdx = -1, secondIdx = -1;
+        const long long cx = cellOf(pts1[i].x), cy = cellOf(pts1[i].y);
+        for (long long gy = cy - 1; gy <= cy + 1; ++gy) {
+            for (long long gx = cx - 1; gx <= cx + 1; ++gx) {
+                auto it = grid.find(key(gx, gy));
+                if (it == grid.end()) continue;
+                for (int j : it->second) {
+                    double dx = pts2[j].x + offset.x - pts1[i].x, dy = pts2[j].y + offset.y - pts1[i].y;
+                    if (dx*dx + dy*dy > r2) continue;
+                    double d = 0.0;
+                    if (distType == Distance::L2) {
+                        d = euclideanDistance(desc1.row(i), desc2.row(j));
+                    } else {
+                        d = static_cast<double>(hammingDistance(desc1.row(i), desc2.row(j)));
+                    }
+                    if (d < best) {
+                        second = best; secondIdx = bestIdx;
+                        best = d; bestIdx = j;
+                    } else if (d < second) {
+                        second = d; secondIdx = j;
+                    }
+                }
+            }
+        }
+        if (bestIdx >= 0 && secondIdx >= 0) {
+            knn.push_back({ {i, bestIdx, best}, {i, secondIdx, second} });
+        }
+    }
+    return knn;
+}
+
 std::vector<Match> ratioTest(const std::vector<std::pair<Match,Match>>& knn, double ratio) {
+    VC_TRACE_SCOPE("ratio");
     std::vector<Match> good;
     for (const auto& p : knn) {
         const auto& m1 = p.first;
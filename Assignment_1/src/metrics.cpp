@@ -0,0 +1,247 @@
+#include "metrics.hpp"
+#include "trace.hpp"
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+namespace vc {
+namespace {
+constexpr size_t kRingCapacity = 2048;
+constexpr auto kFlushInterval = std::chrono::milliseconds(200); // an idle writer still drains this often
+constexpr size_t kMaxOpenFiles = 64;
+constexpr uint16_t kBinaryVersion = 1;
+constexpr uint16_t kByteOrderMark = 0xFEFF;
+
+const char* extension(MetricsFormat f) {
+    return f == MetricsFormat::JSONL ? ".jsonl" : f == MetricsFormat::BINARY ? ".bin" : ".csv";
+}
+
+template <typename T>
+void put(std::ofstream& ofs, T v) { ofs.write(reinterpret_cast<const char*>(&v), sizeof(v)); }
+
+void putMagic(std::ofstream& ofs, const char* magic) {
+    ofs.write(magic, 4);
+    put(ofs, kBinaryVersion);
+    put(ofs, kByteOrderMark);
+}
+
+void jsonString(std::string& out, const std::string& s) {
+    out += '"';
+    for (char c : s) {
+        if (c == '"' || c == '\\') out += '\\';
+        if (static_cast<unsigned char>(c) < 0x20) { char buf[8]; std::snprintf(buf, sizeof(buf), "\\u%04x", c); out += buf; continue; }
+        out += c;
+    }
+    out += '"';
+}
+
+void number(std::string& out, double v, int precision, bool json) {
+    if (json && !std::isfinite(v)) { out += "null"; return; }
+    char buf[64];
+    if (precision < 0) std::snprintf(buf, sizeof(buf), "%g", v);
+    else std::snprintf(buf, sizeof(buf), "%.*f", precision, v);
+    out += buf;
+}
+}
+
+MetricsSink& MetricsSink::instance() {
+    static MetricsSink sink;
+    return sink;
+}
+
+MetricsSink::MetricsSink() : ring_(kRingCapacity) {
+    symbols_.emplace_back(); // id 0: the empty string
+    symbolIds_[""] = 0;
+    writer_ = std::thread([this]{ writerLoop(); });
+}
+
+MetricsSink::~MetricsSink() {
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        stop_ = true;
+        notEmpty_.notify_all();
+    }
+    writer_.join();
+}
+
+Sym MetricsSink::intern(const std::string& s) {
+    std::lock_guard<std::mutex> lk(symMtx_);
+    auto it = symbolIds_.find(s);
+    if (it != symbolIds_.end()) return Sym{it->second};
+    const uint32_t id = static_cast<uint32_t>(symbols_.size());
+    symbols_.push_back(s);
+    symbolIds_.emplace(s, id);
+    return Sym{id};
+}
+
+std::string MetricsSink::symbol(uint32_t id) {
+    std::lock_guard<std::mutex> lk(symMtx_);
+    return id < symbols_.size() ? symbols_[id] : std::string();
+}
+
+void MetricsSink::recordSeries(const MetricTable& table, Sym dir, MetricsFormat format, std::vector<double> values) {
+    MetricRecord r;
+    r.table = &table;
+    r.dir = dir;
+    r.format = format;
+    r.series = std::move(values);
+    push(std::move(r));
+}
+
+void MetricsSink::push(MetricRecord&& r) {
+    std::unique_lock<std::mutex> lk(mtx_);
+    notFull_.wait(lk, [this]{ return size_ < ring_.size(); });
+    ring_[(head_ + size_) % ring_.size()] = std::move(r);
+    ++size_;
+    ++pushed_;
+    if (size_ >= ring_.size() / 2) notEmpty_.notify_one();
+}
+
+void MetricsSink::flush() {
+    std::unique_lock<std::mutex> lk(mtx_);
+    const uint64_t target = pushed_;
+    flushRequested_ = true;
+    notEmpty_.notify_one();
+    drained_.wait(lk, [&]{ return written_ >= target; });
+}
+
+void MetricsSink::writerLoop() {
+    VC_TRACE_THREAD("metrics writer");
+    std::vector<MetricRecord> batch;
+    batch.reserve(ring_.size());
+    for (;;) {
+        std::unique_lock<std::mutex> lk(mtx_);
+        notEmpty_.wait_for(lk, kFlushInterval, [this]{ return stop_ || flushRequested_ || size_ >= ring_.size() / 2; });
+        batch.clear();
+        for (; size_ > 0; --size_) {
+            batch.push_back(std::move(ring_[head_]));
+            head_ = (head_ + 1) % ring_.size();
+        }
+        const bool stopping = stop_;
+        flushRequested_ = false;
+        notFull_.notify_all();
+        lk.unlock();
+
+        {
+            VC_TRACE_SCOPE("metrics write");
+            for (const auto& r : batch) write(r);
+            for (auto& f : files_) f.second->ofs.flush();
+        }
+        // A long-lived daemon touches a new run directory per request
+        if (files_.size() > kMaxOpenFiles) files_.clear();
+
+        lk.lock();
+        written_ += batch.size();
+        drained_.notify_all();
+        if (stopping && size_ == 0) break;
+    }
+    files_.clear();
+}
+
+void MetricsSink::write(const MetricRecord& r) {
+    const MetricTable& t = *r.table;
+    const std::string path = symbol(r.dir.id) + "/" + t.name + extension(r.format);
+    std::string line;
+
+    if (t.series) {
+        std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+        if (r.format == MetricsFormat::BINARY) {
+            putMagic(ofs, "VCMS");
+            put(ofs, static_cast<uint64_t>(r.series.size()));
+            ofs.write(reinterpret_cast<const char*>(r.series.data()), r.series.size() * sizeof(double));
+            return;
+        }
+        line.reserve(r.series.size() * 12);
+        for (double v : r.series) { number(line, v, -1, r.format == MetricsFormat::JSONL); line += '\n'; }
+        ofs << line;
+        return;
+    }
+
+    auto it = files_.find(path);
+    if (it == files_.end()) {
+        std::error_code ec;
+        const bool fresh = !std::filesystem::exists(path, ec) || std::filesystem::file_size(path, ec) == 0;
+        auto ot = std::make_unique<OpenTable>();
+        ot->ofs.open(path, std::ios::binary | std::ios::app);
+        if (!ot->ofs) return;
+        if (fresh && r.format == MetricsFormat::CSV) {
+            for (size_t c = 0; c < t.columns.size(); ++c) { if (c) line += ','; line += t.columns[c].name; }
+            ot->ofs << line << '\n';
+            line.clear();
+        } else if (fresh && r.format == MetricsFormat::BINARY) {
+            putMagic(ot->ofs, "VCMT");
+            put(ot->ofs, static_cast<uint16_t>(t.columns.size()));
+            for (const auto& c : t.columns) {
+                const uint8_t n = static_cast<uint8_t>(std::strlen(c.name));
+                put(ot->ofs, n);
+                ot->ofs.write(c.name, n);
+                put(ot->ofs, static_cast<int8_t>(c.precision));
+            }
+        }
+        it = files_.emplace(path, std::move(ot)).first;
+    }
+    OpenTable& ot = *it->second;
+
+    if (r.format == MetricsFormat::BINARY) {
+        for (size_t k = 0; k < r.count; ++k) {
+            const MetricValue& v = r.values[k];
+            if (v.kind != MetricValue::SYM) continue;
+            if (v.sym >= ot.defined.size()) ot.defined.resize(v.sym + 1, false);
+            if (ot.defined[v.sym]) continue;
+            const std::string s = symbol(v.sym);
+            ot.ofs.put('S');
+            put(ot.ofs, v.sym);
+            put(ot.ofs, static_cast<uint16_t>(s.size()));
+            ot.ofs.write(s.data(), s.size());
+            ot.defined[v.sym] = true;
+        }
+        ot.ofs.put('R');
+        for (size_t k = 0; k < r.count; ++k) {
+            const MetricValue& v = r.values[k];
+            put(ot.ofs, static_cast<uint8_t>(v.kind));
+            if (v.kind == MetricValue::INT) put(ot.ofs, v.i);
+            else if (v.kind == MetricValue::REAL) put(ot.ofs, v.d);
+            else put(ot.ofs, v.sym);
+        }
+        return;
+    }
+
+    const bool json = r.format == MetricsFormat::JSONL;
+    if (json) line += '{';
+    for (size_t k = 0; k < r.count; ++k) {
+        const MetricValue& v = r.values[k];
+        const int precision = k < t.columns.size() ? t.columns[k].precision : -1;
+        if (k) line += ',';
+        if (json) { jsonString(line, k < t.columns.size() ? t.columns[k].name : "?"); line += ':'; }
+        if (v.kind == MetricValue::INT) {
+            char buf[32];
+            std::snprintf(buf, sizeof(buf), "%" PRId64, v.i);
+            line += buf;
+        } else if (v.kind == MetricValue::REAL) {
+            number(line, v.d, precision, json);
+        } else if (json) {
+            jsonString(line, symbol(v.sym));
+        } else {
+            line += symbol(v.sym);
+        }
+    }
+    if (json) line += '}';
+    line += '\n';
+    ot.ofs << line;
+}
+
+bool parseMetricsFormat(const std::string& s, MetricsFormat& out) {
+    if (s == "csv") out = MetricsFormat::CSV;
+    else if (s == "jsonl") out = MetricsFormat::JSONL;
+    else if (s == "bin") out = MetricsFormat::BINARY;
+    else return false;
+    return true;
+}
+
+const char* toString(MetricsFormat f) {
+    return f == MetricsFormat::JSONL ? "jsonl" : f == MetricsFormat::BINARY ? "bin" : "csv";
+}
+}
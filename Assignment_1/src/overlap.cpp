@@ -0,0 +1,101 @@
+#include "overlap.hpp"
+#include "preprocess.hpp"
+#include <opencv2/imgproc.hpp>
+#include <opencv2/core.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace vc {
+// Overlap of image j placed at offset t inside image i, in image i's coordinates
+static cv::Rect2d overlapInI(cv::Size si, cv::Size sj, cv::Point2d t) {
+    return cv::Rect2d(0, 0, si.width, si.height) & cv::Rect2d(t.x, t.y, sj.width, sj.height);
+}
+
+std::vector<OverlapEstimate> estimateOverlaps(const std::vector<cv::Mat>& imgs,
+                                              const std::vector<std::pair<int,int>>& pairs,
+                                              ThreadPool& pool, int thumbSide,
+                                              double minResponse, double minNcc, double minOverlap) {
+    std::vector<OverlapEstimate> out(pairs.size());
+    if (imgs.empty()) return out;
+
+    // One scale for the whole set, so thumbnail shifts map back with a single factor
+    int maxSide = 1;
+    for (const auto& im : imgs) maxSide = std::max(maxSide, std::max(im.cols, im.rows));
+    const double s = std::min(1.0, static_cast<double>(thumbSide) / maxSide);
+    std::vector<cv::Mat> thumbs(imgs.size()), padded(imgs.size());
+    pool.parallelFor(static_cast<int>(imgs.size()), [&](int i) {
+        cv::Mat small;
+        cv::resize(toGray(imgs[i]), small, cv::Size(), s, s, cv::INTER_AREA);
+        small.convertTo(thumbs[i], CV_32F);
+    });
+    // phaseCorrelate needs equal sizes: zero-pad every thumbnail to the largest one
+    cv::Size pad(0, 0);
+    for (const auto& t : thumbs) pad = cv::Size(std::max(pad.width, t.cols), std::max(pad.height, t.rows));
+    for (size_t i = 0; i < thumbs.size(); ++i) {
+        padded[i] = cv::Mat::zeros(pad, CV_32F);
+        thumbs[i].copyTo(padded[i](cv::Rect(0, 0, thumbs[i].cols, thumbs[i].rows)));
+    }
+    cv::Mat window;
+    cv::createHanningWindow(window, pad, CV_32F);
+
+    pool.parallelFor(static_cast<int>(pairs.size()), [&](int k) {
+        auto t0 = std::chrono::high_resolution_clock::now();
+        OverlapEstimate& e = out[k];
+        e.i = pairs[k].first; e.j = pairs[k].second;
+        const cv::Mat& ti = thumbs[e.i];
+        const cv::Mat& tj = thumbs[e.j];
+        cv::Point2d d = cv::phaseCorrelate(padded[e.i], padded[e.j], window, &e.response);
+
+        // The peak is only known modulo the padded size and up to the sign convention:
+        // keep the candidate whose overlap correlates best
+        double bestNcc = -2.0;
+        cv::Point2d best;
+        cv::Mat res;
+        for (int sign : {1, -1}) {
+            for (int ax = -1; ax <= 1; ++ax) {
+                for (int ay = -1; ay <= 1; ++ay) {
+                    cv::Point2d t(sign * d.x + ax * pad.width, sign * d.y + ay * pad.height);
+                    cv::Rect ri = overlapInI(ti.size(), tj.size(), t);
+                    if (ri.width < 8 || ri.height < 8) continue;
+                    cv::Rect rj(ri.x - cvRound(t.x), ri.y - cvRound(t.y), ri.width, ri.height);
+                    rj &= cv::Rect(0, 0, tj.cols, tj.rows);
+                    if (rj.size() != ri.size()) continue;
+                    cv::matchTemplate(ti(ri), tj(rj), res, cv::TM_CCOEFF_NORMED);
+                    double ncc = res.at<float>(0, 0);
+                    if (std::isfinite(ncc) && ncc > bestNcc) { bestNcc = ncc; best = t; }
+                }
+            }
+        }
+        if (bestNcc > -2.0) {
+            const cv::Size si = imgs[e.i].size(), sj = imgs[e.j].size();
+            e.shift = best * (1.0 / s);
+            e.ncc = bestNcc;
+            e.overlap = overlapInI(si, sj, e.shift).area() / std::min(si.area(), sj.area());
+            // Thumbnail quantisation plus the rotation/perspective a translation cannot express
+            e.radius = 0.2 * std::max(std::max(sj.width, sj.height), std::max(si.width, si.height)) + 2.0 / s;
+            e.valid = e.response >= minResponse && e.ncc >= minNcc && e.overlap >= minOverlap;
+        }
+        auto t1 = std::chrono::high_resolution_clock::now();
+        e.ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+    });
+    return out;
+}
+
+std::vector<cv::Mat> overlapMasks(const std::vector<cv::Mat>& imgs, const std::vector<OverlapEstimate>& est) {
+    std::vector<cv::Mat> masks(imgs.size());
+    auto add = [&](int idx, cv::Rect2d r, double grow) {
+        cv::Mat& m = masks[idx];
+        if (m.empty()) m = cv::Mat::zeros(imgs[idx].size(), CV_8U);
+        cv::Rect rr(cvFloor(r.x - grow), cvFloor(r.y - grow), cvCeil(r.width + 2*grow), cvCeil(r.height + 2*grow));
+        m(rr & cv::Rect(0, 0, m.cols, m.rows)).setTo(255);
+    };
+    for (const auto& e : est) {
+        if (!e.valid) continue;
+        cv::Rect2d ri = overlapInI(imgs[e.i].size(), imgs[e.j].size(), e.shift);
+        add(e.i, ri, e.radius);
+        add(e.j, cv::Rect2d(ri.x - e.shift.x, ri.y - e.shift.y, ri.width, ri.height), e.radius);
+    }
+    return masks;
+}
+}
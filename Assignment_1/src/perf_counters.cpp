@@ -0,0 +1,114 @@
+#include "perf_counters.hpp"
+#include <atomic>
+#include <cstring>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace vc {
+PerfCounts& PerfCounts::operator+=(const PerfCounts& o) {
+    auto add = [](int64_t& a, int64_t b) { a = (a < 0 || b < 0) ? (a < 0 ? b : a) : a + b; };
+    add(cycles, o.cycles);
+    add(instructions, o.instructions);
+    add(l1dMisses, o.l1dMisses);
+    add(llcMisses, o.llcMisses);
+    add(branchMisses, o.branchMisses);
+    return *this;
+}
+
+namespace perf {
+namespace {
+std::atomic<bool> on{false};
+constexpr int kEvents = 5; // cycles, instructions, L1D read misses, LLC misses, branch misses
+
+#ifdef __linux__
+// Counter group of one thread: slot[e] is the position of event e in a group read, -1 = unsupported
+struct ThreadGroup {
+    int leader = -1;
+    int fds[kEvents] = {-1, -1, -1, -1, -1};
+    int slot[kEvents] = {-1, -1, -1, -1, -1};
+    int members = 0;
+    bool tried = false;
+
+    ~ThreadGroup() { for (int fd : fds) if (fd >= 0) close(fd); }
+
+    void open() {
+        tried = true;
+        const uint32_t types[kEvents] = {PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+                                         PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE};
+        const uint64_t configs[kEvents] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+        for (int e = 0; e < kEvents; ++e) {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[e];
+            attr.config = configs[e];
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            const int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0));
+            if (fd < 0) {
+                if (e == 0) return; // no cycles counter: the whole group is unavailable
+                continue;           // e.g. no LLC event in a VM: only this column stays -1
+            }
+            if (e == 0) leader = fd;
+            fds[e] = fd;
+            slot[e] = members++;
+        }
+    }
+
+    // values: time_enabled, time_running, then one value per member
+    bool read(uint64_t* values) {
+        if (leader < 0) return false;
+        uint64_t buf[3 + kEvents];
+        const ssize_t want = static_cast<ssize_t>((3 + members) * sizeof(uint64_t));
+        if (::read(leader, buf, want) != want || buf[0] != static_cast<uint64_t>(members)) return false;
+        std::memcpy(values, buf + 1, (2 + members) * sizeof(uint64_t));
+        return true;
+    }
+};
+
+ThreadGroup& group() {
+    thread_local ThreadGroup g;
+    if (!g.tried) g.open();
+    return g;
+}
+#endif
+}
+
+void setEnabled(bool enable) { on.store(enable, std::memory_order_relaxed); }
+bool enabled() { return on.load(std::memory_order_relaxed); }
+
+Section::Section() : active_(false) {
+#ifdef __linux__
+    if (enabled()) active_ = group().read(start_);
+#endif
+}
+
+PerfCounts Section::stop() {
+    PerfCounts c;
+#ifdef __linux__
+    uint64_t end[2 + kEvents];
+    if (!active_ || !group().read(end)) return c;
+    active_ = false;
+    const ThreadGroup& g = group();
+    const double enabledNs = static_cast<double>(end[0] - start_[0]);
+    const double runningNs = static_cast<double>(end[1] - start_[1]);
+    const double scale = runningNs > 0 ? enabledNs / runningNs : 0.0;
+    int64_t* out[kEvents] = {&c.cycles, &c.instructions, &c.l1dMisses, &c.llcMisses, &c.branchMisses};
+    for (int e = 0; e < kEvents; ++e) {
+        const int s = g.slot[e];
+        if (s < 0 || runningNs <= 0) continue;
+        *out[e] = static_cast<int64_t>(static_cast<double>(end[2 + s] - start_[2 + s]) * scale + 0.5);
+    }
+#endif
+    return c;
+}
+}
+}
@@ -0,0 +1,49 @@
+#include "refine.hpp"
+#include <opencv2/imgproc.hpp>
+#include <opencv2/core.hpp>
+#include <cmath>
+
+namespace vc {
+// Vertex offset of the parabola through (-1, a), (0, b), (1, c)
+static inline double parabolaPeak(double a, double b, double c) {
+    double den = a - 2.0 * b + c;
+    return std::abs(den) > 1e-12 ? 0.5 * (a - c) / den : 0.0;
+}
+
+int refineCorrespondences(const cv::Mat& grayA, const cv::Mat& grayB, const cv::Mat& H_ab,
+                          const std::vector<cv::Point2f>& ptsA, std::vector<cv::Point2f>& ptsB,
+                          int patch, int radius, double minScore) {
+    CV_Assert(grayA.type() == CV_8U && grayB.type() == CV_8U);
+    CV_Assert(ptsA.size() == ptsB.size());
+    const int half = patch / 2;
+    const cv::Rect boundsA(0, 0, grayA.cols, grayA.rows), boundsB(0, 0, grayB.cols, grayB.rows);
+    std::vector<cv::Point2f> pred;
+    if (ptsA.empty()) return 0;
+    cv::perspectiveTransform(ptsA, pred, H_ab);
+
+    int refined = 0;
+    cv::Mat res;
+    for (size_t k = 0; k < ptsA.size(); ++k) {
+        cv::Point ia(cvRound(ptsA[k].x), cvRound(ptsA[k].y));
+        cv::Point ib(cvRound(pred[k].x), cvRound(pred[k].y));
+        cv::Rect tpl(ia.x - half, ia.y - half, patch, patch);
+        cv::Rect win(ib.x - half - radius, ib.y - half - radius, patch + 2*radius, patch + 2*radius);
+        if ((tpl & boundsA) != tpl || (win & boundsB) != win) continue;
+
+        cv::matchTemplate(grayB(win), grayA(tpl), res, cv::TM_CCOEFF_NORMED);
+        double maxVal; cv::Point maxLoc;
+        cv::minMaxLoc(res, nullptr, &maxVal, nullptr, &maxLoc);
+        if (maxVal < minScore) continue;
+        double dx = 0.0, dy = 0.0;
+        if (maxLoc.x > 0 && maxLoc.x < res.cols - 1)
+            dx = parabolaPeak(res.at<float>(maxLoc.y, maxLoc.x-1), res.at<float>(maxLoc), res.at<float>(maxLoc.y, maxLoc.x+1));
+        if (maxLoc.y > 0 && maxLoc.y < res.rows - 1)
+            dy = parabolaPeak(res.at<float>(maxLoc.y-1, maxLoc.x), res.at<float>(maxLoc), res.at<float>(maxLoc.y+1, maxLoc.x));
+        // Peak is the template's top-left corner; keep ptsA's sub-pixel offset from its patch centre
+        ptsB[k] = cv::Point2f(static_cast<float>(win.x + maxLoc.x + dx + half + (ptsA[k].x - ia.x)),
+                              static_cast<float>(win.y + maxLoc.y + dy + half + (ptsA[k].y - ia.y)));
+        ++refined;
+    }
+    return refined;
+}
+}
@@ -0,0 +1,29 @@
+#include "resolution.hpp"
+#include <opencv2/imgproc.hpp>
+#include <algorithm>
+#include <cmath>
+
+namespace vc {
+double scaleForBudget(cv::Size size, double megapix) {
+    if (megapix <= 0.0 || size.area() == 0) return 1.0;
+    return std::min(1.0, std::sqrt(megapix * 1e6 / static_cast<double>(size.area())));
+}
+
+cv::Size scaledSize(cv::Size size, double s) {
+    return s >= 1.0 ? size : cv::Size(cvRound(size.width * s), cvRound(size.height * s));
+}
+
+cv::Mat rescaleHomography(const cv::Mat& H, double k) {
+    if (H.empty() || k == 1.0) return H;
+    cv::Mat K = (cv::Mat_<double>(3,3) << k, 0, 0, 0, k, 0, 0, 0, 1);
+    cv::Mat Kinv = (cv::Mat_<double>(3,3) << 1.0/k, 0, 0, 0, 1.0/k, 0, 0, 0, 1);
+    return K * H * Kinv;
+}
+
+cv::Mat resized(const cv::Mat& img, double s) {
+    if (s >= 1.0) return img;
+    cv::Mat out;
+    cv::resize(img, out, cv::Size(), s, s, cv::INTER_AREA);
+    return out;
+}
+}
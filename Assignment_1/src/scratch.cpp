@@ -0,0 +1,145 @@
+#include "scratch.hpp"
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+namespace vc {
+namespace {
+constexpr size_t kMinPooledBytes = size_t(1) << 20; // below this malloc's own caching does fine
+
+// Geometric size classes: every request in (c/2, c] is served by the buffers of class c
+size_t sizeClass(size_t bytes) {
+    size_t c = kMinPooledBytes;
+    while (c < bytes) c <<= 1;
+    return c;
+}
+
+// Hands out pooled buffers to Mats and takes them back in deallocate, which OpenCV calls once the
+// last header referencing one is released (on whichever thread that happens).
+class ScratchAllocator : public cv::MatAllocator {
+public:
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+                           cv::AccessFlag flags, cv::UMatUsageFlags usage) const override {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i = dims - 1; i >= 0; --i) {
+            if (step) {
+                if (data && step[i] != CV_AUTOSTEP) total = step[i];
+                else step[i] = total;
+            }
+            total *= sizes[i];
+        }
+        if (data || total < kMinPooledBytes)
+            return cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usage);
+
+        const size_t cls = sizeClass(total);
+        void* p = take(cls);
+        if (!p) p = cv::fastMalloc(cls);
+        cv::UMatData* u = new cv::UMatData(this);
+        u->data = u->origdata = static_cast<uchar*>(p);
+        u->size = total;
+        return u;
+    }
+    bool allocate(cv::UMatData* u, cv::AccessFlag flags, cv::UMatUsageFlags usage) const override {
+        return cv::Mat::getStdAllocator()->allocate(u, flags, usage);
+    }
+    void deallocate(cv::UMatData* u) const override {
+        if (!u) return;
+        give(u->origdata, sizeClass(u->size));
+        delete u;
+    }
+
+    void setLimit(size_t bytes) {
+        std::lock_guard<std::mutex> lk(mtx_);
+        limit_ = bytes;
+        evict(limit_);
+    }
+    void trim() {
+        std::lock_guard<std::mutex> lk(mtx_);
+        evict(0);
+    }
+    ScratchStats stats() const {
+        std::lock_guard<std::mutex> lk(mtx_);
+        return stats_;
+    }
+
+private:
+    void* take(size_t cls) const {
+        std::lock_guard<std::mutex> lk(mtx_);
+        auto it = free_.find(cls);
+        if (it == free_.end() || it->second.empty()) { ++stats_.misses; return nullptr; }
+        void* p = it->second.back();
+        it->second.pop_back();
+        stats_.retainedBytes -= cls;
+        ++stats_.hits;
+        return p;
+    }
+    void give(void* p, size_t cls) const {
+        {
+            std::lock_guard<std::mutex> lk(mtx_);
+            if (stats_.retainedBytes + cls <= limit_) {
+                free_[cls].push_back(p);
+                stats_.retainedBytes += cls;
+                stats_.peakRetainedBytes = std::max(stats_.peakRetainedBytes, stats_.retainedBytes);
+                return;
+            }
+        }
+        cv::fastFree(p);
+    }
+    // Largest classes first: they hold the most memory for the fewest reuses. Caller holds mtx_.
+    void evict(size_t keep) const {
+        for (auto it = free_.rbegin(); it != free_.rend() && stats_.retainedBytes > keep; ++it) {
+            while (!it->second.empty() && stats_.retainedBytes > keep) {
+                cv::fastFree(it->second.back());
+                it->second.pop_back();
+                stats_.retainedBytes -= it->first;
+            }
+        }
+    }
+
+    mutable std::mutex mtx_;
+    mutable std::map<size_t, std::vector<void*>> free_;
+    mutable ScratchStats stats_;
+    size_t limit_ = size_t(1) << 30;
+};
+
+// Never destroyed: Mats released during static destruction may still hand buffers back
+ScratchAllocator& scratchAllocator() {
+    static ScratchAllocator* allocator = new ScratchAllocator();
+    return *allocator;
+}
+}
+
+cv::Mat scratchMat(cv::Size size, int type) {
+    cv::Mat m = scratchMat();
+    m.create(size, type);
+    return m;
+}
+
+cv::Mat scratchMat() {
+    cv::Mat m;
+    m.allocator = &scratchAllocator();
+    return m;
+}
+
+void setScratchLimit(size_t bytes) { scratchAllocator().setLimit(bytes); }
+void trimScratch() { scratchAllocator().trim(); }
+ScratchStats scratchStats() { return scratchAllocator().stats(); }
+
+#if defined(__unix__) || defined(__APPLE__)
+size_t peakRssBytes() {
+    struct rusage ru;
+    if (::getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+#ifdef __APPLE__
+    return static_cast<size_t>(ru.ru_maxrss);        // bytes
+#else
+    return static_cast<size_t>(ru.ru_maxrss) * 1024; // kilobytes
+#endif
+}
+#else
+size_t peakRssBytes() { return 0; }
+#endif
+}
@@ -0,0 +1,257 @@
+#include "server.hpp"
+#include "bounded_queue.hpp"
+#include "scratch.hpp"
+#include "trace.hpp"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#if defined(__unix__) || defined(__APPLE__)
+#define VC_HAVE_UNIX_SOCKETS 1
+#include <csignal>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace vc {
+#ifdef VC_HAVE_UNIX_SOCKETS
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// Requests and replies are single lines; anything longer than this is not a request
+constexpr size_t kMaxLine = 1 << 20;
+
+bool readLine(int fd, std::string& line) {
+    line.clear();
+    char c;
+    while (line.size() < kMaxLine) {
+        const ssize_t r = ::read(fd, &c, 1);
+        if (r <= 0) return !line.empty();
+        if (c == '\n') return true;
+        line.push_back(c);
+    }
+    return false;
+}
+
+bool writeAll(int fd, const std::string& s) {
+    for (size_t off = 0; off < s.size(); ) {
+        const ssize_t w = ::write(fd, s.data() + off, s.size() - off);
+        if (w <= 0) return false;
+        off += static_cast<size_t>(w);
+    }
+    return true;
+}
+
+std::vector<std::string> splitTabs(const std::string& line) {
+    std::vector<std::string> out;
+    std::string tok;
+    std::istringstream ss(line);
+    while (std::getline(ss, tok, '\t')) out.push_back(tok);
+    return out;
+}
+
+std::string jsonString(const std::string& s) {
+    std::string out = "\"";
+    for (char c : s) {
+        if (c == '"' || c == '\\') { out += '\\'; out += c; }
+        else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else out += c;
+    }
+    return out + "\"";
+}
+
+std::string replyJson(const RunResult& r, double queueMs, bool preview = false) {
+    std::ostringstream ss;
+    ss << "{" << (preview ? "\"preview\":true," : "") << "\"ok\":" << (r.ok ? "true" : "false") << ",\"error\":" << jsonString(r.error)
+       << ",\"output\":" << jsonString(r.output) << ",\"run_dir\":" << jsonString(r.outDir)
+       << ",\"width\":" << r.size.width << ",\"height\":" << r.size.height
+       << ",\"queue_ms\":" << queueMs << ",\"wall_ms\":" << r.wallMs
+       << ",\"peak_rss_mb\":" << r.peakRssMB << "}\n";
+    return ss.str();
+}
+
+std::string resolve(const std::string& cwd, const std::string& p) {
+    if (p.empty() || std::filesystem::path(p).is_absolute()) return p;
+    return (std::filesystem::path(cwd) / p).lexically_normal().string();
+}
+
+// Paths a request writes to stay under the daemon's run directory: anything absolute or
+// reaching out through ".." is refused rather than written with the daemon's privileges
+std::string confined(const std::string& baseDir, const std::string& p, const char* flag) {
+    const std::filesystem::path rel(p);
+    if (rel.is_absolute() || rel.has_root_name())
+        throw std::runtime_error(std::string(flag) + ": absolute paths are not accepted by the daemon: " + p);
+    for (const auto& part : rel.lexically_normal())
+        if (part == "..") throw std::runtime_error(std::string(flag) + ": path leaves the run directory: " + p);
+    return (std::filesystem::path(baseDir) / rel).lexically_normal().string();
+}
+
+// --set and --pair become directory names under the run directory (debug images)
+const std::string& pathComponent(const std::string& v, const char* flag) {
+    if (v == "." || v == ".." || v.find_first_of("/\\") != std::string::npos)
+        throw std::runtime_error(std::string(flag) + ": must be a plain name, not a path: " + v);
+    return v;
+}
+
+// Process-wide settings the daemon fixed at startup; a request cannot change them
+constexpr const char* kDaemonOnlyFlags[] = {"--threads", "--trace", "--perf-counters", "--batch", "--jobs",
+                                            "--batch-mem-mb", "--serve", "--submit"};
+
+sockaddr_un socketAddress(const std::string& path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) throw std::runtime_error("socket path too long: " + path);
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+struct Connection { int fd; Clock::time_point accepted; };
+}
+
+int serve(const std::string& socketPath, const CliArgs& defaults) {
+    std::signal(SIGPIPE, SIG_IGN); // a client that hung up must not take the daemon down
+    int listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) { std::perror("socket"); return 1; }
+    const sockaddr_un addr = socketAddress(socketPath);
+    ::unlink(socketPath.c_str());
+    // Only the daemon's user may connect: the socket is created owner-only, not with the umask
+    const mode_t mask = ::umask(0177);
+    const bool bound = ::bind(listenFd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == 0;
+    ::umask(mask);
+    if (!bound || ::chmod(socketPath.c_str(), 0600) != 0 || ::listen(listenFd, 64) != 0) {
+        std::perror(socketPath.c_str());
+        ::close(listenFd);
+        return 1;
+    }
+
+    ThreadPool pool(defaults.opts.threads);
+    const std::string baseDir = defaults.outDir.empty() ? timestampedRunDir("serve") : defaults.outDir;
+    const int workers = defaults.batch.jobs > 0 ? defaults.batch.jobs : 2;
+    std::cout << "Serving on " << socketPath << " (" << workers << " request workers, " << pool.size()
+              << " pool workers), runs under " << baseDir << std::endl;
+
+    BoundedQueue<Connection> pending(64);
+    std::atomic<bool> stop{false};
+    std::atomic<int> seq{0};
+    std::atomic<int> active{0};
+    auto handle = [&](const Connection& conn) {
+        std::string line;
+        if (!readLine(conn.fd, line)) return;
+        std::vector<std::string> tokens = splitTabs(line);
+        if (tokens.size() == 2 && tokens[1] == "--shutdown") {
+            writeAll(conn.fd, "{\"ok\":true,\"shutdown\":true}\n");
+            stop = true;
+            ::shutdown(listenFd, SHUT_RDWR); // wakes the accept loop
+            return;
+        }
+        const double queueMs = std::chrono::duration<double, std::milli>(Clock::now() - conn.accepted).count();
+        RunResult res;
+        try {
+            if (tokens.empty()) throw std::runtime_error("empty request");
+            const std::string cwd = tokens.front();
+            for (size_t t = 1; t < tokens.size(); ++t)
+                for (const char* flag : kDaemonOnlyFlags)
+                    if (tokens[t] == flag) throw std::runtime_error(std::string(flag) + " cannot be set per request");
+            CliArgs args = defaults;
+            args.paths.clear();
+            args.videoPath.clear();
+            args.outDir.clear();
+            parseArgs(std::vector<std::string>(tokens.begin() + 1, tokens.end()), args);
+            for (auto& p : args.paths) p = resolve(cwd, p);
+            args.videoPath = resolve(cwd, args.videoPath);
+            if (args.incrementalDir != defaults.incrementalDir)
+                args.incrementalDir = confined(baseDir, args.incrementalDir, "--incremental");
+            args.outDir = args.outDir.empty() ? baseDir + "/req" + std::to_string(seq++)
+                                              : confined(baseDir, args.outDir, "--out");
+            if (args.opts.featureCacheDir != defaults.opts.featureCacheDir)
+                args.opts.featureCacheDir = confined(baseDir, args.opts.featureCacheDir, "--feature-cache");
+            pathComponent(args.setId, "--set");
+            pathComponent(args.pairId, "--pair");
+            // A progressive preview goes out as its own line ahead of the final reply
+            res = runStitch(args, pool, [&](const RunResult& preview) {
+                writeAll(conn.fd, replyJson(preview, queueMs, true));
+            });
+        } catch (const std::exception& e) {
+            res.ok = false;
+            res.error = e.what();
+        }
+        writeAll(conn.fd, replyJson(res, queueMs));
+        std::cout << "[serve] " << (res.ok ? res.output : "failed: " + res.error) << " (" << res.wallMs << " ms)" << std::endl;
+    };
+    std::vector<std::thread> threads;
+    for (int w = 0; w < workers; ++w) {
+        threads.emplace_back([&]{
+            VC_TRACE_THREAD("request worker");
+            Connection conn;
+            while (pending.pop(conn)) {
+                ++active;
+                handle(conn);
+                ::close(conn.fd);
+                // Concurrent requests share the parked scratch buffers; an idle daemon holds none
+                if (--active == 0) trimScratch();
+            }
+        });
+    }
+
+    while (!stop) {
+        int fd = ::accept(listenFd, nullptr, nullptr);
+        if (fd < 0) {
+            if (stop) break;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            std::perror("accept");
+            break;
+        }
+        if (!pending.push(Connection{fd, Clock::now()})) { ::close(fd); break; }
+    }
+    pending.close();
+    for (auto& t : threads) t.join();
+    ::close(listenFd);
+    ::unlink(socketPath.c_str());
+    std::cout << "Server stopped" << std::endl;
+    return 0;
+}
+
+int submit(const std::string& socketPath, const std::vector<std::string>& tokens) {
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) { std::perror("socket"); return 1; }
+    const sockaddr_un addr = socketAddress(socketPath);
+    if (::connect(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0) {
+        std::perror(socketPath.c_str());
+        ::close(fd);
+        return 1;
+    }
+    std::string line = std::filesystem::current_path().string();
+    for (const auto& t : tokens) line += "\t" + t;
+    std::string reply;
+    bool ok = writeAll(fd, line + "\n");
+    // Preview lines (progressive requests) come first, the final reply last
+    while (ok && (ok = readLine(fd, reply)) && reply.rfind("{\"preview\":true", 0) == 0)
+        std::cout << reply << std::endl;
+    ::close(fd);
+    if (!ok) { std::cerr << "No reply from " << socketPath << std::endl; return 1; }
+    std::cout << reply << std::endl;
+    return reply.find("\"ok\":true") != std::string::npos ? 0 : 1;
+}
+#else
+int serve(const std::string&, const CliArgs&) {
+    std::cerr << "--serve needs Unix domain sockets" << std::endl;
+    return 1;
+}
+
+int submit(const std::string&, const std::vector<std::string>&) {
+    std::cerr << "--submit needs Unix domain sockets" << std::endl;
+    return 1;
+}
+#endif
+}
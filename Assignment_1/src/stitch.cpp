@@ -5,31 +5,70 @@
 #include "warp.hpp"
 #include "preprocess.hpp"
 #include "blend.hpp"
+#include "compose.hpp"
+#include "match_graph.hpp"
+#include "bundle.hpp"
+#include "thread_pool.hpp"
+#include "bounded_queue.hpp"
+#include "refine.hpp"
+#include "overlap.hpp"
+#include "mapped_canvas.hpp"
+#include "resolution.hpp"
+#include "feature_cache.hpp"
+#include "debug_viz.hpp"
+#include "metrics.hpp"
+#include "perf_counters.hpp"
+#include "scratch.hpp"
+#include "trace.hpp"
 #include <opencv2/imgproc.hpp>
 #include <opencv2/highgui.hpp>
 #include <opencv2/core.hpp>
 #include <opencv2/calib3d.hpp>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <exception>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <numeric>
+#include <thread>
 
 namespace vc {
-static void writeCsvRow(const std::string& filePath, const std::string& header, const std::string& row) {
-    const bool exists = std::filesystem::exists(filePath);
-    std::ofstream ofs(filePath, std::ios::app);
-    if (!exists) ofs << header << "\n";
-    ofs << row << "\n";
-}
-
-static std::string toString(Detector d) {
-    return d==Detector::SIFT?"sift":d==Detector::ORB?"orb":"akaze";
-}
+// Metrics tables; rows are queued on the metrics sink and written by its own thread
+static const MetricTable kDetectTable{"detect_describe", {
+    {"run_id", 0}, {"detector", 0}, {"image_role", 0}, {"num_keypoints", 0}, {"detect_time_ms", 3},
+    {"describe_time_ms", 3}, {"avg_keypoint_scale", 3}, {"avg_response", 3}, {"cache", 0}, {"cache_time_ms", 3},
+    {"detected_keypoints", 0}}};
+static const MetricTable kMatchingTable{"matching", {
+    {"run_id", 0}, {"detector", 0}, {"knn_k", 0}, {"raw_matches", 0}, {"raw_match_time_ms", 3}, {"ratio", 2},
+    {"kept_matches", 0}, {"filter_time_ms", 3}, {"dist_mean", 6}, {"dist_std", 6},
+    {"cycles", 0}, {"instructions", 0}, {"l1d_misses", 0}, {"llc_misses", 0}, {"branch_misses", 0}}};
+static const MetricTable kRansacTable{"ransac", {
+    {"run_id", 0}, {"detector", 0}, {"thresh_px", 3}, {"iters", 0}, {"inliers", 0}, {"inlier_ratio", 6},
+    {"ransac_time_ms", 3}, {"avg_reproj_error_px", 6}, {"h00", 6}, {"h01", 6}, {"h02", 6}, {"h10", 6}, {"h11", 6},
+    {"h12", 6}, {"h20", 6}, {"h21", 6}, {"h22", 6},
+    {"cycles", 0}, {"instructions", 0}, {"l1d_misses", 0}, {"llc_misses", 0}, {"branch_misses", 0}}};
+static const MetricTable kOverlapTable{"overlap", {
+    {"run_id", 0}, {"i", 0}, {"j", 0}, {"response", 6}, {"ncc", 6}, {"overlap", 6}, {"shift_x", 3}, {"shift_y", 3},
+    {"valid", 0}, {"prepass_time_ms", 3}}};
+static const MetricTable kBundleTable{"bundle", {
+    {"run_id", 0}, {"stage", 0}, {"images", 0}, {"pairs", 0}, {"residuals", 0}, {"iterations", 0},
+    {"initial_rms_px", 6}, {"final_rms_px", 6}, {"ba_time_ms", 3}}};
+static const MetricTable kStitchTable{"stitch", {
+    {"run_id", 0}, {"detector", 0}, {"thresh_px", 3}, {"blending", 0}, {"warp_time_ms", 3}, {"blend_time_ms", 3},
+    {"seam_error_mean", 6}, {"seam_error_max", 6}, {"out_w", 0}, {"out_h", 0},
+    {"warp_cycles", 0}, {"warp_instructions", 0}, {"warp_l1d_misses", 0}, {"warp_llc_misses", 0}, {"warp_branch_misses", 0},
+    {"blend_cycles", 0}, {"blend_instructions", 0}, {"blend_l1d_misses", 0}, {"blend_llc_misses", 0},
+    {"blend_branch_misses", 0}}};
+// Per-match descriptor distances of the latest alignment, for histograms
+static const MetricTable kRawDistTable{"raw_distances", {{"distance", -1}}, true};
+static const MetricTable kKeptDistTable{"kept_distances", {{"distance", -1}}, true};
 
-static std::string toString(BlendMode b) {
-    return b==BlendMode::OVERLAY?"overlay":"feather";
-}
 static KPDesc runDetector(const cv::Mat& img, Detector d) {
     switch (d) {
         case Detector::SIFT: return detectSIFT(img);
@@ -43,6 +82,491 @@ static Distance distTypeFor(Detector d) {
     return d == Detector::ORB ? Distance::HAMMING : Distance::L2;
 }
 
+// Number of previously placed images a new image is matched against
+static constexpr size_t kMatchNeighbours = 2;
+
+// Cached features of several images, with the image and keypoint index each row came from
+struct NeighbourFeatures { KPDesc feats; std::vector<int> image; std::vector<int> local; };
+
+// Concatenates the cached features of images [first, last) with keypoints mapped into the reference frame
+static NeighbourFeatures neighbourFeatures(const std::vector<KPDesc>& feats, const std::vector<cv::Mat>& toRef, size_t first, size_t last) {
+    NeighbourFeatures out;
+    std::vector<cv::Mat> descs;
+    for (size_t j = first; j < last; ++j) {
+        const auto& f = feats[j];
+        if (f.kps.empty()) continue;
+        std::vector<cv::Point2f> pts, ptsRef;
+        cv::KeyPoint::convert(f.kps, pts);
+        cv::perspectiveTransform(pts, ptsRef, toRef[j]);
+        for (size_t k = 0; k < f.kps.size(); ++k) {
+            cv::KeyPoint kp = f.kps[k];
+            kp.pt = ptsRef[k];
+            out.feats.kps.push_back(kp);
+            out.image.push_back(static_cast<int>(j));
+            out.local.push_back(static_cast<int>(k));
+        }
+        descs.push_back(f.desc);
+    }
+    if (!descs.empty()) cv::vconcat(descs, out.feats.desc);
+    return out;
+}
+
+static std::vector<cv::Mat> resizeAll(const std::vector<cv::Mat>& imgs, double scale, ThreadPool& pool) {
+    std::vector<cv::Mat> out(imgs);
+    if (scale >= 1.0) return out; // headers only, no copies
+    pool.parallelFor(static_cast<int>(imgs.size()), [&](int i) {
+        VC_TRACE_SCOPE("resize");
+        out[i] = resized(imgs[i], scale);
+    });
+    return out;
+}
+
+namespace {
+// State shared by the alignment and compositing phases of one stitchImages call
+struct StitchContext {
+    std::vector<cv::Mat> imgs; // work-scale copies: detection, matching and RANSAC run on these
+    Detector detector;
+    BlendMode blendMode;
+    int ransacIter;
+    double reprojThresh;
+    double ratio;
+    bool debug;
+    const StitchOptions& opts;
+    std::string outDir, vizRoot, runId;
+    Sym csvDir;      // metrics table directory: outDir, or the batch directory
+    Sym outSym, runSym, detectorSym;
+    // Per-image feature cache: every input is detected and described exactly once,
+    // together with its transform into the reference frame.
+    std::vector<KPDesc> feats;
+    std::vector<cv::Mat> toRef;
+    std::vector<int> order; // placement order, reference first
+    std::vector<PairCorrespondences> corrs; // pairwise inliers for bundle adjustment
+    std::vector<cv::Mat> composeImgs; // compose-scale copies: warping and blending run on these
+    double workScale = 1.0, composeScale = 1.0; // relative to the input resolution
+    std::vector<OverlapEstimate> overlaps; // pre-pass estimates, empty when it did not run
+    std::vector<cv::Mat> detectMasks;      // per-image detection masks, empty = whole image
+    const FeatureCache* featureCache = nullptr; // on-disk detect/describe cache, null = off
+    std::unique_ptr<DebugVizWriter> viz;        // --debug images, rendered off the stitching path
+    bool logFiles = true;                       // metrics tables; off when there is no outDir
+    bool verbose = true;                        // progress on stdout; off when there is no outDir
+    StitchReport* report = nullptr;             // caller's structured results, null = none
+};
+}
+
+static void logDetect(const StitchContext& ctx, size_t idx, const char* role, const DetectStats& ds) {
+    const KPDesc& f = ctx.feats[idx];
+    double avgSize = 0.0, avgResp = 0.0; size_t n = f.kps.size();
+    for (const auto& k : f.kps) { avgSize += k.size; avgResp += k.response; }
+    if (n>0) { avgSize/=n; avgResp/=n; }
+    if (ctx.report) {
+        ImageReport& r = ctx.report->images[idx];
+        r.keypoints = static_cast<int>(n);
+        r.detectMs = ds.detectMs;
+        r.describeMs = ds.describeMs;
+        r.cache = ds.cache;
+    }
+    if (!ctx.logFiles) return;
+
+    // Log detect/describe per image
+    const char* cache = ds.cache < 0 ? "off" : ds.cache == 0 ? "miss" : "hit";
+    metrics().record(kDetectTable, ctx.csvDir, ctx.opts.metricsFormat, ctx.runSym, ctx.detectorSym, metrics().intern(role), n,
+                     ds.detectMs, ds.describeMs, avgSize, avgResp, metrics().intern(cache), ds.cacheMs, ds.detected);
+}
+
+// Feature stage: every input detected and described once, concurrently, before alignment
+static void extractAll(StitchContext& ctx, ThreadPool& pool) {
+    VC_TRACE_SCOPE("extract features");
+    if (ctx.verbose) std::cout << "Detect features in " << ctx.imgs.size() << " images..." << std::endl;
+    std::vector<DetectStats> dstats;
+    auto t0 = std::chrono::high_resolution_clock::now();
+    ctx.feats = extractFeatures(ctx.imgs, ctx.detector, pool, &dstats, ctx.detectMasks.empty() ? nullptr : &ctx.detectMasks,
+                                ctx.featureCache, ctx.opts.keypoints);
+    auto t1 = std::chrono::high_resolution_clock::now();
+    if (ctx.verbose) std::cout << "  wall time(ms)=" << std::chrono::duration<double, std::milli>(t1 - t0).count() << std::endl;
+    for (size_t i = 0; i < ctx.feats.size(); ++i)
+        logDetect(ctx, i, ctx.opts.unordered ? "image" : (i == 0 ? "ref" : "new"), dstats[i]);
+}
+
+static void logMatching(const StitchContext& ctx, int a, int b, size_t rawMatches, double matchMs, size_t kept, double filterMs,
+                        double dm, double ds, const PerfCounts& pc) {
+    if (ctx.report) {
+        PairReport r;
+        r.a = a; r.b = b;
+        r.rawMatches = static_cast<int>(rawMatches);
+        r.keptMatches = static_cast<int>(kept);
+        r.matchMs = matchMs;
+        r.filterMs = filterMs;
+        ctx.report->pairs.push_back(std::move(r));
+    }
+    if (!ctx.logFiles) return;
+    metrics().record(kMatchingTable, ctx.csvDir, ctx.opts.metricsFormat, ctx.runSym, ctx.detectorSym, 2, rawMatches, matchMs,
+                     ctx.ratio, kept, filterMs, dm, ds, pc.cycles, pc.instructions, pc.l1dMisses, pc.llcMisses, pc.branchMisses);
+}
+
+// Completes the pair last passed to logMatching
+static void logRansac(const StitchContext& ctx, int inliers, double inlier_ratio, double ransac_ms, double avg_err, const cv::Mat& H,
+                      const PerfCounts& pc) {
+    if (ctx.report) {
+        PairReport& r = ctx.report->pairs.back();
+        r.inliers = inliers;
+        r.ransacMs = ransac_ms;
+        r.avgReprojError = avg_err;
+        r.H = H.clone();
+    }
+    if (!ctx.logFiles) return;
+    // H flatten
+    double h00=H.at<double>(0,0), h01=H.at<double>(0,1), h02=H.at<double>(0,2);
+    double h10=H.at<double>(1,0), h11=H.at<double>(1,1), h12=H.at<double>(1,2);
+    double h20=H.at<double>(2,0), h21=H.at<double>(2,1), h22=H.at<double>(2,2);
+    metrics().record(kRansacTable, ctx.csvDir, ctx.opts.metricsFormat, ctx.runSym, ctx.detectorSym, ctx.reprojThresh,
+                     ctx.ransacIter, inliers, inlier_ratio, ransac_ms, avg_err, h00, h01, h02, h10, h11, h12, h20, h21, h22,
+                     pc.cycles, pc.instructions, pc.l1dMisses, pc.llcMisses, pc.branchMisses);
+}
+
+// Sequential set: aligns image i against the cached features of its previous neighbours.
+// Returns false when no valid homography was found.
+static bool alignNext(StitchContext& ctx, size_t i) {
+    VC_TRACE_SCOPE("align image");
+    const auto& imgs = ctx.imgs;
+    const auto detector = ctx.detector;
+    const int ransacIter = ctx.ransacIter;
+    const double reprojThresh = ctx.reprojThresh;
+    const double ratio = ctx.ratio;
+    auto& feats = ctx.feats;
+    auto& toRef = ctx.toRef;
+
+    if (ctx.verbose) std::cout << "[" << i << "/" << imgs.size()-1 << "] Align..." << std::endl;
+
+    // Match against the cached features of the previous neighbours, in reference coordinates
+    const size_t first = i > kMatchNeighbours ? i - kMatchNeighbours : 0;
+    NeighbourFeatures nf = neighbourFeatures(feats, toRef, first, i);
+    const KPDesc& a = nf.feats;
+    const KPDesc& b = feats[i];
+    if (ctx.verbose) std::cout << "  neighbour kps=" << a.kps.size() << ", new kps=" << b.kps.size() << std::endl;
+
+    auto distType = distTypeFor(detector);
+    if (ctx.verbose) std::cout << "  Match descriptors..." << std::endl;
+    auto t0 = std::chrono::high_resolution_clock::now();
+    perf::Section matchSection;
+    auto t_m0 = std::chrono::high_resolution_clock::now();
+    auto knn = bruteForceMatchKNN(a.desc, b.desc, distType, 2);
+    auto t_m1 = std::chrono::high_resolution_clock::now();
+    std::vector<Match> good = ratioTest(knn, ratio);
+    auto t_m2 = std::chrono::high_resolution_clock::now();
+    const PerfCounts matchPerf = matchSection.stop();
+    auto t1 = std::chrono::high_resolution_clock::now();
+    double matchMs = std::chrono::duration<double, std::milli>(t_m1 - t_m0).count();
+    double filterMs = std::chrono::duration<double, std::milli>(t_m2 - t_m1).count();
+    if (ctx.verbose) std::cout << "  good matches=" << good.size() << ", time(ms)=" << (matchMs+filterMs) << std::endl;
+
+    // Distances for histograms
+    std::vector<double> raw_dists; raw_dists.reserve(knn.size());
+    for (const auto& pr : knn) raw_dists.push_back(pr.first.dist);
+    std::vector<double> kept_dists; kept_dists.reserve(good.size());
+    for (const auto& m : good) kept_dists.push_back(m.dist);
+    // Matching CSV
+    auto meanStd = [](const std::vector<double>& v){
+        if (v.empty()) return std::pair<double,double>(0.0,0.0);
+        double s = std::accumulate(v.begin(), v.end(), 0.0);
+        double mean = s / v.size();
+        double var = 0.0; for (double x : v){ double d=x-mean; var += d*d; }
+        var /= v.size();
+        return std::pair<double,double>(mean, std::sqrt(var));
+    };
+    auto [dm, ds] = meanStd(kept_dists);
+    logMatching(ctx, static_cast<int>(i) - 1, static_cast<int>(i), knn.size(), matchMs, good.size(), filterMs, dm, ds, matchPerf);
+    if (ctx.logFiles) {
+        // Distance series, handed over without a copy
+        metrics().recordSeries(kRawDistTable, ctx.outSym, ctx.opts.metricsFormat, std::move(raw_dists));
+        metrics().recordSeries(kKeptDistTable, ctx.outSym, ctx.opts.metricsFormat, std::move(kept_dists));
+    }
+
+    if (ctx.viz) {
+        // Visualise against the direct neighbour, in its own image coordinates
+        PairViz pv;
+        pv.index = i;
+        pv.imgA = imgs[i-1];
+        pv.imgB = imgs[i];
+        pv.kpsA = feats[i-1].kps;
+        pv.kpsB = b.kps;
+        for (const auto& m : good)
+            if (nf.image[m.queryIdx] == static_cast<int>(i-1))
+                pv.matches.emplace_back(nf.local[m.queryIdx], m.trainIdx, static_cast<float>(m.dist));
+        ctx.viz->matches(std::move(pv));
+    }
+
+    std::vector<cv::Point2f> srcPts, dstPts;
+    srcPts.reserve(good.size());
+    dstPts.reserve(good.size());
+    for (const auto& m : good) {
+        srcPts.push_back(a.kps[m.queryIdx].pt);
+        dstPts.push_back(b.kps[m.trainIdx].pt);
+    }
+    std::vector<unsigned char> mask_p2n, mask_n2p;
+    if (ctx.verbose) std::cout << "  RANSAC homography..." << std::endl;
+    perf::Section ransacSection;
+    auto t_r0 = std::chrono::high_resolution_clock::now();
+    cv::Mat H_p2n = ransacHomography(srcPts, dstPts, ransacIter, reprojThresh, mask_p2n); // ref->new
+    cv::Mat H_n2p = ransacHomography(dstPts, srcPts, ransacIter, reprojThresh, mask_n2p); // new->ref
+    auto t_r1 = std::chrono::high_resolution_clock::now();
+    const PerfCounts ransacPerf = ransacSection.stop();
+    if ((H_p2n.empty() || !cv::checkRange(H_p2n)) && (H_n2p.empty() || !cv::checkRange(H_n2p))) return false;
+
+    // Choose direction: prefer the one with more inliers
+    int in_p2n = 0, in_n2p = 0;
+    for (auto v : mask_p2n) in_p2n += (v ? 1 : 0);
+    for (auto v : mask_n2p) in_n2p += (v ? 1 : 0);
+    bool use_n2p = in_n2p >= in_p2n;
+    if (ctx.verbose) std::cout << "  inliers(p2n)=" << in_p2n << ", inliers(n2p)=" << in_n2p << ", use=" << (use_n2p?"n2p":"p2n") << std::endl;
+    cv::Mat H_new_to_ref = use_n2p ? H_n2p : H_p2n.inv();
+    if (H_new_to_ref.empty() || !cv::checkRange(H_new_to_ref)) return false;
+
+    // RANSAC CSV (avg reprojection error on inliers)
+    auto reprojAvg = [&](const std::vector<cv::Point2f>& P, const std::vector<cv::Point2f>& Q, const std::vector<unsigned char>& m, const cv::Mat& H){
+        double s=0.0; int c=0; for(size_t t=0;t<P.size();++t){ if(!m[t]) continue; cv::Vec3d ph(P[t].x,P[t].y,1.0); cv::Vec3d q = cv::Mat(H*cv::Mat(ph)); double wx=q[0]/q[2]; double wy=q[1]/q[2]; double dx=wx-Q[t].x, dy=wy-Q[t].y; s+=std::sqrt(dx*dx+dy*dy); ++c;} return c>0 ? s/c : 0.0; };
+    double ransac_ms = std::chrono::duration<double, std::milli>(t_r1 - t_r0).count();
+    int inliers = use_n2p ? in_n2p : in_p2n;
+    double inlier_ratio = (good.empty()? 0.0 : static_cast<double>(inliers)/static_cast<double>(good.size()));
+    double avg_err = use_n2p ? reprojAvg(dstPts, srcPts, mask_n2p, H_n2p) : reprojAvg(srcPts, dstPts, mask_p2n, H_p2n);
+    logRansac(ctx, inliers, inlier_ratio, ransac_ms, avg_err, H_new_to_ref, ransacPerf);
+
+    if (ctx.viz) {
+        // Inliers from the direct neighbour, in its own image coordinates
+        const auto& maskUse = use_n2p ? mask_n2p : mask_p2n;
+        PairViz pv;
+        pv.index = i;
+        pv.imgA = imgs[i-1];
+        pv.imgB = imgs[i];
+        for (size_t t = 0; t < maskUse.size(); ++t) {
+            if (maskUse[t] && nf.image[good[t].queryIdx] == static_cast<int>(i-1)) {
+                pv.kpsA.push_back(feats[i-1].kps[nf.local[good[t].queryIdx]]);
+                pv.kpsB.push_back(b.kps[good[t].trainIdx]);
+                pv.matches.emplace_back(static_cast<int>(pv.kpsA.size()-1), static_cast<int>(pv.kpsB.size()-1), 0.f);
+            }
+        }
+        ctx.viz->inliers(std::move(pv));
+    }
+
+    // Inlier correspondences per neighbour pair, kept for global refinement
+    const auto& inMask = use_n2p ? mask_n2p : mask_p2n;
+    std::map<int, PairCorrespondences> byNeighbour;
+    for (size_t t = 0; t < inMask.size(); ++t) {
+        if (!inMask[t]) continue;
+        const int j = nf.image[good[t].queryIdx];
+        auto& pc = byNeighbour[j];
+        pc.a = j; pc.b = static_cast<int>(i);
+        pc.ptsA.push_back(feats[j].kps[nf.local[good[t].queryIdx]].pt);
+        pc.ptsB.push_back(b.kps[good[t].trainIdx].pt);
+    }
+    for (auto& kv : byNeighbour) ctx.corrs.push_back(std::move(kv.second));
+
+    toRef[i] = H_new_to_ref;
+    return true;
+}
+
+// Sequential set: chain order, stops at the first image that cannot be aligned
+static void alignSequential(StitchContext& ctx) {
+    ctx.toRef[0] = cv::Mat::eye(3, 3, CV_64F);
+    size_t placed = 1;
+    while (placed < ctx.imgs.size() && alignNext(ctx, placed)) ++placed;
+    ctx.order.resize(placed);
+    std::iota(ctx.order.begin(), ctx.order.end(), 0);
+}
+
+// Sequential set, pipelined: extraction of image i+2, alignment of image i+1 and warping of
+// image i (at compose scale) run on their own threads, connected by bounded queues. With
+// tiles == nullptr the warp stage is skipped (transforms still change afterwards, e.g. under
+// bundle adjustment).
+static void alignPipelined(StitchContext& ctx, std::vector<WarpedTile>* tiles) {
+    const size_t n = ctx.imgs.size();
+    ctx.feats.assign(n, KPDesc());
+    if (tiles) tiles->assign(n, WarpedTile());
+    BoundedQueue<size_t> described(2), aligned(2);
+    std::atomic<bool> stop{false};
+    // The first exception of any stage stops all three; it is rethrown once they have all ended
+    std::exception_ptr error;
+    std::mutex errorMtx;
+    auto fail = [&]{
+        {
+            std::lock_guard<std::mutex> lk(errorMtx);
+            if (!error) error = std::current_exception();
+        }
+        stop = true;
+        described.close();
+        aligned.close();
+    };
+
+    std::thread extractor([&]{
+        VC_TRACE_THREAD("extract stage");
+        try {
+            for (size_t i = 0; i < n && !stop; ++i) {
+                DetectStats ds;
+                ctx.feats[i] = describeCached(ctx.featureCache, ctx.imgs[i], ctx.detector, &ds,
+                                              ctx.detectMasks.empty() ? cv::Mat() : ctx.detectMasks[i], ctx.opts.keypoints);
+                logDetect(ctx, i, i == 0 ? "ref" : "new", ds);
+                if (!described.push(i)) break;
+            }
+        } catch (...) {
+            fail();
+        }
+        described.close();
+    });
+    std::thread warper([&]{
+        VC_TRACE_THREAD("warp stage");
+        try {
+            const double k = ctx.composeScale / ctx.workScale;
+            size_t i;
+            while (aligned.pop(i)) (*tiles)[i] = warpTile(ctx.composeImgs[i], rescaleHomography(ctx.toRef[i], k));
+        } catch (...) {
+            fail();
+        }
+    });
+
+    size_t placed = 0;
+    try {
+        size_t i;
+        while (!stop && described.pop(i)) {
+            if (i == 0) {
+                ctx.toRef[0] = cv::Mat::eye(3, 3, CV_64F);
+            } else if (!alignNext(ctx, i)) {
+                break;
+            }
+            placed = i + 1;
+            if (tiles) aligned.push(i);
+        }
+    } catch (...) {
+        fail();
+    }
+    stop = true;
+    described.close();
+    aligned.close();
+    extractor.join();
+    warper.join();
+    if (error) std::rethrow_exception(error);
+
+    if (tiles) tiles->resize(placed);
+    ctx.order.resize(placed);
+    std::iota(ctx.order.begin(), ctx.order.end(), 0);
+}
+
+// Unordered set: every pair matched in parallel, images placed along a maximum spanning tree
+static void alignUnordered(StitchContext& ctx, ThreadPool& pool) {
+    VC_TRACE_SCOPE("align unordered");
+    const int n = static_cast<int>(ctx.imgs.size());
+
+    std::vector<std::pair<int,int>> pairs;
+    std::vector<OverlapEstimate> seeds;
+    if (ctx.overlaps.empty()) {
+        for (int i = 0; i < n; ++i)
+            for (int j = i + 1; j < n; ++j) pairs.emplace_back(i, j);
+    } else {
+        // Pairs the pre-pass found no overlap for cannot align: skip them entirely
+        for (const auto& e : ctx.overlaps) {
+            if (!e.valid) continue;
+            pairs.emplace_back(e.i, e.j);
+            seeds.push_back(e);
+        }
+    }
+    if (ctx.verbose) std::cout << "Match " << pairs.size() << " pairs..." << std::endl;
+    auto pms = matchPairs(ctx.feats, pairs, distTypeFor(ctx.detector), ctx.ratio, ctx.ransacIter, ctx.reprojThresh, pool,
+                          seeds.empty() ? nullptr : &seeds);
+    for (const auto& pm : pms) {
+        logMatching(ctx, pm.i, pm.j, pm.rawMatches, pm.matchMs, pm.matches.size(), pm.filterMs, pm.distMean, pm.distStd, pm.matchPerf);
+        if (pm.H.empty()) continue;
+        double inlier_ratio = pm.matches.empty() ? 0.0 : static_cast<double>(pm.inliers) / pm.matches.size();
+        logRansac(ctx, pm.inliers, inlier_ratio, pm.ransacMs, pm.avgReprojError, pm.H, pm.ransacPerf);
+    }
+
+    ctx.toRef = spanningTreeTransforms(n, pms, ctx.opts.minInliers, ctx.order);
+    if (ctx.verbose) std::cout << "  reference=" << ctx.order.front() << ", placed=" << ctx.order.size() << "/" << n << std::endl;
+
+    // Every accepted pair, not only the tree edges, constrains the global refinement
+    for (const auto& pm : pms) {
+        if (pm.H.empty() || pm.inliers < ctx.opts.minInliers) continue;
+        PairCorrespondences pc; pc.a = pm.i; pc.b = pm.j;
+        for (size_t t = 0; t < pm.matches.size(); ++t) {
+            if (!pm.inlierMask[t]) continue;
+            pc.ptsA.push_back(ctx.feats[pm.i].kps[pm.matches[t].queryIdx].pt);
+            pc.ptsB.push_back(ctx.feats[pm.j].kps[pm.matches[t].trainIdx].pt);
+        }
+        ctx.corrs.push_back(std::move(pc));
+    }
+}
+
+// Phase-correlation pre-pass on thumbnails: all pairs of an unordered set, consecutive pairs
+// otherwise. Fills ctx.overlaps and the detection masks.
+static void prepassOverlaps(StitchContext& ctx, ThreadPool& pool) {
+    VC_TRACE_SCOPE("overlap prepass");
+    const int n = static_cast<int>(ctx.imgs.size());
+    std::vector<std::pair<int,int>> pairs;
+    for (int i = 0; i < n; ++i)
+        for (int j = i + 1; j < (ctx.opts.unordered ? n : std::min(n, i + 2)); ++j) pairs.emplace_back(i, j);
+    if (ctx.verbose) std::cout << "Overlap pre-pass on " << pairs.size() << " pairs..." << std::endl;
+    ctx.overlaps = estimateOverlaps(ctx.imgs, pairs, pool, ctx.opts.prepassPx);
+
+    int kept = 0;
+    for (const auto& e : ctx.overlaps) {
+        kept += e.valid ? 1 : 0;
+        if (!ctx.logFiles) continue;
+        metrics().record(kOverlapTable, ctx.csvDir, ctx.opts.metricsFormat, ctx.runSym, e.i, e.j, e.response, e.ncc, e.overlap,
+                         e.shift.x, e.shift.y, e.valid, e.ms);
+    }
+    if (ctx.verbose) std::cout << "  overlapping pairs=" << kept << "/" << pairs.size() << std::endl;
+
+    ctx.detectMasks = overlapMasks(ctx.imgs, ctx.overlaps);
+    if (!ctx.opts.unordered) {
+        // A chain still has to align across a link the pre-pass missed: detect everywhere there
+        for (const auto& e : ctx.overlaps) {
+            if (e.valid) continue;
+            ctx.detectMasks[e.i].release();
+            ctx.detectMasks[e.j].release();
+        }
+    }
+}
+
+static void runBundleAdjustment(const StitchContext& ctx, std::vector<cv::Mat>& toRef,
+                                const std::vector<PairCorrespondences>& corrs, double huberPx,
+                                const char* stage, ThreadPool& pool) {
+    VC_TRACE_SCOPE("bundle adjust");
+    if (ctx.verbose) std::cout << "Bundle adjustment (" << stage << ")..." << std::endl;
+    BundleStats bs = refineHomographies(toRef, corrs, ctx.order.front(), pool, ctx.opts.bundleIterations, huberPx);
+    if (ctx.verbose) std::cout << "  rms " << bs.initialRms << " -> " << bs.finalRms << " px, iterations=" << bs.iterations << std::endl;
+    if (ctx.report) ctx.report->bundle.push_back(bs);
+    if (!ctx.logFiles) return;
+    metrics().record(kBundleTable, ctx.csvDir, ctx.opts.metricsFormat, ctx.runSym, metrics().intern(stage), ctx.order.size(),
+                     corrs.size(), bs.residuals, bs.iterations, bs.initialRms, bs.finalRms, bs.ms);
+}
+
+// Guided full-resolution refinement: work-scale inliers are re-localised on the input images
+// around their predicted positions, then all transforms are re-optimised against them
+static void refineFullResolution(const StitchContext& ctx, const std::vector<cv::Mat>& fullImgs,
+                                 std::vector<cv::Mat>& toRefFull, ThreadPool& pool) {
+    VC_TRACE_SCOPE("refine full res");
+    const double k = 1.0 / ctx.workScale;
+    std::vector<cv::Mat> gray(fullImgs.size());
+    pool.parallelFor(static_cast<int>(ctx.order.size()), [&](int t) {
+        gray[ctx.order[t]] = toGray(fullImgs[ctx.order[t]]);
+    });
+    std::vector<PairCorrespondences> corrs;
+    for (const auto& pc : ctx.corrs) {
+        if (toRefFull[pc.a].empty() || toRefFull[pc.b].empty()) continue;
+        PairCorrespondences full = pc;
+        for (auto& p : full.ptsA) p *= static_cast<float>(k);
+        for (auto& p : full.ptsB) p *= static_cast<float>(k);
+        corrs.push_back(std::move(full));
+    }
+    std::vector<int> refined(corrs.size(), 0);
+    pool.parallelFor(static_cast<int>(corrs.size()), [&](int c) {
+        auto& pc = corrs[c];
+        cv::Mat H_ab = toRefFull[pc.b].inv() * toRefFull[pc.a];
+        refined[c] = refineCorrespondences(gray[pc.a], gray[pc.b], H_ab, pc.ptsA, pc.ptsB);
+    });
+    size_t total = 0, moved = 0;
+    for (size_t c = 0; c < corrs.size(); ++c) { total += corrs[c].ptsA.size(); moved += refined[c]; }
+    if (ctx.verbose) std::cout << "Full-res refinement: " << moved << "/" << total << " correspondences re-localised" << std::endl;
+    runBundleAdjustment(ctx, toRefFull, corrs, ctx.reprojThresh * k, "full", pool);
+}
+
 cv::Mat stitchImages(const std::vector<cv::Mat>& imgs,
                      Detector detector,
                      vc::BlendMode blendMode,
@@ -52,387 +576,209 @@ cv::Mat stitchImages(const std::vector<cv::Mat>& imgs,
                      bool debug,
                      const std::string& outDir,
                      const std::string& setId,
-                     const std::string& pairId) {
+                     const std::string& pairId,
+                     const StitchOptions& opts) {
     if (imgs.empty()) return cv::Mat();
+    VC_TRACE_SCOPE("stitch");
+    const auto tStart = std::chrono::steady_clock::now();
+    const ScratchStats scratchStart = scratchStats();
+    const bool files = !outDir.empty();
     // Prepare output directory
-    std::filesystem::create_directories(outDir);
     std::string vizRoot = outDir;
-    if (!setId.empty() && !pairId.empty()) {
+    if (files) std::filesystem::create_directories(outDir);
+    if (files && !setId.empty() && !pairId.empty()) {
         vizRoot = outDir + "/viz/" + setId + "/" + toString(detector) + "/" + pairId;
         std::filesystem::create_directories(vizRoot);
     }
     // Save params
-    {
+    if (files) {
         std::ofstream ofs(outDir + "/params.txt");
-        ofs << "detector=" << (detector==Detector::SIFT?"sift":detector==Detector::ORB?"orb":"akaze") << "\n";
-        ofs << "blend=" << (blendMode==BlendMode::OVERLAY?"overlay":"feather") << "\n";
+        ofs << "detector=" << toString(detector) << "\n";
+        ofs << "blend=" << toString(blendMode) << "\n";
         ofs << "ratio=" << ratio << "\n";
         ofs << "ransac_iter=" << ransacIter << "\n";
         ofs << "reproj_th=" << reprojThresh << "\n";
         ofs << "debug=" << (debug?1:0) << "\n";
+        ofs << "unordered=" << (opts.unordered?1:0) << "\n";
+        ofs << "pipelined=" << (opts.pipelined?1:0) << "\n";
+        ofs << "bundle_adjust=" << (opts.bundleAdjust?1:0) << "\n";
+        ofs << "work_megapix=" << opts.workMegapix << "\n";
+        ofs << "compose_megapix=" << opts.composeMegapix << "\n";
+        ofs << "refine_full_res=" << (opts.refineFullRes?1:0) << "\n";
+        ofs << "overlap_prepass=" << (opts.overlapPrepass?opts.prepassPx:0) << "\n";
+        ofs << "tiff=" << (opts.tiffPath.empty() ? "none" : opts.tiffPath) << "\n";
+        ofs << "dzi=" << (opts.dziPath.empty() ? "none" : opts.dziPath) << "\n";
+        ofs << "mapped_canvas=" << (opts.mappedCanvas?1:0) << "\n";
+        ofs << "canvas_budget_mb=" << opts.canvasBudgetMB << "\n";
+        ofs << "keypoint_select=" << toString(opts.keypoints) << "\n";
+        ofs << "feature_cache=" << (opts.featureCacheDir.empty() ? "none" : opts.featureCacheDir) << "\n";
+        ofs << "metrics=" << toString(opts.metricsFormat) << "\n";
+        ofs << "perf_counters=" << (perf::enabled()?1:0) << "\n";
+        ofs << "viz_scale=" << opts.vizScale << "\n";
         ofs.flush();
     }
 
-    cv::Mat pano = imgs[0].clone();
-
-    for (size_t i = 1; i < imgs.size(); ++i) {
-        // Debug outputs
-        char namebuf[256];
-
-        std::cout << "[" << i << "/" << imgs.size()-1 << "] Detect features..." << std::endl;
-        // Build detector ptr
-        cv::Ptr<cv::Feature2D> detPtr;
-        if (detector == Detector::SIFT) detPtr = cv::SIFT::create();
-        else if (detector == Detector::ORB) detPtr = cv::ORB::create(5000);
-        else detPtr = cv::AKAZE::create();
-
-        // Detect + describe with timing (pano)
-        KPDesc a; KPDesc b;
-        auto t_d0 = std::chrono::high_resolution_clock::now();
-        std::vector<cv::KeyPoint> a_kps; detPtr->detect(pano, a_kps);
-        auto t_d1 = std::chrono::high_resolution_clock::now();
-        cv::Mat a_desc; detPtr->compute(pano, a_kps, a_desc);
-        auto t_d2 = std::chrono::high_resolution_clock::now();
-        a.kps = std::move(a_kps); a.desc = a_desc;
-
-        // Detect + describe with timing (new)
-        auto t_e0 = std::chrono::high_resolution_clock::now();
-        std::vector<cv::KeyPoint> b_kps; detPtr->detect(imgs[i], b_kps);
-        auto t_e1 = std::chrono::high_resolution_clock::now();
-        cv::Mat b_desc; detPtr->compute(imgs[i], b_kps, b_desc);
-        auto t_e2 = std::chrono::high_resolution_clock::now();
-        b.kps = std::move(b_kps); b.desc = b_desc;
-
-        double pano_detect_ms = std::chrono::duration<double, std::milli>(t_d1 - t_d0).count();
-        double pano_desc_ms   = std::chrono::duration<double, std::milli>(t_d2 - t_d1).count();
-        double new_detect_ms  = std::chrono::duration<double, std::milli>(t_e1 - t_e0).count();
-        double new_desc_ms    = std::chrono::duration<double, std::milli>(t_e2 - t_e1).count();
-
-        auto avgStats = [](const std::vector<cv::KeyPoint>& kps){
-            double avgSize = 0.0, avgResp = 0.0; size_t n = kps.size();
-            for (const auto& k : kps) { avgSize += k.size; avgResp += k.response; }
-            if (n>0) { avgSize/=n; avgResp/=n; }
-            return std::pair<double,double>(avgSize, avgResp);
-        };
-        auto [pano_avg_size, pano_avg_resp] = avgStats(a.kps);
-        auto [new_avg_size, new_avg_resp]   = avgStats(b.kps);
-
-        std::cout << "  pano kps=" << a.kps.size() << ", new kps=" << b.kps.size() << std::endl;
-        // Log detect/describe per image
-        const std::string ddHead = "run_id,detector,image_role,num_keypoints,detect_time_ms,describe_time_ms,avg_keypoint_scale,avg_response";
-        const std::string run_id = outDir.substr(outDir.find_last_of('/')+1);
-        char rowbuf[512];
-        std::snprintf(rowbuf, sizeof(rowbuf), "%s,%s,pano,%zu,%.3f,%.3f,%.3f,%.3f",
-                      run_id.c_str(), toString(detector).c_str(), a.kps.size(), pano_detect_ms, pano_desc_ms, pano_avg_size, pano_avg_resp);
-        writeCsvRow(outDir + "/detect_describe.csv", ddHead, rowbuf);
-        std::snprintf(rowbuf, sizeof(rowbuf), "%s,%s,new,%zu,%.3f,%.3f,%.3f,%.3f",
-                      run_id.c_str(), toString(detector).c_str(), b.kps.size(), new_detect_ms, new_desc_ms, new_avg_size, new_avg_resp);
-        writeCsvRow(outDir + "/detect_describe.csv", ddHead, rowbuf);
-
-        auto distType = distTypeFor(detector);
-        std::cout << "  Match descriptors..." << std::endl;
-        auto t0 = std::chrono::high_resolution_clock::now();
-        auto t_m0 = std::chrono::high_resolution_clock::now();
-        auto knn = bruteForceMatchKNN(a.desc, b.desc, distType, 2);
-        auto t_m1 = std::chrono::high_resolution_clock::now();
-        std::vector<Match> good = ratioTest(knn, ratio);
-        auto t_m2 = std::chrono::high_resolution_clock::now();
-        auto t1 = std::chrono::high_resolution_clock::now();
-        double matchMs = std::chrono::duration<double, std::milli>(t_m1 - t_m0).count();
-        double filterMs = std::chrono::duration<double, std::milli>(t_m2 - t_m1).count();
-        std::cout << "  good matches=" << good.size() << ", time(ms)=" << (matchMs+filterMs) << std::endl;
-
-        // Distances for histograms
-        std::vector<double> raw_dists; raw_dists.reserve(knn.size());
-        for (const auto& pr : knn) raw_dists.push_back(pr.first.dist);
-        std::vector<double> kept_dists; kept_dists.reserve(good.size());
-        for (const auto& m : good) kept_dists.push_back(m.dist);
-        // Save distances to CSV
-        {
-            std::ofstream fd(outDir + "/raw_distances.csv");
-            for (double d : raw_dists) fd << d << "\n";
-        }
-        {
-            std::ofstream fd(outDir + "/kept_distances.csv");
-            for (double d : kept_dists) fd << d << "\n";
-        }
-        // Matching CSV
-        const std::string mHead = "run_id,detector,knn_k,raw_matches,raw_match_time_ms,ratio,kept_matches,filter_time_ms,dist_mean,dist_std";
-        auto meanStd = [](const std::vector<double>& v){
-            if (v.empty()) return std::pair<double,double>(0.0,0.0);
-            double s = std::accumulate(v.begin(), v.end(), 0.0);
-            double mean = s / v.size();
-            double var = 0.0; for (double x : v){ double d=x-mean; var += d*d; }
-            var /= v.size();
-            return std::pair<double,double>(mean, std::sqrt(var));
-        };
-        auto [dm, ds] = meanStd(kept_dists);
-        std::snprintf(rowbuf, sizeof(rowbuf), "%s,%s,%d,%zu,%.3f,%.2f,%zu,%.3f,%.6f,%.6f",
-                      run_id.c_str(), toString(detector).c_str(), 2, knn.size(), matchMs, ratio, good.size(), filterMs, dm, ds);
-        writeCsvRow(outDir + "/matching.csv", mHead, rowbuf);
-
-        if (debug) {
-            // 1) More visible keypoints: rich style + bright color
-            cv::Mat imgKP1, imgKP2;
-            cv::drawKeypoints(pano, a.kps, imgKP1, cv::Scalar(0,255,255), cv::DrawMatchesFlags::DRAW_RICH_KEYPOINTS);
-            cv::drawKeypoints(imgs[i], b.kps, imgKP2, cv::Scalar(0,255,255), cv::DrawMatchesFlags::DRAW_RICH_KEYPOINTS);
-            snprintf(namebuf, sizeof(namebuf), "%s/kps_%zu_a.jpg", vizRoot.c_str(), i);
-            cv::imwrite(namebuf, imgKP1);
-            snprintf(namebuf, sizeof(namebuf), "%s/kps_%zu_b.jpg", vizRoot.c_str(), i);
-            cv::imwrite(namebuf, imgKP2);
-
-            // 2) Dense matches (OpenCV default)
-            std::vector<cv::DMatch> dm; dm.reserve(good.size());
-            for (size_t t = 0; t < good.size(); ++t) dm.emplace_back(good[t].queryIdx, good[t].trainIdx, static_cast<float>(good[t].dist));
-            cv::Mat matchesImg;
-            cv::drawMatches(pano, a.kps, imgs[i], b.kps, dm, matchesImg);
-            snprintf(namebuf, sizeof(namebuf), "%s/matches_%zu.jpg", vizRoot.c_str(), i);
-            cv::imwrite(namebuf, matchesImg);
-
-            // 3) Annotated matches: colored pairs + pair index labels (topN to avoid clutter)
-            auto colorFromIndex = [](int idx){
-                int hue = (idx * 37) % 180; // spread hues
-                cv::Mat hsv(1,1,CV_8UC3, cv::Vec3b((uchar)hue, 200, 255));
-                cv::Mat bgr; cv::cvtColor(hsv, bgr, cv::COLOR_HSV2BGR);
-                cv::Vec3b c = bgr.at<cv::Vec3b>(0,0);
-                return cv::Scalar(c[0], c[1], c[2]);
-            };
-            int H = std::max(pano.rows, imgs[i].rows);
-            int W = pano.cols + imgs[i].cols;
-            cv::Mat anno(H, W, CV_8UC3, cv::Scalar::all(0));
-            pano.copyTo(anno(cv::Rect(0, 0, pano.cols, pano.rows)));
-            imgs[i].copyTo(anno(cv::Rect(pano.cols, 0, imgs[i].cols, imgs[i].rows)));
-            int xOffset = pano.cols;
-            int topN = std::min<int>(static_cast<int>(good.size()), 150);
-            for (int t = 0; t < topN; ++t) {
-                const auto &m = good[t];
-                cv::Point p(cvRound(a.kps[m.queryIdx].pt.x), cvRound(a.kps[m.queryIdx].pt.y));
-                cv::Point q(cvRound(b.kps[m.trainIdx].pt.x) + xOffset, cvRound(b.kps[m.trainIdx].pt.y));
-                cv::Scalar col = colorFromIndex(t);
-                cv::circle(anno, p, 4, col, 2, cv::LINE_AA);
-                cv::circle(anno, q, 4, col, 2, cv::LINE_AA);
-                cv::line(anno, p, q, col, 1, cv::LINE_AA);
-                char txt[16]; std::snprintf(txt, sizeof(txt), "%d", t+1);
-                cv::putText(anno, txt, p + cv::Point(5,-5), cv::FONT_HERSHEY_SIMPLEX, 0.45, col, 1, cv::LINE_AA);
-                cv::putText(anno, txt, q + cv::Point(5,-5), cv::FONT_HERSHEY_SIMPLEX, 0.45, col, 1, cv::LINE_AA);
-            }
-            snprintf(namebuf, sizeof(namebuf), "%s/matches_annotated_%zu.jpg", vizRoot.c_str(), i);
-            cv::imwrite(namebuf, anno);
-        }
-
-        std::vector<cv::Point2f> srcPts, dstPts;
-        srcPts.reserve(good.size());
-        dstPts.reserve(good.size());
-        for (const auto& m : good) {
-            srcPts.push_back(a.kps[m.queryIdx].pt);
-            dstPts.push_back(b.kps[m.trainIdx].pt);
-        }
-        std::vector<unsigned char> mask_p2n, mask_n2p;
-        std::cout << "  RANSAC homography..." << std::endl;
-        auto t_r0 = std::chrono::high_resolution_clock::now();
-        cv::Mat H_p2n = ransacHomography(srcPts, dstPts, ransacIter, reprojThresh, mask_p2n); // pano->new
-        cv::Mat H_n2p = ransacHomography(dstPts, srcPts, ransacIter, reprojThresh, mask_n2p); // new->pano
-        auto t_r1 = std::chrono::high_resolution_clock::now();
-        if ((H_p2n.empty() || !cv::checkRange(H_p2n)) && (H_n2p.empty() || !cv::checkRange(H_n2p))) return pano;
-
-        // Choose direction: prefer the one with more inliers
-        int in_p2n = 0, in_n2p = 0;
-        for (auto v : mask_p2n) in_p2n += (v ? 1 : 0);
-        for (auto v : mask_n2p) in_n2p += (v ? 1 : 0);
-        bool use_n2p = in_n2p >= in_p2n;
-        std::cout << "  inliers(p2n)=" << in_p2n << ", inliers(n2p)=" << in_n2p << ", use=" << (use_n2p?"n2p":"p2n") << std::endl;
-        cv::Mat H_new_to_pano = use_n2p ? H_n2p : H_p2n.inv();
-        if (H_new_to_pano.empty() || !cv::checkRange(H_new_to_pano)) return pano;
-
-        // RANSAC CSV (avg reprojection error on inliers)
-        auto reprojAvg = [&](const std::vector<cv::Point2f>& P, const std::vector<cv::Point2f>& Q, const std::vector<unsigned char>& m, const cv::Mat& H){
-            double s=0.0; int c=0; for(size_t t=0;t<P.size();++t){ if(!m[t]) continue; cv::Vec3d ph(P[t].x,P[t].y,1.0); cv::Vec3d q = cv::Mat(H*cv::Mat(ph)); double wx=q[0]/q[2]; double wy=q[1]/q[2]; double dx=wx-Q[t].x, dy=wy-Q[t].y; s+=std::sqrt(dx*dx+dy*dy); ++c;} return c>0 ? s/c : 0.0; };
-        double ransac_ms = std::chrono::duration<double, std::milli>(t_r1 - t_r0).count();
-        int inliers = use_n2p ? in_n2p : in_p2n;
-        double inlier_ratio = (good.empty()? 0.0 : static_cast<double>(inliers)/static_cast<double>(good.size()));
-        double avg_err = use_n2p ? reprojAvg(dstPts, srcPts, mask_n2p, H_n2p) : reprojAvg(srcPts, dstPts, mask_p2n, H_p2n);
-        // H flatten
-        double h00=H_new_to_pano.at<double>(0,0), h01=H_new_to_pano.at<double>(0,1), h02=H_new_to_pano.at<double>(0,2);
-        double h10=H_new_to_pano.at<double>(1,0), h11=H_new_to_pano.at<double>(1,1), h12=H_new_to_pano.at<double>(1,2);
-        double h20=H_new_to_pano.at<double>(2,0), h21=H_new_to_pano.at<double>(2,1), h22=H_new_to_pano.at<double>(2,2);
-        const std::string rHead = "run_id,detector,thresh_px,iters,inliers,inlier_ratio,ransac_time_ms,avg_reproj_error_px,h00,h01,h02,h10,h11,h12,h20,h21,h22";
-        std::snprintf(rowbuf, sizeof(rowbuf), "%s,%s,%.3f,%d,%d,%.6f,%.3f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f",
-                      run_id.c_str(), toString(detector).c_str(), reprojThresh, ransacIter, inliers, inlier_ratio, ransac_ms, avg_err,
-                      h00,h01,h02,h10,h11,h12,h20,h21,h22);
-        writeCsvRow(outDir + "/ransac.csv", rHead, rowbuf);
-
-        if (debug) {
-            const auto& maskUse = use_n2p ? mask_n2p : mask_p2n;
-            std::vector<cv::DMatch> dmIn;
-            std::vector<cv::KeyPoint> a_in, b_in; a_in.reserve(maskUse.size()); b_in.reserve(maskUse.size());
-            for (size_t t = 0; t < maskUse.size(); ++t) {
-                if (maskUse[t]) {
-                    a_in.push_back(a.kps[good[t].queryIdx]);
-                    b_in.push_back(b.kps[good[t].trainIdx]);
-                    dmIn.emplace_back(static_cast<int>(a_in.size()-1), static_cast<int>(b_in.size()-1), 0.f);
-                }
-            }
-            if (!a_in.empty()) {
-                // Dense inliers image
-                cv::Mat inlierImg;
-                cv::drawMatches(pano, a_in, imgs[i], b_in, dmIn, inlierImg);
-                snprintf(namebuf, sizeof(namebuf), "%s/inliers_%zu.jpg", vizRoot.c_str(), i);
-                cv::imwrite(namebuf, inlierImg);
-
-                // Annotated inliers (limit topN)
-                auto colorFromIndex = [](int idx){
-                    int hue = (idx * 37) % 180; cv::Mat hsv(1,1,CV_8UC3, cv::Vec3b((uchar)hue, 200, 255));
-                    cv::Mat bgr; cv::cvtColor(hsv, bgr, cv::COLOR_HSV2BGR); cv::Vec3b c = bgr.at<cv::Vec3b>(0,0);
-                    return cv::Scalar(c[0], c[1], c[2]);
-                };
-                int H = std::max(pano.rows, imgs[i].rows);
-                int W = pano.cols + imgs[i].cols;
-                cv::Mat anno(H, W, CV_8UC3, cv::Scalar::all(0));
-                pano.copyTo(anno(cv::Rect(0, 0, pano.cols, pano.rows)));
-                imgs[i].copyTo(anno(cv::Rect(pano.cols, 0, imgs[i].cols, imgs[i].rows)));
-                int xOffset = pano.cols;
-                int topN = std::min<int>(static_cast<int>(a_in.size()), 150);
-                for (int t = 0; t < topN; ++t) {
-                    cv::Point p(cvRound(a_in[t].pt.x), cvRound(a_in[t].pt.y));
-                    cv::Point q(cvRound(b_in[t].pt.x) + xOffset, cvRound(b_in[t].pt.y));
-                    cv::Scalar col = colorFromIndex(t);
-                    cv::circle(anno, p, 4, col, 2, cv::LINE_AA);
-                    cv::circle(anno, q, 4, col, 2, cv::LINE_AA);
-                    cv::line(anno, p, q, col, 1, cv::LINE_AA);
-                    char txt[16]; std::snprintf(txt, sizeof(txt), "%d", t+1);
-                    cv::putText(anno, txt, p + cv::Point(5,-5), cv::FONT_HERSHEY_SIMPLEX, 0.45, col, 1, cv::LINE_AA);
-                    cv::putText(anno, txt, q + cv::Point(5,-5), cv::FONT_HERSHEY_SIMPLEX, 0.45, col, 1, cv::LINE_AA);
-                }
-                snprintf(namebuf, sizeof(namebuf), "%s/inliers_annotated_%zu.jpg", vizRoot.c_str(), i);
-                cv::imwrite(namebuf, anno);
-            }
-        }
-
-        // Compute dynamic canvas by transforming corners
-        std::vector<cv::Point2f> panoCorners = {
-            cv::Point2f(0, 0),
-            cv::Point2f(static_cast<float>(pano.cols), 0),
-            cv::Point2f(static_cast<float>(pano.cols), static_cast<float>(pano.rows)),
-            cv::Point2f(0, static_cast<float>(pano.rows))
-        };
-
-        std::vector<cv::Point2f> imgCorners = {
-            cv::Point2f(0, 0),
-            cv::Point2f(static_cast<float>(imgs[i].cols), 0),
-            cv::Point2f(static_cast<float>(imgs[i].cols), static_cast<float>(imgs[i].rows)),
-            cv::Point2f(0, static_cast<float>(imgs[i].rows))
-        };
-
-        // H maps pano -> img; we need new->pano for corner transform
-        // H_new_to_pano chosen above
-        std::vector<cv::Point2f> imgCornersWarped;
-        cv::perspectiveTransform(imgCorners, imgCornersWarped, H_new_to_pano);
-
-        float minX = 0.f, minY = 0.f, maxX = static_cast<float>(pano.cols), maxY = static_cast<float>(pano.rows);
-        for (const auto& p : imgCornersWarped) {
-            minX = std::min(minX, p.x);
-            minY = std::min(minY, p.y);
-            maxX = std::max(maxX, p.x);
-            maxY = std::max(maxY, p.y);
-        }
-
-        int tx = (minX < 0.f) ? static_cast<int>(std::floor(-minX)) : 0;
-        int ty = (minY < 0.f) ? static_cast<int>(std::floor(-minY)) : 0;
-        int outW = static_cast<int>(std::ceil(maxX + tx));
-        int outH = static_cast<int>(std::ceil(maxY + ty));
-
-        // Compose translation so that everything is positive in the canvas
-        cv::Mat T = (cv::Mat_<double>(3,3) << 1, 0, tx, 0, 1, ty, 0, 0, 1);
-        cv::Mat G = T * H_new_to_pano; // pass G; warper will invert internally
-
-        std::cout << "  Warp new image... outW=" << outW << ", outH=" << outH << std::endl;
-        auto t_w0 = std::chrono::high_resolution_clock::now();
-        cv::Mat warped = warpPerspectiveCustom(imgs[i], G, cv::Size(outW, outH));
-        auto t_w1 = std::chrono::high_resolution_clock::now();
-
-        cv::Mat canvas(outH, outW, CV_8UC3, cv::Scalar::all(0));
-        pano.copyTo(canvas(cv::Rect(tx, ty, pano.cols, pano.rows)));
-
-        // Mask for blending
-        cv::Mat nonzeroGray, mask;
-        cv::cvtColor(warped, nonzeroGray, cv::COLOR_BGR2GRAY);
-        cv::threshold(nonzeroGray, mask, 1, 255, cv::THRESH_BINARY);
-
-        cv::Mat blended;
-        double warp_ms = std::chrono::duration<double, std::milli>(t_w1 - t_w0).count();
-        double blend_ms = 0.0;
-        if (blendMode == BlendMode::OVERLAY) {
-            auto t_b0 = std::chrono::high_resolution_clock::now();
-            blended = blendOverlay(canvas, warped, mask);
-            auto t_b1 = std::chrono::high_resolution_clock::now();
-            blend_ms = std::chrono::duration<double, std::milli>(t_b1 - t_b0).count();
+    StitchContext ctx{imgs, detector, blendMode, ransacIter, reprojThresh, ratio, debug && files, opts};
+    ctx.logFiles = files;
+    ctx.verbose = files;
+    ctx.report = opts.report;
+    if (ctx.report) {
+        *ctx.report = StitchReport();
+        ctx.report->images.resize(imgs.size());
+    }
+    ctx.outDir = outDir;
+    ctx.vizRoot = vizRoot;
+    ctx.runId = outDir.substr(outDir.find_last_of('/')+1);
+    ctx.outSym = metrics().intern(outDir);
+    ctx.csvDir = opts.csvDir.empty() ? ctx.outSym : metrics().intern(opts.csvDir);
+    ctx.runSym = metrics().intern(ctx.runId);
+    ctx.detectorSym = metrics().intern(toString(detector));
+    ctx.toRef.resize(imgs.size());
+    std::unique_ptr<ThreadPool> ownPool;
+    if (!opts.pool) ownPool = std::make_unique<ThreadPool>(opts.threads);
+    ThreadPool& pool = opts.pool ? *opts.pool : *ownPool;
+    std::unique_ptr<FeatureCache> featureCache;
+    if (opts.featureCache) {
+        ctx.featureCache = opts.featureCache;
+    } else if (!opts.featureCacheDir.empty()) {
+        featureCache = std::make_unique<FeatureCache>(opts.featureCacheDir);
+        ctx.featureCache = featureCache.get();
+    }
+    // Drained when ctx goes out of scope, after compositing
+    if (ctx.debug) ctx.viz = std::make_unique<DebugVizWriter>(vizRoot, opts.vizThreads, opts.vizScale);
+
+    // Registration runs on a megapixel budget, compositing at its own scale
+    ctx.workScale = scaleForBudget(imgs[0].size(), opts.workMegapix);
+    ctx.composeScale = scaleForBudget(imgs[0].size(), opts.composeMegapix);
+    ctx.imgs = resizeAll(imgs, ctx.workScale, pool);
+    ctx.composeImgs = resizeAll(imgs, ctx.composeScale, pool);
+    if (ctx.verbose) std::cout << "work scale=" << ctx.workScale << ", compose scale=" << ctx.composeScale << std::endl;
+
+    if (opts.overlapPrepass && imgs.size() > 1) prepassOverlaps(ctx, pool);
+
+    // Feature + alignment phase; the pipelined path also warps while it aligns
+    std::vector<WarpedTile> tiles;
+    if (opts.unordered) {
+        extractAll(ctx, pool);
+        alignUnordered(ctx, pool);
+    } else if (opts.pipelined) {
+        // Whole-image tiles would defeat bounded-memory streaming, so they are skipped for it too
+        const bool finalWhileAligning = !opts.bundleAdjust && !opts.refineFullRes &&
+                                        opts.tiffPath.empty() && opts.dziPath.empty();
+        alignPipelined(ctx, finalWhileAligning ? &tiles : nullptr);
+    } else {
+        extractAll(ctx, pool);
+        alignSequential(ctx);
+    }
+    if (opts.bundleAdjust && ctx.order.size() > 1)
+        runBundleAdjustment(ctx, ctx.toRef, ctx.corrs, reprojThresh, "work", pool);
+
+    // Transforms from work scale to input resolution, optionally refined there
+    std::vector<cv::Mat> toRefFull(ctx.toRef.size());
+    for (size_t i = 0; i < toRefFull.size(); ++i) toRefFull[i] = rescaleHomography(ctx.toRef[i], 1.0 / ctx.workScale);
+    if (opts.refineFullRes && ctx.order.size() > 1) refineFullResolution(ctx, imgs, toRefFull, pool);
+    const auto tAligned = std::chrono::steady_clock::now();
+
+    // Compositing phase: one canvas, every image warped and blended exactly once
+    std::vector<cv::Mat> placedImgs, placedToRef;
+    for (int idx : ctx.order) {
+        placedImgs.push_back(ctx.composeImgs[idx]);
+        placedToRef.push_back(rescaleHomography(toRefFull[idx], ctx.composeScale));
+    }
+    if (ctx.verbose) std::cout << "Compose " << placedImgs.size() << " images..." << std::endl;
+    // In-memory compositing holds canvas, coverage and, for feathering, float accumulators
+    const double inMemoryBytes = static_cast<double>(panoramaBounds(placedImgs, placedToRef).area()) *
+                                 (blendMode == BlendMode::FEATHER ? 20.0 : 4.0);
+    const double budget = opts.canvasBudgetMB > 0 ? opts.canvasBudgetMB * 1e6 : 0.5 * physicalMemoryBytes();
+    const bool useMapped = opts.mappedCanvas || (budget > 0 && inMemoryBytes > budget);
+    std::vector<ComposeStats> cstats;
+    cv::Mat pano;
+    cv::Size panoSize;
+    cv::Rect content; // set when the canvas tracked its own content bounds
+    {
+        VC_TRACE_SCOPE("compose");
+        if (!opts.tiffPath.empty()) {
+            // Streaming outputs: bands go straight to the files, nothing is returned or cropped
+            BigTiffWriter tiff(opts.tiffPath, opts.tiffCompression, &pool);
+            composeToSink(placedImgs, placedToRef, blendMode, tiff, pool, opts.bandRows, &cstats);
+            panoSize = panoramaBounds(placedImgs, placedToRef).size();
+            if (ctx.verbose) std::cout << "Saved: " << opts.tiffPath << " (" << tiff.bytesWritten() << " bytes)" << std::endl;
+        } else if (!opts.dziPath.empty()) {
+            DeepZoomWriter dzi(opts.dziPath, pool, opts.dziTileSize, 1, opts.dziFormat);
+            composeToSink(placedImgs, placedToRef, blendMode, dzi, pool, opts.bandRows, &cstats);
+            panoSize = panoramaBounds(placedImgs, placedToRef).size();
+            if (ctx.verbose) std::cout << "Saved: " << opts.dziPath << ".dzi (" << dzi.tilesWritten() << " tiles)" << std::endl;
+        } else if (useMapped) {
+            // Bands composited in memory, the canvas itself paged by the kernel
+            if (ctx.verbose) std::cout << "Canvas exceeds the memory budget: using a file-backed canvas" << std::endl;
+            // Without a run directory the backing file goes to the temp directory; allocateMapped
+            // makes the name unique
+            const std::string canvasPath = files ? outDir + "/canvas.map" :
+                (std::filesystem::temp_directory_path() / "vc_canvas.map").string();
+            MappedCanvas canvas(canvasPath);
+            composeToSink(placedImgs, placedToRef, blendMode, canvas, pool, opts.bandRows, &cstats);
+            pano = canvas.mat();
+            panoSize = pano.size();
+            content = canvas.contentBounds();
         } else {
-            // Robust feathering: weights from distance transforms of both masks
-            cv::Mat maskBase = cv::Mat::zeros(canvas.size(), CV_8U);
-            cv::rectangle(maskBase, cv::Rect(tx, ty, pano.cols, pano.rows), cv::Scalar(255), cv::FILLED);
-
-            cv::Mat dtTop, dtBase;
-            cv::distanceTransform(mask, dtTop, cv::DIST_L2, 3);
-            cv::distanceTransform(maskBase, dtBase, cv::DIST_L2, 3);
-
-            cv::Mat wTop, wBase, denom;
-            dtTop.convertTo(wTop, CV_32F);
-            dtBase.convertTo(wBase, CV_32F);
-            denom = wTop + wBase + 1e-6f;
-            cv::divide(wTop, denom, wTop);
-            // wBase = 1 - wTop
-            wBase = 1.0f - wTop;
-
-            cv::Mat baseF, topF;
-            canvas.convertTo(baseF, CV_32F, 1.0/255.0);
-            warped.convertTo(topF, CV_32F, 1.0/255.0);
-
-            std::vector<cv::Mat> bc, tc, oc;
-            cv::split(baseF, bc);
-            cv::split(topF, tc);
-            oc.resize(3);
-            auto t_b0 = std::chrono::high_resolution_clock::now();
-            for (int c = 0; c < 3; ++c) oc[c] = bc[c].mul(wBase) + tc[c].mul(wTop);
-            cv::Mat outF; cv::merge(oc, outF);
-            outF.convertTo(blended, CV_8U, 255.0);
-            auto t_b1 = std::chrono::high_resolution_clock::now();
-            blend_ms = std::chrono::duration<double, std::milli>(t_b1 - t_b0).count();
+            pano = tiles.empty() ? composePanorama(placedImgs, placedToRef, blendMode, &cstats,
+                                                   opts.nearestWarp ? Interp::NEAREST : Interp::BILINEAR)
+                                 : composeTiles(tiles, blendMode, &cstats);
+            panoSize = pano.size();
         }
-
-        pano = blended;
-
-        // Seam quality on overlap region
-        double seam_mean = 0.0, seam_max = 0.0;
-        {
-            cv::Mat grayA, grayB; cv::cvtColor(canvas, grayA, cv::COLOR_BGR2GRAY); cv::cvtColor(warped, grayB, cv::COLOR_BGR2GRAY);
-            cv::Mat overlap; cv::bitwise_and(mask, (mask>0), overlap); // mask itself
-            cv::Mat diff;
-            cv::absdiff(grayA, grayB, diff);
-            cv::Scalar meanVal, stdVal; cv::meanStdDev(diff, meanVal, stdVal, overlap);
-            seam_mean = meanVal[0];
-            double minv, maxv; cv::minMaxLoc(diff, &minv, &maxv, nullptr, nullptr, overlap);
-            seam_max = maxv;
+    }
+    // The pool is process-wide: counts are this run's share since it started (concurrent runs
+    // add theirs), the retained bytes are the pool's level now
+    const ScratchStats ss = scratchStats();
+    const size_t scratchHits = ss.hits - scratchStart.hits, scratchMisses = ss.misses - scratchStart.misses;
+    if (ctx.verbose) std::cout << "  scratch buffers reused=" << scratchHits << "/" << (scratchHits + scratchMisses)
+                               << ", pool retains " << ss.retainedBytes / 1e6 << " MB, peak RSS="
+                               << peakRssBytes() / 1e6 << " MB" << std::endl;
+    if (ctx.report) {
+        StitchReport& r = *ctx.report;
+        for (int idx : ctx.order) {
+            r.images[idx].placed = true;
+            r.images[idx].toRef = toRefFull[idx].clone();
         }
-
-        // Stitch CSV row
-        const std::string sHead = "run_id,detector,thresh_px,blending,warp_time_ms,blend_time_ms,seam_error_mean,seam_error_max,out_w,out_h";
-        std::snprintf(rowbuf, sizeof(rowbuf), "%s,%s,%.3f,%s,%.3f,%.3f,%.6f,%.6f,%d,%d",
-                      run_id.c_str(), toString(detector).c_str(), reprojThresh, toString(blendMode).c_str(),
-                      warp_ms, blend_ms, seam_mean, seam_max, pano.cols, pano.rows);
-        writeCsvRow(outDir + "/stitch.csv", sHead, rowbuf);
+        r.order = ctx.order;
+        r.compose = cstats;
+        r.workScale = ctx.workScale;
+        r.composeScale = ctx.composeScale;
+        r.size = panoSize;
+        const auto tComposed = std::chrono::steady_clock::now();
+        r.alignMs = std::chrono::duration<double, std::milli>(tAligned - tStart).count();
+        r.composeMs = std::chrono::duration<double, std::milli>(tComposed - tAligned).count();
     }
-
-    // Auto-crop black borders
-    cv::Mat gray, mask;
-    std::cout << "Auto-crop..." << std::endl;
-    cv::cvtColor(pano, gray, cv::COLOR_BGR2GRAY);
-    cv::threshold(gray, mask, 1, 255, cv::THRESH_BINARY);
-    std::vector<cv::Point> pts; cv::findNonZero(mask, pts);
-    if (!pts.empty()) {
-        cv::Rect roi = cv::boundingRect(pts);
-        pano = pano(roi).clone();
+    const Sym blendSym = files ? metrics().intern(toString(blendMode)) : Sym();
+    for (size_t k = 0; files && k < cstats.size(); ++k) {
+        const ComposeStats& cs = cstats[k];
+        // Stitch row
+        metrics().record(kStitchTable, ctx.csvDir, opts.metricsFormat, ctx.runSym, ctx.detectorSym, reprojThresh, blendSym,
+                         cs.warpMs, cs.blendMs, cs.seamMean, cs.seamMax, panoSize.width, panoSize.height,
+                         cs.warpPerf.cycles, cs.warpPerf.instructions, cs.warpPerf.l1dMisses, cs.warpPerf.llcMisses,
+                         cs.warpPerf.branchMisses, cs.blendPerf.cycles, cs.blendPerf.instructions, cs.blendPerf.l1dMisses,
+                         cs.blendPerf.llcMisses, cs.blendPerf.branchMisses);
     }
 
+    // Auto-crop black borders; a mapped canvas is cropped by header so it is never copied
+    if (useMapped && content.area() > 0) {
+        pano = pano(content);
+    } else if (!pano.empty() && !useMapped) {
+        VC_TRACE_SCOPE("crop");
+        cv::Mat gray, mask;
+        if (ctx.verbose) std::cout << "Auto-crop..." << std::endl;
+        cv::cvtColor(pano, gray, cv::COLOR_BGR2GRAY);
+        cv::threshold(gray, mask, 1, 255, cv::THRESH_BINARY);
+        std::vector<cv::Point> pts; cv::findNonZero(mask, pts);
+        if (!pts.empty()) {
+            cv::Rect roi = cv::boundingRect(pts);
+            pano = pano(roi).clone();
+        }
+    }
+    if (ctx.report) {
+        ctx.report->totalMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - tStart).count();
+        ctx.report->peakRssBytes = peakRssBytes();
+    }
     return pano;
 }
 }
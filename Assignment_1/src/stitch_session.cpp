@@ -0,0 +1,18 @@
+#include "stitch_session.hpp"
+#include "trace.hpp"
+
+namespace vc {
+StitchSession::StitchSession(int threads, const std::string& featureCacheDir) : pool_(threads) {
+    if (!featureCacheDir.empty()) featureCache_ = std::make_unique<FeatureCache>(featureCacheDir);
+}
+
+cv::Mat StitchSession::stitch(const std::vector<cv::Mat>& imgs, const StitchConfig& cfg, StitchReport* report) {
+    VC_TRACE_SCOPE("session stitch");
+    StitchOptions opts = cfg.opts;
+    opts.pool = &pool_;
+    if (featureCache_) opts.featureCache = featureCache_.get();
+    opts.report = report;
+    // Empty run directory: no params.txt, metrics tables or debug images
+    return stitchImages(imgs, cfg.detector, cfg.blend, cfg.ransacIter, cfg.reprojThresh, cfg.ratio, false, "", "", "", opts);
+}
+}
@@ -0,0 +1,84 @@
+#include "thread_pool.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+namespace vc {
+ThreadPool::ThreadPool(int threads) {
+    if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    workers_.reserve(threads);
+    for (int t = 0; t < threads; ++t) workers_.emplace_back([this]{ workerLoop(); });
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& w : workers_) w.join();
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        tasks_.push_back(std::move(task));
+    }
+    cv_.notify_one();
+}
+
+void ThreadPool::workerLoop() {
+    VC_TRACE_THREAD("pool worker");
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lk(mtx_);
+            cv_.wait(lk, [this]{ return stop_ || !tasks_.empty(); });
+            if (stop_ && tasks_.empty()) return;
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+        task();
+    }
+}
+
+void ThreadPool::parallelFor(int n, const std::function<void(int)>& fn) {
+    if (n <= 0) return;
+    if (n == 1) { fn(0); return; }
+    // Shared state outlives this call: helpers that start late only see an exhausted counter
+    struct State {
+        std::function<void(int)> fn;
+        int n = 0;
+        std::atomic<int> next{0};
+        std::atomic<int> done{0};
+        std::mutex m;
+        std::condition_variable cv;
+        std::exception_ptr err;
+    };
+    auto st = std::make_shared<State>();
+    st->fn = fn;
+    st->n = n;
+    auto work = [st]{
+        for (int k = st->next++; k < st->n; k = st->next++) {
+            try {
+                st->fn(k);
+            } catch (...) {
+                std::lock_guard<std::mutex> lk(st->m);
+                if (!st->err) st->err = std::current_exception();
+            }
+            if (++st->done == st->n) {
+                std::lock_guard<std::mutex> lk(st->m);
+                st->cv.notify_all();
+            }
+        }
+    };
+    const int helpers = std::min(n - 1, size());
+    for (int h = 0; h < helpers; ++h) submit(work);
+    work();
+    std::unique_lock<std::mutex> lk(st->m);
+    st->cv.wait(lk, [&]{ return st->done.load() == st->n; });
+    if (st->err) std::rethrow_exception(st->err);
+}
+}
@@ -0,0 +1,254 @@
+#include "tiff_writer.hpp"
+#include "trace.hpp"
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+#ifdef VC_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace vc {
+namespace {
+// TIFF tag types
+constexpr std::uint16_t kShort = 3, kLong = 4, kLong8 = 16;
+
+void appendLE(std::vector<std::uint8_t>& out, std::uint64_t v, int bytes) {
+    for (int b = 0; b < bytes; ++b) out.push_back(static_cast<std::uint8_t>(v >> (8 * b)));
+}
+
+// MSB-first bit packing as TIFF LZW expects
+class BitWriter {
+public:
+    explicit BitWriter(std::vector<std::uint8_t>& out) : out_(out) {}
+    void put(int code, int width) {
+        acc_ = (acc_ << width) | static_cast<std::uint32_t>(code);
+        bits_ += width;
+        while (bits_ >= 8) { out_.push_back(static_cast<std::uint8_t>(acc_ >> (bits_ - 8))); bits_ -= 8; }
+        acc_ &= (1u << bits_) - 1;
+    }
+    void flush() {
+        if (bits_ > 0) out_.push_back(static_cast<std::uint8_t>(acc_ << (8 - bits_)));
+        acc_ = 0; bits_ = 0;
+    }
+private:
+    std::vector<std::uint8_t>& out_;
+    std::uint32_t acc_ = 0;
+    int bits_ = 0;
+};
+
+// TIFF LZW: 9..12 bit codes with the "early change" width switch, a ClearCode before the
+// table overflows and an EndOfInformation code at the end of every strip
+void lzwEncode(const std::uint8_t* data, std::size_t n, std::vector<std::uint8_t>& out) {
+    constexpr int kClear = 256, kEoi = 257, kFirst = 258, kTableEnd = 4094;
+    constexpr std::size_t kHashSize = 1 << 14, kHashMask = kHashSize - 1;
+    std::vector<std::int32_t> keys(kHashSize, -1);
+    std::vector<std::uint16_t> codes(kHashSize);
+    BitWriter bw(out);
+    int width = 9, next = kFirst;
+    bw.put(kClear, width);
+    if (n == 0) { bw.put(kEoi, width); bw.flush(); return; }
+
+    int w = data[0];
+    for (std::size_t k = 1; k < n; ++k) {
+        const int c = data[k];
+        const std::int32_t key = (w << 8) | c;
+        std::size_t h = (static_cast<std::uint32_t>(key) * 2654435761u >> 8) & kHashMask;
+        while (keys[h] != -1 && keys[h] != key) h = (h + 1) & kHashMask;
+        if (keys[h] == key) { w = codes[h]; continue; }
+        bw.put(w, width);
+        if (next < kTableEnd) {
+            keys[h] = key;
+            codes[h] = static_cast<std::uint16_t>(next++);
+            if (next >= (1 << width) && width < 12) ++width;
+        } else {
+            bw.put(kClear, width);
+            std::fill(keys.begin(), keys.end(), -1);
+            next = kFirst; width = 9;
+        }
+        w = c;
+    }
+    bw.put(w, width);
+    // The decoder adds one more entry after the last code before it reads EOI
+    if (++next >= (1 << width) && width < 12) ++width;
+    bw.put(kEoi, width);
+    bw.flush();
+}
+}
+
+BigTiffWriter::BigTiffWriter(const std::string& path, TiffCompression compression, ThreadPool* pool,
+                             int rowsPerStrip)
+    : path_(path), compression_(compression), pool_(pool), rowsPerStrip_(std::max(1, rowsPerStrip)) {
+#ifndef VC_HAVE_ZLIB
+    if (compression_ == TiffCompression::DEFLATE) {
+        std::cerr << "BigTiffWriter: built without zlib, using LZW instead of deflate" << std::endl;
+        compression_ = TiffCompression::LZW;
+    }
+#endif
+}
+
+BigTiffWriter::~BigTiffWriter() {
+    bands_.close();
+    if (worker_.joinable()) worker_.join();
+    if (file_) std::fclose(file_);
+}
+
+void BigTiffWriter::begin(cv::Size size) {
+    CV_Assert(size.width > 0 && size.height > 0 && !file_);
+    size_ = size;
+    file_ = std::fopen(path_.c_str(), "wb");
+    if (!file_) throw std::runtime_error("BigTiffWriter: cannot open " + path_);
+    // Little-endian BigTIFF header; the first IFD offset is patched in finish()
+    std::vector<std::uint8_t> hdr = {'I', 'I'};
+    appendLE(hdr, 43, 2); appendLE(hdr, 8, 2); appendLE(hdr, 0, 2); appendLE(hdr, 0, 8);
+    writeBytes(hdr.data(), hdr.size());
+    worker_ = std::thread(&BigTiffWriter::run, this);
+}
+
+void BigTiffWriter::writeBand(int y, const cv::Mat& band) {
+    CV_Assert(file_ && band.type() == CV_8UC3 && band.cols == size_.width && y == nextRow_);
+    nextRow_ += band.rows;
+    bands_.push(band); // false once the writer failed; finish() reports why
+}
+
+void BigTiffWriter::finish() {
+    bands_.close();
+    if (worker_.joinable()) worker_.join();
+    if (error_) std::rethrow_exception(error_);
+    if (nextRow_ != size_.height) throw std::runtime_error("BigTiffWriter: incomplete image " + path_);
+    writeIfd();
+    if (std::fclose(file_) != 0) { file_ = nullptr; throw std::runtime_error("BigTiffWriter: close failed " + path_); }
+    file_ = nullptr;
+}
+
+void BigTiffWriter::run() {
+    VC_TRACE_THREAD("tiff writer");
+    try {
+        const std::size_t rowBytes = static_cast<std::size_t>(size_.width) * 3;
+        cv::Mat band;
+        while (bands_.pop(band)) {
+            VC_TRACE_SCOPE("tiff band");
+            const std::size_t old = pending_.size();
+            pending_.resize(old + rowBytes * band.rows);
+            for (int r = 0; r < band.rows; ++r) {
+                const std::uint8_t* s = band.ptr<std::uint8_t>(r);
+                std::uint8_t* d = &pending_[old + r * rowBytes];
+                for (int x = 0; x < size_.width; ++x) {
+                    d[3*x] = s[3*x+2]; d[3*x+1] = s[3*x+1]; d[3*x+2] = s[3*x];
+                }
+            }
+            band.release();
+            flushStrips(false);
+        }
+        flushStrips(true);
+    } catch (...) {
+        error_ = std::current_exception();
+        bands_.close();
+    }
+}
+
+// Encodes every complete strip of pending_ (and the short tail when last) and appends them in order
+void BigTiffWriter::flushStrips(bool last) {
+    const std::size_t rowBytes = static_cast<std::size_t>(size_.width) * 3;
+    const int rows = static_cast<int>(pending_.size() / rowBytes);
+    int strips = rows / rowsPerStrip_;
+    if (last && rows % rowsPerStrip_ != 0) ++strips;
+    if (strips == 0) return;
+
+    std::vector<std::vector<std::uint8_t>> encoded(strips);
+    auto encode = [&](int s) {
+        const int r0 = s * rowsPerStrip_;
+        encoded[s] = encodeStrip(&pending_[r0 * rowBytes], std::min(rowsPerStrip_, rows - r0));
+    };
+    if (pool_) pool_->parallelFor(strips, encode);
+    else for (int s = 0; s < strips; ++s) encode(s);
+
+    for (const auto& e : encoded) {
+        stripOffsets_.push_back(fileOffset_);
+        stripBytes_.push_back(e.size());
+        writeBytes(e.data(), e.size());
+    }
+    const std::size_t consumed = std::min<std::size_t>(rows, static_cast<std::size_t>(strips) * rowsPerStrip_) * rowBytes;
+    pending_.erase(pending_.begin(), pending_.begin() + consumed);
+}
+
+std::vector<std::uint8_t> BigTiffWriter::encodeStrip(const std::uint8_t* rgb, int rows) const {
+    const std::size_t rowBytes = static_cast<std::size_t>(size_.width) * 3;
+    std::vector<std::uint8_t> raw(rgb, rgb + rowBytes * rows);
+    if (compression_ == TiffCompression::NONE) return raw;
+
+    // Horizontal differencing (Predictor 2) makes photographic rows far more compressible
+    for (int r = 0; r < rows; ++r) {
+        std::uint8_t* p = &raw[r * rowBytes];
+        for (std::size_t k = rowBytes - 1; k >= 3; --k) p[k] = static_cast<std::uint8_t>(p[k] - p[k-3]);
+    }
+    std::vector<std::uint8_t> out;
+#ifdef VC_HAVE_ZLIB
+    if (compression_ == TiffCompression::DEFLATE) {
+        uLongf len = compressBound(static_cast<uLong>(raw.size()));
+        out.resize(len);
+        if (compress2(out.data(), &len, raw.data(), static_cast<uLong>(raw.size()), 6) != Z_OK)
+            throw std::runtime_error("BigTiffWriter: deflate failed");
+        out.resize(len);
+        return out;
+    }
+#endif
+    out.reserve(raw.size() / 2);
+    lzwEncode(raw.data(), raw.size(), out);
+    return out;
+}
+
+void BigTiffWriter::writeBytes(const void* data, std::size_t n) {
+    if (n > 0 && std::fwrite(data, 1, n, file_) != n)
+        throw std::runtime_error("BigTiffWriter: write failed " + path_);
+    fileOffset_ += n;
+}
+
+void BigTiffWriter::writeIfd() {
+    std::vector<std::uint8_t> buf;
+    if (fileOffset_ % 8) { buf.assign(8 - fileOffset_ % 8, 0); writeBytes(buf.data(), buf.size()); }
+
+    // Strip arrays that do not fit into an entry's 8 value bytes go right before the IFD
+    const std::uint64_t strips = stripOffsets_.size();
+    std::uint64_t offsetsAt = stripOffsets_.empty() ? 0 : stripOffsets_[0];
+    std::uint64_t bytesAt = stripBytes_.empty() ? 0 : stripBytes_[0];
+    if (strips > 1) {
+        buf.clear();
+        offsetsAt = fileOffset_;
+        for (auto v : stripOffsets_) appendLE(buf, v, 8);
+        bytesAt = fileOffset_ + buf.size();
+        for (auto v : stripBytes_) appendLE(buf, v, 8);
+        writeBytes(buf.data(), buf.size());
+    }
+
+    const std::uint16_t compressionTag = compression_ == TiffCompression::NONE ? 1
+                                       : compression_ == TiffCompression::LZW ? 5 : 8;
+    struct Entry { std::uint16_t tag, type; std::uint64_t count, value; };
+    std::vector<Entry> entries = {
+        {256, kLong, 1, static_cast<std::uint64_t>(size_.width)},   // ImageWidth
+        {257, kLong, 1, static_cast<std::uint64_t>(size_.height)},  // ImageLength
+        {258, kShort, 3, 8ull | (8ull << 16) | (8ull << 32)},      // BitsPerSample
+        {259, kShort, 1, compressionTag},                           // Compression
+        {262, kShort, 1, 2},                                        // PhotometricInterpretation = RGB
+        {273, kLong8, strips, offsetsAt},                           // StripOffsets
+        {277, kShort, 1, 3},                                        // SamplesPerPixel
+        {278, kLong, 1, static_cast<std::uint64_t>(rowsPerStrip_)}, // RowsPerStrip
+        {279, kLong8, strips, bytesAt},                             // StripByteCounts
+        {284, kShort, 1, 1},                                        // PlanarConfiguration = chunky
+    };
+    if (compression_ != TiffCompression::NONE) entries.push_back({317, kShort, 1, 2}); // Predictor
+
+    buf.clear();
+    const std::uint64_t ifdAt = fileOffset_;
+    appendLE(buf, entries.size(), 8);
+    for (const auto& e : entries) {
+        appendLE(buf, e.tag, 2); appendLE(buf, e.type, 2); appendLE(buf, e.count, 8); appendLE(buf, e.value, 8);
+    }
+    appendLE(buf, 0, 8); // no further IFD
+    writeBytes(buf.data(), buf.size());
+
+    buf.clear();
+    appendLE(buf, ifdAt, 8);
+    if (std::fseek(file_, 8, SEEK_SET) != 0 || std::fwrite(buf.data(), 1, 8, file_) != 8)
+        throw std::runtime_error("BigTiffWriter: cannot patch header " + path_);
+}
+}
@@ -0,0 +1,108 @@
+#include "trace.hpp"
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace vc {
+namespace trace {
+std::atomic<bool> active{false};
+
+namespace {
+struct Event { const char* name; int64_t beginNs, endNs; };
+
+// Events of one thread. Kept alive by the registry after the thread exits; the lock is only
+// ever contended while write() copies the events out.
+struct ThreadBuffer {
+    int tid = 0;
+    std::string name;
+    std::vector<Event> events;
+    std::mutex mtx;
+};
+
+struct Registry {
+    std::mutex mtx;
+    std::vector<std::shared_ptr<ThreadBuffer>> threads;
+    int64_t originNs = 0;
+};
+
+Registry& registry() {
+    static Registry r;
+    return r;
+}
+
+ThreadBuffer& localBuffer() {
+    thread_local std::shared_ptr<ThreadBuffer> buf;
+    if (!buf) {
+        buf = std::make_shared<ThreadBuffer>();
+        buf->events.reserve(1024);
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lk(r.mtx);
+        buf->tid = static_cast<int>(r.threads.size()) + 1;
+        r.threads.push_back(buf);
+    }
+    return *buf;
+}
+
+void jsonString(std::FILE* f, const std::string& s) {
+    std::fputc('"', f);
+    for (char c : s) {
+        if (c == '"' || c == '\\') std::fputc('\\', f);
+        if (static_cast<unsigned char>(c) >= 0x20) std::fputc(c, f);
+    }
+    std::fputc('"', f);
+}
+}
+
+void start() {
+    Registry& r = registry();
+    {
+        std::lock_guard<std::mutex> lk(r.mtx);
+        if (r.originNs == 0) r.originNs = nowNs();
+    }
+    active.store(true, std::memory_order_relaxed);
+}
+
+void setThreadName(const char* name) {
+    ThreadBuffer& b = localBuffer();
+    std::lock_guard<std::mutex> lk(b.mtx);
+    b.name = name;
+}
+
+void record(const char* name, int64_t beginNs, int64_t endNs) {
+    ThreadBuffer& b = localBuffer();
+    std::lock_guard<std::mutex> lk(b.mtx);
+    b.events.push_back({name, beginNs, endNs});
+}
+
+bool write(const std::string& path) {
+    Registry& r = registry();
+    std::vector<std::shared_ptr<ThreadBuffer>> threads;
+    int64_t originNs;
+    {
+        std::lock_guard<std::mutex> lk(r.mtx);
+        threads = r.threads;
+        originNs = r.originNs;
+    }
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+    if (!f) return false;
+    // Complete events ("X"): nesting on a thread follows from the timestamps (microseconds)
+    std::fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    std::fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"panorama\"}}");
+    for (const auto& t : threads) {
+        std::lock_guard<std::mutex> lk(t->mtx);
+        std::fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", t->tid);
+        jsonString(f, t->name.empty() ? "thread " + std::to_string(t->tid) : t->name);
+        std::fprintf(f, "}}");
+        for (const auto& e : t->events) {
+            std::fprintf(f, ",\n{\"name\":");
+            jsonString(f, e.name);
+            std::fprintf(f, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                         t->tid, (e.beginNs - originNs) * 1e-3, (e.endNs - e.beginNs) * 1e-3);
+        }
+    }
+    std::fprintf(f, "\n]}\n");
+    return std::fclose(f) == 0;
+}
+}
+}
@@ -0,0 +1,171 @@
+#include "video.hpp"
+#include "bounded_queue.hpp"
+#include "preprocess.hpp"
+#include "trace.hpp"
+#include <opencv2/calib3d.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/video/tracking.hpp>
+#include <opencv2/videoio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <fstream>
+#include <thread>
+
+namespace vc {
+namespace {
+using Clock = std::chrono::high_resolution_clock;
+
+struct Frame {
+    int index = -1;
+    cv::Mat image;   // full resolution
+    cv::Mat gray;    // tracking resolution
+    double overlap = 1.0;
+    int tracked = 0;
+};
+
+// Fewer surviving corners than this and the similarity fit is not trusted
+constexpr int kMinTracked = 20;
+// The last frame becomes a keyframe only below this overlap; above it, it adds almost no new content
+constexpr double kMaxTailOverlap = 0.95;
+
+// Area of the keyframe, mapped by A into the current frame, that lies inside it, over the frame area
+double overlapFraction(const cv::Mat& A, cv::Size size) {
+    const float w = static_cast<float>(size.width), h = static_cast<float>(size.height);
+    std::vector<cv::Point2f> rect{{0, 0}, {w, 0}, {w, h}, {0, h}}, warped, inter;
+    cv::transform(rect, warped, A);
+    const double area = cv::intersectConvexConvex(warped, rect, inter);
+    return area / (static_cast<double>(w) * h);
+}
+}
+
+std::vector<Keyframe> selectKeyframes(const std::string& path, const KeyframeOptions& opts,
+                                      KeyframeStats* stats, const std::string& csvPath) {
+    std::vector<Keyframe> keyframes;
+    cv::VideoCapture cap(path);
+    if (!cap.isOpened()) return keyframes;
+    auto t0 = Clock::now();
+    KeyframeStats st;
+
+    // Decoder thread: only every stride-th frame is retrieved, the others are just grabbed
+    BoundedQueue<Frame> decoded(8);
+    std::atomic<bool> stop{false};
+    std::exception_ptr decodeError; // rethrown on the calling thread after the join
+    std::thread decoder([&]{
+        VC_TRACE_THREAD("video decoder");
+        try {
+            const int stride = std::max(1, opts.stride);
+            for (int index = 0; !stop; ++index) {
+                auto d0 = Clock::now();
+                Frame f;
+                f.index = index;
+                bool ok;
+                {
+                    VC_TRACE_SCOPE("decode");
+                    ok = index % stride == 0 ? cap.read(f.image) : cap.grab();
+                }
+                st.decodeMs += std::chrono::duration<double, std::milli>(Clock::now() - d0).count();
+                if (!ok) break;
+                if (f.image.empty()) continue;
+                ++st.frames;
+                if (!decoded.push(std::move(f))) break;
+            }
+        } catch (...) {
+            decodeError = std::current_exception();
+        }
+        decoded.close();
+    });
+
+    // Tracker, on the calling thread
+    Frame kf, candidate; // last keyframe, and the latest frame still overlapping it enough
+    std::vector<cv::Point2f> kfPts, curPts;
+    cv::Mat prevGray;
+    auto emit = [&](const Frame& f) {
+        keyframes.push_back(Keyframe{f.index, f.image, f.overlap, f.tracked});
+        if (opts.maxKeyframes > 0 && static_cast<int>(keyframes.size()) >= opts.maxKeyframes) stop = true;
+    };
+    auto seed = [&](const Frame& f) {
+        kf = f;
+        candidate = f;
+        cv::goodFeaturesToTrack(f.gray, kfPts, opts.maxCorners, 0.01, 8);
+        curPts = kfPts;
+        prevGray = f.gray;
+    };
+    // Moves the tracked corners on to f and returns its overlap with the keyframe
+    auto track = [&](Frame& f) {
+        std::vector<cv::Point2f> next;
+        std::vector<uchar> status;
+        std::vector<float> err;
+        if (!curPts.empty()) cv::calcOpticalFlowPyrLK(prevGray, f.gray, curPts, next, status, err);
+        size_t kept = 0;
+        const cv::Rect bounds(0, 0, f.gray.cols, f.gray.rows);
+        for (size_t k = 0; k < next.size(); ++k) {
+            if (!status[k] || !bounds.contains(cv::Point(next[k]))) continue;
+            kfPts[kept] = kfPts[k];
+            curPts[kept] = next[k];
+            ++kept;
+        }
+        kfPts.resize(kept);
+        curPts.resize(kept);
+        prevGray = f.gray;
+        f.tracked = static_cast<int>(kept);
+        cv::Mat A;
+        if (kept >= static_cast<size_t>(kMinTracked)) A = cv::estimateAffinePartial2D(kfPts, curPts);
+        f.overlap = A.empty() ? 0.0 : overlapFraction(A, f.gray.size());
+        return f.overlap >= opts.minOverlap && f.tracked >= kMinTracked;
+    };
+
+    // A throw while tracking (one bad frame) must not unwind past the joinable decoder
+    struct JoinDecoder {
+        std::thread& t;
+        std::atomic<bool>& stop;
+        BoundedQueue<Frame>& q;
+        ~JoinDecoder() { stop = true; q.close(); if (t.joinable()) t.join(); }
+    } joinDecoder{decoder, stop, decoded};
+
+    Frame f;
+    while (decoded.pop(f)) {
+        if (stop) continue; // drain until the decoder notices
+        auto k0 = Clock::now();
+        const double s = std::min(1.0, opts.trackSide / static_cast<double>(std::max(f.image.cols, f.image.rows)));
+        cv::Mat gray = toGray(f.image);
+        if (s < 1.0) cv::resize(gray, f.gray, cv::Size(), s, s, cv::INTER_AREA);
+        else f.gray = gray;
+
+        if (kf.index < 0) {
+            emit(f);
+            seed(f);
+        } else if (track(f)) {
+            candidate = f;
+        } else {
+            // The last frame still above the threshold becomes the keyframe, and f is tracked from it
+            bool placed = false;
+            if (candidate.index != kf.index) {
+                emit(candidate);
+                seed(candidate);
+                if (track(f)) { candidate = f; placed = true; }
+            }
+            // Too far even from the previous frame (fast motion, lost track): take f as it is
+            if (!placed && !stop) {
+                emit(f);
+                seed(f);
+            }
+        }
+        st.trackMs += std::chrono::duration<double, std::milli>(Clock::now() - k0).count();
+    }
+    decoder.join();
+    if (decodeError) std::rethrow_exception(decodeError);
+    if (!stop && candidate.index != kf.index && candidate.overlap < kMaxTailOverlap) emit(candidate);
+
+    st.wallMs = std::chrono::duration<double, std::milli>(Clock::now() - t0).count();
+    if (stats) *stats = st;
+    if (!csvPath.empty()) {
+        std::ofstream ofs(csvPath);
+        ofs << "keyframe,frame,overlap,tracked_corners\n";
+        for (size_t k = 0; k < keyframes.size(); ++k)
+            ofs << k << "," << keyframes[k].frame << "," << keyframes[k].overlap << "," << keyframes[k].tracked << "\n";
+    }
+    return keyframes;
+}
+}
@@ -1,6 +1,9 @@
 #include "warp.hpp"
+#include "scratch.hpp"
+#include "trace.hpp"
 #include <opencv2/imgproc.hpp>
 #include <opencv2/core.hpp>
+#include <algorithm>
 #include <cmath>
 
 namespace vc {
@@ -26,21 +29,47 @@ static cv::Vec3f bilinearAt(const cv::Mat& src, float x, float y) {
 }
 
 cv::Mat warpPerspectiveCustom(const cv::Mat& src, const cv::Mat& H, cv::Size outSize) {
+    return warpPerspectiveRoi(src, H, cv::Rect(0, 0, outSize.width, outSize.height));
+}
+
+cv::Mat warpPerspectiveRoi(const cv::Mat& src, const cv::Mat& H, const cv::Rect& roi, cv::Mat* weight, Interp interp) {
+    VC_TRACE_SCOPE("warp");
     CV_Assert(src.type() == CV_8UC3);
-    cv::Mat Hinv = H.inv();
-    cv::Mat dst(outSize, CV_8UC3, cv::Scalar::all(0));
+    cv::Mat Hinv;
+    cv::Mat(H.inv()).convertTo(Hinv, CV_64F);
+    const double* h = Hinv.ptr<double>();
+    // Pooled buffers: tiles of similar size reuse memory that is already mapped
+    cv::Mat dst = scratchMat(roi.size(), CV_8UC3);
+    dst.setTo(cv::Scalar::all(0));
+    if (weight) {
+        *weight = scratchMat(roi.size(), CV_32F);
+        weight->setTo(0);
+    }
 
-    for (int y = 0; y < outSize.height; ++y) {
-        for (int x = 0; x < outSize.width; ++x) {
-            cv::Vec3d p(x, y, 1.0);
-            cv::Vec3d q = cv::Mat(Hinv * cv::Mat(p));
-            float sx = static_cast<float>(q[0] / q[2]);
-            float sy = static_cast<float>(q[1] / q[2]);
+    for (int y = 0; y < roi.height; ++y) {
+        cv::Vec3b* drow = dst.ptr<cv::Vec3b>(y);
+        float* wrow = weight ? weight->ptr<float>(y) : nullptr;
+        const double py = y + roi.y;
+        for (int x = 0; x < roi.width; ++x) {
+            const double px = x + roi.x;
+            double qz = h[6]*px + h[7]*py + h[8];
+            float sx = static_cast<float>((h[0]*px + h[1]*py + h[2]) / qz);
+            float sy = static_cast<float>((h[3]*px + h[4]*py + h[5]) / qz);
             if (sx >= -1 && sy >= -1 && sx < src.cols && sy < src.rows) {
-                cv::Vec3f c = bilinearAt(src, sx, sy);
-                dst.at<cv::Vec3b>(y, x) = cv::Vec3b(cv::saturate_cast<uchar>(c[0]),
-                                                    cv::saturate_cast<uchar>(c[1]),
-                                                    cv::saturate_cast<uchar>(c[2]));
+                if (interp == Interp::NEAREST) {
+                    const int nx = std::min(std::max(cvRound(sx), 0), src.cols - 1);
+                    const int ny = std::min(std::max(cvRound(sy), 0), src.rows - 1);
+                    drow[x] = src.at<cv::Vec3b>(ny, nx);
+                } else {
+                    cv::Vec3f c = bilinearAt(src, sx, sy);
+                    drow[x] = cv::Vec3b(cv::saturate_cast<uchar>(c[0]),
+                                        cv::saturate_cast<uchar>(c[1]),
+                                        cv::saturate_cast<uchar>(c[2]));
+                }
+                if (wrow) {
+                    float d = std::min(std::min(sx + 1.f, src.cols - sx), std::min(sy + 1.f, src.rows - sy));
+                    wrow[x] = std::max(d, 1e-3f);
+                }
             }
         }
     }